@@ -26,5 +26,11 @@ ADD: '+' ;
 SUB: '-' ;
 MUL: '*' ;
 DIV: '/' ;
-CELL: [A-Z]+[0-9]+ ;
+// a cell of another sheet is prefixed with the sheet name: Sheet2!A1, 'Q1 2024'!B2;
+// quotes inside a quoted name are doubled
+CELL: (SHEET '!')? [A-Z]+[0-9]+ ;
+fragment SHEET
+        : [A-Za-z_] [A-Za-z0-9_]*
+        | '\'' (~'\'' | '\'\'')+ '\''
+        ;
 WS: [ \t\n\r]+ -> skip ;
\ No newline at end of file
@@ -4,11 +4,20 @@
 #include "FormulaLexer.h"
 #include "FormulaParser.h"
 
+#include <algorithm>
 #include <cassert>
+#include <cctype>
+#include <charconv>
 #include <cmath>
+#include <iterator>
+#include <map>
 #include <memory>
+#include <mutex>
 #include <optional>
 #include <sstream>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
 
 namespace ASTImpl
 {
@@ -77,11 +86,23 @@ namespace ASTImpl
     public:
         virtual ~Expr() = default;
         virtual void Print(std::ostream& out) const = 0;
-        virtual void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const = 0;
-        virtual double Evaluate(CellValue args) const = 0;
+        virtual void DoPrintFormula(FormulaText& out, ExprPrecedence precedence) const = 0;
+        virtual ExprValue Evaluate(CellValue args) const = 0;
         virtual ExprPrecedence GetPrecedence() const = 0;
+        // number of nodes in the subtree rooted at this node
+        virtual size_t GetSize() const = 0;
+        // returns a simplified subtree with the same value; `self` owns this node
+        virtual std::unique_ptr<Expr> Fold(std::unique_ptr<Expr> self) = 0;
+        // deep copy whose cell nodes point to cells[index] of the original ones
+        virtual std::unique_ptr<Expr> Clone(const std::vector<const CellReference*>& cells) const = 0;
+        // value of the node if it is a numeric literal
+        virtual std::optional<double> GetConstant() const
+        {
+            return std::nullopt;
+        }
 
-        void PrintFormula(std::ostream& out, ExprPrecedence parent_precedence,
+        // appends the canonical text of the subtree to out
+        void PrintFormula(FormulaText& out, ExprPrecedence parent_precedence,
             bool right_child = false) const
         {
             auto precedence = GetPrecedence();
@@ -89,14 +110,14 @@ namespace ASTImpl
             bool parens_needed = PRECEDENCE_RULES[parent_precedence][precedence] & mask;
             if (parens_needed)
             {
-                out << '(';
+                out.text += '(';
             }
 
             DoPrintFormula(out, precedence);
 
             if (parens_needed)
             {
-                out << ')';
+                out.text += ')';
             }
         }
     };
@@ -104,6 +125,84 @@ namespace ASTImpl
 
     namespace
     {
+        std::unique_ptr<Expr> FoldExpr(std::unique_ptr<Expr> expr)
+        {
+            Expr* node = expr.get();
+            return node->Fold(std::move(expr));
+        }
+
+        // a name that the lexer accepts without quotes
+        bool IsPlainSheetName(std::string_view name)
+        {
+            auto is_head = [](char c) { return std::isalpha(static_cast<unsigned char>(c)) || c == '_'; };
+            auto is_tail = [](char c) { return std::isalnum(static_cast<unsigned char>(c)) || c == '_'; };
+            return !name.empty() && is_head(name.front()) && std::all_of(name.begin(), name.end(), is_tail);
+        }
+
+        // appends the sheet prefix of a reference to another sheet: Sheet2! or 'Q1 2024'!
+        void AppendSheetPrefix(std::string& out, const std::string& sheet)
+        {
+            if (sheet.empty())
+                return;
+            if (IsPlainSheetName(sheet))
+            {
+                out += sheet;
+            }
+            else
+            {
+                out += '\'';
+                for (char c : sheet)
+                {
+                    if (c == '\'')
+                        out += c;
+                    out += c;
+                }
+                out += '\'';
+            }
+            out += '!';
+        }
+
+        // the sheet name of a CELL token without quotes; the cell name is left in text
+        std::string TakeSheetName(std::string_view& text)
+        {
+            size_t separator = text.rfind('!');
+            if (separator == std::string_view::npos)
+                return {};
+
+            std::string_view prefix = text.substr(0, separator);
+            text.remove_prefix(separator + 1);
+            if (prefix.size() < 2 || prefix.front() != '\'')
+                return std::string(prefix);
+
+            // the lexer guarantees that inner quotes are doubled
+            std::string sheet;
+            for (size_t i = 1; i + 1 < prefix.size(); ++i)
+            {
+                sheet += prefix[i];
+                if (prefix[i] == '\'')
+                    ++i;
+            }
+            return sheet;
+        }
+
+        // appends the name of the cell, or #REF! for a deleted one
+        void PrintCellName(FormulaText& out, const CellReference* cell)
+        {
+            size_t offset = out.text.size();
+            if (cell->pos.IsValid())
+            {
+                AppendSheetPrefix(out.text, cell->sheet);
+                char name[Position::MAX_STRING_LENGTH];
+                out.text.append(name, cell->pos.ToChars(name));
+            }
+            else
+            {
+                out.text += FormulaError(FormulaError::Category::Ref).ToString();
+            }
+            out.cells.push_back({ offset, out.text.size() - offset, cell });
+        }
+
+
         class BinaryOpExpr final : public Expr
         {
         public:
@@ -132,10 +231,10 @@ namespace ASTImpl
                 out << ')';
             }
 
-            void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const override
+            void DoPrintFormula(FormulaText& out, ExprPrecedence precedence) const override
             {
                 lhs_->PrintFormula(out, precedence);
-                out << static_cast<char>(type_);
+                out.text += static_cast<char>(type_);
                 rhs_->PrintFormula(out, precedence, /* right_child = */ true);
             }
 
@@ -158,31 +257,65 @@ namespace ASTImpl
                 }
             }
 
-            double Evaluate(CellValue args) const override
+            size_t GetSize() const override
             {
-                if (type_ == Add && std::isfinite(lhs_->Evaluate(args) + rhs_->Evaluate(args)))
-                {
-                    return lhs_->Evaluate(args) + rhs_->Evaluate(args);
-                }
-                else if (type_ == Subtract && std::isfinite(lhs_->Evaluate(args) - rhs_->Evaluate(args)))
-                {
-                    return lhs_->Evaluate(args) - rhs_->Evaluate(args);
-                }
-                else if (type_ == Multiply && std::isfinite(lhs_->Evaluate(args) * rhs_->Evaluate(args)))
-                {
-                    return lhs_->Evaluate(args) * rhs_->Evaluate(args);
-                }
-                else if (type_ == Divide && std::isfinite(lhs_->Evaluate(args) / rhs_->Evaluate(args)))
+                return 1 + lhs_->GetSize() + rhs_->GetSize();
+            }
+
+            ExprValue Evaluate(CellValue args) const override
+            {
+                const ExprValue lhs = lhs_->Evaluate(args);
+                const double* lhs_value = std::get_if<double>(&lhs);
+                if (!lhs_value)
+                    return lhs;
+
+                const ExprValue rhs = rhs_->Evaluate(args);
+                const double* rhs_value = std::get_if<double>(&rhs);
+                if (!rhs_value)
+                    return rhs;
+
+                double result = Apply(*lhs_value, *rhs_value);
+                if (!std::isfinite(result))
                 {
-                    return lhs_->Evaluate(args) / rhs_->Evaluate(args);
+                    return FormulaError(FormulaError::Category::Div0);
                 }
-                else
+                return result;
+            }
+
+            std::unique_ptr<Expr> Fold(std::unique_ptr<Expr> self) override;
+
+            std::unique_ptr<Expr> Clone(const std::vector<const CellReference*>& cells) const override
+            {
+                return std::make_unique<BinaryOpExpr>(type_, lhs_->Clone(cells), rhs_->Clone(cells));
+            }
+
+        private:
+            double Apply(double lhs, double rhs) const
+            {
+                switch (type_)
                 {
-                    throw FormulaError(FormulaError::Category::Div0);
+                case Add:
+                    return lhs + rhs;
+                case Subtract:
+                    return lhs - rhs;
+                case Multiply:
+                    return lhs * rhs;
+                case Divide:
+                    return lhs / rhs;
                 }
+                assert(false);
+                return 0;
+            }
+
+            // x / c == x * (1 / c) bit for bit when c is a power of two
+            // whose reciprocal is a normal double
+            static bool HasExactReciprocal(double value)
+            {
+                int exponent = 0;
+                double mantissa = std::frexp(value, &exponent);
+                return std::fabs(mantissa) == 0.5 && std::isnormal(1 / value);
             }
 
-        private:
             Type type_;
             std::unique_ptr<Expr> lhs_;
             std::unique_ptr<Expr> rhs_;
@@ -211,9 +344,9 @@ namespace ASTImpl
                 out << ')';
             }
 
-            void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const override
+            void DoPrintFormula(FormulaText& out, ExprPrecedence precedence) const override
             {
-                out << static_cast<char>(type_);
+                out.text += static_cast<char>(type_);
                 operand_->PrintFormula(out, precedence);
             }
 
@@ -221,12 +354,27 @@ namespace ASTImpl
                 return EP_UNARY;
             }
 
-            double Evaluate(CellValue args) const override
+            size_t GetSize() const override
             {
+                return 1 + operand_->GetSize();
+            }
+
+            ExprValue Evaluate(CellValue args) const override
+            {
+                ExprValue value = operand_->Evaluate(args);
                 if (type_ == UnaryMinus)
-                    return -operand_->Evaluate(args);
-                else
-                    return operand_->Evaluate(args);
+                {
+                    if (double* number = std::get_if<double>(&value))
+                        *number = -*number;
+                }
+                return value;
+            }
+
+            std::unique_ptr<Expr> Fold(std::unique_ptr<Expr> self) override;
+
+            std::unique_ptr<Expr> Clone(const std::vector<const CellReference*>& cells) const override
+            {
+                return std::make_unique<UnaryOpExpr>(type_, operand_->Clone(cells));
             }
 
         private:
@@ -238,26 +386,28 @@ namespace ASTImpl
         class CellExpr final : public Expr
         {
         public:
-            explicit CellExpr(const Position* cell)
+            explicit CellExpr(const CellReference* cell)
                 : cell_(cell)
             {
             }
 
             void Print(std::ostream& out) const override
             {
-                if (!cell_->IsValid())
+                if (!cell_->pos.IsValid())
                 {
                     out << FormulaError::Category::Ref;
                 }
                 else
                 {
-                    out << cell_->ToString();
+                    std::string name;
+                    AppendSheetPrefix(name, cell_->sheet);
+                    out << name << cell_->pos.ToString();
                 }
             }
 
-            void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */) const override
+            void DoPrintFormula(FormulaText& out, ExprPrecedence /* precedence */) const override
             {
-                Print(out);
+                PrintCellName(out, cell_);
             }
 
             ExprPrecedence GetPrecedence() const override
@@ -265,13 +415,30 @@ namespace ASTImpl
                 return EP_ATOM;
             }
 
-            double Evaluate(CellValue args) const override
+            size_t GetSize() const override
+            {
+                return 1;
+            }
+
+            ExprValue Evaluate(CellValue args) const override
             {
-                return args(*cell_);
+                if (!cell_->pos.IsValid())
+                    return FormulaError(FormulaError::Category::Ref);
+                return args(cell_->pos, cell_->index);
+            }
+
+            std::unique_ptr<Expr> Fold(std::unique_ptr<Expr> self) override
+            {
+                return self;
+            }
+
+            std::unique_ptr<Expr> Clone(const std::vector<const CellReference*>& cells) const override
+            {
+                return std::make_unique<CellExpr>(cells[cell_->index]);
             }
 
         private:
-            const Position* cell_;
+            const CellReference* cell_;
         };
 
 
@@ -288,9 +455,13 @@ namespace ASTImpl
                 out << value_;
             }
 
-            void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */) const override
+            // shortest representation that parses back to the same double
+            void DoPrintFormula(FormulaText& out, ExprPrecedence /* precedence */) const override
             {
-                out << value_;
+                char buffer[32];
+                auto result = std::to_chars(buffer, buffer + sizeof(buffer), value_);
+                assert(result.ec == std::errc());
+                out.text.append(buffer, result.ptr);
             }
 
             ExprPrecedence GetPrecedence() const override
@@ -298,16 +469,73 @@ namespace ASTImpl
                 return EP_ATOM;
             }
 
-            double Evaluate(CellValue /*args*/) const override
+            size_t GetSize() const override
+            {
+                return 1;
+            }
+
+            ExprValue Evaluate(CellValue /*args*/) const override
+            {
+                return value_;
+            }
+
+            std::unique_ptr<Expr> Fold(std::unique_ptr<Expr> self) override
+            {
+                return self;
+            }
+
+            std::optional<double> GetConstant() const override
             {
                 return value_;
             }
 
+            std::unique_ptr<Expr> Clone(const std::vector<const CellReference*>& /*cells*/) const override
+            {
+                return std::make_unique<NumberExpr>(value_);
+            }
+
         private:
             double value_;
         };
 
 
+        std::unique_ptr<Expr> BinaryOpExpr::Fold(std::unique_ptr<Expr> self)
+        {
+            lhs_ = FoldExpr(std::move(lhs_));
+            rhs_ = FoldExpr(std::move(rhs_));
+
+            auto lhs = lhs_->GetConstant();
+            auto rhs = rhs_->GetConstant();
+            if (lhs && rhs)
+            {
+                // a non-finite result stays in the tree to report #DIV/0! on evaluation
+                double result = Apply(*lhs, *rhs);
+                if (std::isfinite(result))
+                    return std::make_unique<NumberExpr>(result);
+            }
+            else if (type_ == Divide && rhs && HasExactReciprocal(*rhs))
+            {
+                type_ = Multiply;
+                rhs_ = std::make_unique<NumberExpr>(1 / *rhs);
+            }
+            return self;
+        }
+
+        std::unique_ptr<Expr> UnaryOpExpr::Fold(std::unique_ptr<Expr> self)
+        {
+            operand_ = FoldExpr(std::move(operand_));
+
+            if (type_ == UnaryPlus)
+                return std::move(operand_);
+            if (auto value = operand_->GetConstant())
+                return std::make_unique<NumberExpr>(-*value);
+            // the operand has been folded, so a nested unary op is a minus: -(-x) == x
+            if (auto* inner = dynamic_cast<UnaryOpExpr*>(operand_.get()))
+                return std::move(inner->operand_);
+            return self;
+        }
+
+
         class ParseASTListener final : public FormulaBaseListener
         {
         public:
@@ -320,7 +548,7 @@ namespace ASTImpl
                 return root;
             }
 
-            std::forward_list<Position> MoveCells()
+            std::forward_list<CellReference> MoveCells()
             {
                 return std::move(cells_);
             }
@@ -364,13 +592,23 @@ namespace ASTImpl
             void exitCell(FormulaParser::CellContext* ctx) override
             {
                 auto value_str = ctx->CELL()->getSymbol()->getText();
-                auto value = Position::FromString(value_str);
+                std::string_view name = value_str;
+                std::string sheet = TakeSheetName(name);
+                auto value = Position::FromString(name);
                 if (!value.IsValid()) {
                     throw FormulaException("Invalid position: " + value_str);
                 }
 
-                cells_.push_front(value);
-                auto node = std::make_unique<CellExpr>(&cells_.front());
+                // repeated references to a cell share one node
+                const CellReference*& cell = sheet.empty()
+                    ? references_[value]
+                    : sheet_references_[{ sheet, value }];
+                if (!cell)
+                {
+                    cells_.push_front({ value, 0, std::move(sheet) });
+                    cell = &cells_.front();
+                }
+                auto node = std::make_unique<CellExpr>(cell);
                 args_.push_back(std::move(node));
             }
 
@@ -407,7 +645,9 @@ namespace ASTImpl
 
         private:
             std::vector<std::unique_ptr<Expr>> args_;
-            std::forward_list<Position> cells_;
+            std::forward_list<CellReference> cells_;
+            std::unordered_map<Position, const CellReference*, HashPosition> references_;
+            std::map<std::pair<std::string, Position>, const CellReference*> sheet_references_;
         };
 
 
@@ -427,37 +667,83 @@ namespace ASTImpl
 }  // namespace ASTImpl
 
 
-FormulaAST ParseFormulaAST(std::istream& in)
+namespace
 {
-    using namespace antlr4;
+    // Lexer, token stream and parser are built once per thread and re-pointed at each
+    // new input instead of being constructed per formula. The ATN and the DFA prediction
+    // cache are static members of the generated classes and are shared by all instances
+    // on all threads; the runtime synchronizes updates to them.
+    class FormulaParserSet
+    {
+    public:
+        FormulaParserSet()
+            : lexer_(&input_)
+            , tokens_(&lexer_)
+            , parser_(&tokens_)
+        {
+            lexer_.removeErrorListeners();
+            lexer_.addErrorListener(&error_listener_);
+            parser_.setErrorHandler(error_handler_);
+            parser_.removeErrorListeners();
+        }
 
-    ANTLRInputStream input(in);
+        FormulaParserSet(const FormulaParserSet&) = delete;
+        FormulaParserSet& operator=(const FormulaParserSet&) = delete;
 
-    FormulaLexer lexer(&input);
-    ASTImpl::BailErrorListener error_listener;
-    lexer.removeErrorListeners();
-    lexer.addErrorListener(&error_listener);
+        FormulaAST Parse(std::string_view text)
+        {
+            // setInputStream, setTokenSource and setTokenStream reset the state left
+            // by the previous input, including a parse abandoned by an exception
+            input_.load(text.data(), text.size());
+            lexer_.setInputStream(&input_);
+            tokens_.setTokenSource(&lexer_);
+            parser_.setTokenStream(&tokens_);
+
+            // The parse tree is owned by the parser; release it as soon as the AST is built
+            struct TreeReleaser
+            {
+                FormulaParser& parser;
+                ~TreeReleaser()
+                {
+                    parser.reset();
+                }
+            } releaser{ parser_ };
 
-    CommonTokenStream tokens(&lexer);
+            antlr4::tree::ParseTree* tree = parser_.main();
+            ASTImpl::ParseASTListener listener;
+            antlr4::tree::ParseTreeWalker::DEFAULT.walk(&listener, tree);
 
-    FormulaParser parser(&tokens);
-    auto error_handler = std::make_shared<BailErrorStrategy>();
-    parser.setErrorHandler(error_handler);
-    parser.removeErrorListeners();
+            return FormulaAST(listener.MoveRoot(), listener.MoveCells());
+        }
+
+    private:
+        antlr4::ANTLRInputStream                   input_;
+        FormulaLexer                               lexer_;
+        ASTImpl::BailErrorListener                 error_listener_;
+        antlr4::CommonTokenStream                  tokens_;
+        FormulaParser                              parser_;
+        std::shared_ptr<antlr4::BailErrorStrategy> error_handler_ = std::make_shared<antlr4::BailErrorStrategy>();
+    };
 
-    tree::ParseTree* tree = parser.main();
-    ASTImpl::ParseASTListener listener;
-    tree::ParseTreeWalker::DEFAULT.walk(&listener, tree);
+    FormulaParserSet& ThreadParserSet()
+    {
+        thread_local FormulaParserSet parser_set;
+        return parser_set;
+    }
+}  // namespace
 
-    return FormulaAST(listener.MoveRoot(), listener.MoveCells());
+
+FormulaAST ParseFormulaAST(std::istream& in)
+{
+    std::string text(std::istreambuf_iterator<char>(in), {});
+    return ParseFormulaAST(std::string_view(text));
 }
 
-FormulaAST ParseFormulaAST(const std::string& in_str)
+FormulaAST ParseFormulaAST(std::string_view text)
 {
-    std::istringstream in(in_str);
     try
     {
-        return ParseFormulaAST(in);
+        return ThreadParserSet().Parse(text);
     }
     catch (...)
     {
@@ -465,13 +751,42 @@ FormulaAST ParseFormulaAST(const std::string& in_str)
     }
 }
 
+void WarmUpFormulaParser()
+{
+    // Every token, operator precedence level and alternative of the grammar, so that
+    // the first real formulas do not pay for filling the shared prediction cache
+    static const char* const FORMULAS[] = {
+        "1", "1.5", ".5", "1e3", "1.5E-3", "A1", "ZZ100", "Sheet2!A1", "'My sheet'!B2",
+        "-A1", "+1", "--1", "(1)", "((A1))",
+        "1+2", "1-2", "1*2", "1/2", "1+2*3", "(1+2)*3", "1-2/3+4*5", "-(A1+B2)*+C3/4-5",
+        "A1+Sheet2!B2*'My sheet'!C3", "1+", "(1", "A1B",
+    };
+    static std::once_flag once;
+    std::call_once(once, [] {
+        for (const char* formula : FORMULAS)
+        {
+            try
+            {
+                ParseFormulaAST(std::string_view(formula));
+            }
+            catch (const FormulaException&)
+            {
+            }
+        }
+    });
+}
+
 
 //********************   FormulaAST   ********************
 
 void FormulaAST::PrintCells(std::ostream& out) const
 {
-    for (auto cell : cells_)
-        out << cell.ToString() << ' ';
+    for (const auto& cell : cells_)
+    {
+        std::string name;
+        ASTImpl::AppendSheetPrefix(name, cell.sheet);
+        out << name << cell.pos.ToString() << ' ';
+    }
 }
 
 void FormulaAST::Print(std::ostream& out) const
@@ -481,29 +796,149 @@ void FormulaAST::Print(std::ostream& out) const
 
 void FormulaAST::PrintFormula(std::ostream& out) const
 {
-    root_expr_->PrintFormula(out, ASTImpl::EP_ATOM);
+    out << expression_.text;
 }
 
-double FormulaAST::Execute(CellValue args) const
+void FormulaAST::PrintFormula(std::string& out) const
+{
+    out += expression_.text;
+}
+
+ExprValue FormulaAST::Execute(CellValue args) const
 {
     return root_expr_->Evaluate(args);
 }
 
-std::forward_list<Position>& FormulaAST::GetCells()
+size_t FormulaAST::GetSize() const
+{
+    return root_expr_->GetSize();
+}
+
+std::forward_list<CellReference>& FormulaAST::GetCells()
 {
     return cells_;
 }
 
-const std::forward_list<Position>& FormulaAST::GetCells() const
+const std::forward_list<CellReference>& FormulaAST::GetCells() const
 {
     return cells_;
 }
 
-FormulaAST::FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr, std::forward_list<Position> cells)
+bool FormulaAST::ShiftReferences(const PositionShift& shift, std::string_view sheet)
+{
+    bool moved = false;
+    bool deleted = false;
+    for (auto& cell : cells_)
+    {
+        if (cell.sheet != sheet)
+            continue;
+        Position to = shift.Apply(cell.pos);
+        if (!(to == cell.pos))
+        {
+            moved = true;
+            deleted = deleted || !to.IsValid();
+            cell.pos = to;
+        }
+    }
+    if (!moved)
+        return false;
+
+    // row and column shifts are monotonic, so the order only breaks when
+    // references are deleted or a moved range overtakes other references
+    bool reordered = !std::is_sorted(cells_.begin(), cells_.end(), CellOrder);
+    if (reordered)
+        IndexCells();
+    RebuildExpression();
+    return deleted || reordered;
+}
+
+FormulaAST FormulaAST::Translate(int rows, int cols) const
+{
+    // the list is kept in index order, so the copies are numbered as the originals
+    std::forward_list<CellReference> cells;
+    std::vector<const CellReference*> by_index;
+    bool deleted = false;
+    auto tail = cells.before_begin();
+    for (const auto& cell : cells_)
+    {
+        assert(cell.index == by_index.size());
+        Position to{ cell.pos.row + rows, cell.pos.col + cols };
+        if (!cell.pos.IsValid() || !to.IsValid())
+        {
+            deleted = deleted || cell.pos.IsValid();
+            to = Position::NONE;
+        }
+        tail = cells.insert_after(tail, { to, cell.index, cell.sheet });
+        by_index.push_back(&*tail);
+    }
+
+    ASTImpl::FormulaText expression{ expression_.text, {} };
+    expression.cells.reserve(expression_.cells.size());
+    for (const auto& name : expression_.cells)
+        expression.cells.push_back({ name.offset, name.length, by_index[name.cell->index] });
+
+    FormulaAST result(root_expr_->Clone(by_index), std::move(cells), std::move(expression));
+    // a translation keeps the order of the references that stay in the table
+    if (deleted)
+        result.IndexCells();
+    if (rows != 0 || cols != 0)
+        result.RebuildExpression();
+    return result;
+}
+
+bool FormulaAST::CellOrder(const CellReference& lhs, const CellReference& rhs)
+{
+    // the empty name of the own sheet goes before the names of other sheets
+    if (lhs.pos.IsValid() != rhs.pos.IsValid())
+        return lhs.pos.IsValid();
+    if (lhs.sheet != rhs.sheet)
+        return lhs.sheet < rhs.sheet;
+    return lhs.pos < rhs.pos;
+}
+
+void FormulaAST::IndexCells()
+{
+    // sorting relinks the nodes, so the CellExpr pointers stay valid
+    cells_.sort(CellOrder);
+    size_t index = 0;
+    for (auto& cell : cells_)
+        cell.index = index++;
+}
+
+void FormulaAST::RebuildExpression()
+{
+    // only the cell names change, the rest of the text is copied as is
+    ASTImpl::FormulaText expression;
+    size_t copied = 0;
+    for (const auto& name : expression_.cells)
+    {
+        expression.text.append(expression_.text, copied, name.offset - copied);
+        ASTImpl::PrintCellName(expression, name.cell);
+        copied = name.offset + name.length;
+    }
+    expression.text.append(expression_.text, copied);
+    expression_ = std::move(expression);
+}
+
+FormulaAST::FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr, std::forward_list<CellReference> cells)
+    : root_expr_(std::move(root_expr))
+    , cells_(std::move(cells))
+{
+    IndexCells();
+
+    // the text is taken before folding so that it matches what the user wrote
+    root_expr_->PrintFormula(expression_, ASTImpl::EP_ATOM);
+    root_expr_ = ASTImpl::FoldExpr(std::move(root_expr_));
+}
+
+FormulaAST::FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr, std::forward_list<CellReference> cells,
+    ASTImpl::FormulaText expression)
     : root_expr_(std::move(root_expr))
+    , expression_(std::move(expression))
     , cells_(std::move(cells))
 {
-    cells_.sort();  // to avoid sorting in GetReferencedCells
 }
 
+FormulaAST::FormulaAST(FormulaAST&&) noexcept = default;
+FormulaAST& FormulaAST::operator=(FormulaAST&&) noexcept = default;
 FormulaAST::~FormulaAST() = default;
\ No newline at end of file
@@ -2,15 +2,15 @@
 
 #include "FormulaLexer.h"
 #include "common.h"
+#include "formula.h"
 
 #include <forward_list>
-#include <functional>
 #include <stdexcept>
+#include <string>
+#include <string_view>
+#include <variant>
+#include <vector>
 
-namespace ASTImpl
-{
-    class Expr;
-}
 
 
 class ParsingError : public std::runtime_error
@@ -19,34 +19,93 @@ class ParsingError : public std::runtime_error
 };
 
 
-using CellValue = std::function<double(Position)>;
+// a distinct cell referenced by a formula; index is its ordinal among the
+// formula's references in sorted order (cells of the own sheet first, then
+// cells of other sheets, then deleted ones) and is passed to CellValue, so that
+// callers can keep per-formula tables of pre-resolved cells
+struct CellReference
+{
+    Position pos;
+    size_t index = 0;
+    std::string sheet;  // unquoted sheet name, empty for the formula's own sheet
+};
+
+
+namespace ASTImpl
+{
+    class Expr;
+
+    // canonical text of a formula that remembers where the cell names are,
+    // so that the text can be rebuilt when references move
+    struct FormulaText
+    {
+        struct CellName
+        {
+            size_t offset;
+            size_t length;
+            const CellReference* cell;
+        };
+
+        std::string text;
+        std::vector<CellName> cells;
+    };
+}
+
+
+// result of evaluating an expression: a number or a formula error;
+// errors are propagated as values, evaluation never throws them
+using ExprValue = FormulaValue;
 
 
 class FormulaAST
 {
 public:
     explicit FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr,
-        std::forward_list<Position> cells);
-    FormulaAST(FormulaAST&&) = default;
-    FormulaAST& operator=(FormulaAST&&) = default;
+        std::forward_list<CellReference> cells);
+    FormulaAST(FormulaAST&&) noexcept;
+    FormulaAST& operator=(FormulaAST&&) noexcept;
     ~FormulaAST();
 
-    double Execute(CellValue args) const;
+    ExprValue Execute(CellValue args) const;
     void PrintCells(std::ostream& out) const;
+    // prints the folded tree that is actually evaluated
     void Print(std::ostream& out) const;
+    // print the canonical form of the formula as it was parsed
     void PrintFormula(std::ostream& out) const;
-    std::forward_list<Position>& GetCells();
-    const std::forward_list<Position>& GetCells() const;
+    void PrintFormula(std::string& out) const;  // appends to out
+    size_t GetSize() const;  // number of nodes in the folded AST
+    // moves references to the cells of the given sheet (empty for the own sheet)
+    // on row/column insertion and deletion and on range moves; references
+    // to deleted cells become #REF!. Returns true if some references were
+    // deleted or reordered: only then the value or the numbering change
+    bool ShiftReferences(const PositionShift& shift, std::string_view sheet = {});
+    // a copy with all references moved by rows and cols, as when a cell is
+    // copied; references that leave the table become #REF!. The folded tree
+    // is cloned, the text is not parsed again
+    FormulaAST Translate(int rows, int cols) const;
+    // distinct referenced cells in sorted order
+    std::forward_list<CellReference>& GetCells();
+    const std::forward_list<CellReference>& GetCells() const;
 
 private:
+    // constant subtrees are folded right after parsing
     std::unique_ptr<ASTImpl::Expr> root_expr_;
+    ASTImpl::FormulaText expression_;
 
     // physically stores cells so that they can be
     // efficiently traversed without going through
-    // the whole AST
-    std::forward_list<Position> cells_;
+    // the whole AST; every CellExpr points to one of the nodes
+    std::forward_list<CellReference> cells_;
+
+    FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr, std::forward_list<CellReference> cells,
+        ASTImpl::FormulaText expression);
+
+    static bool CellOrder(const CellReference& lhs, const CellReference& rhs);
+    void IndexCells();
+    void RebuildExpression();
 };
 
 
+// Parsing is thread-safe: every thread reuses its own lexer and parser instances
 FormulaAST ParseFormulaAST(std::istream& in);
-FormulaAST ParseFormulaAST(const std::string& in_str);
\ No newline at end of file
+FormulaAST ParseFormulaAST(std::string_view text);
\ No newline at end of file
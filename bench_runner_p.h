@@ -0,0 +1,288 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Минимальный раннер микробенчмарков. Каждый бенчмарк повторяется, пока
+// замер не займёт не меньше заданного времени; результаты печатаются в
+// JSON (по умолчанию) или в виде таблицы для чтения глазами.
+//
+//   void BenchSomething(BenchState& state) {
+//       ... подготовка, не входит в замер ...
+//       for (auto _ : state) {
+//           ... измеряемая операция ...
+//       }
+//       state.SetItemsProcessed(n);  // необязательно: элементов за итерацию
+//   }
+//
+// Бенчмарк может сам замерять задержку отдельных операций и передавать её в
+// AddLatency: тогда к результату добавляются p50 и p99 по всем замерам.
+
+class BenchState
+{
+    using Clock = std::chrono::steady_clock;
+
+public:
+    explicit BenchState(size_t iterations)
+        : iterations_(iterations)
+    {
+    }
+
+    // Переменная цикла не используется, атрибут глушит предупреждение о ней
+    struct [[maybe_unused]] Value
+    {
+    };
+
+    class Iterator
+    {
+    public:
+        Iterator(BenchState* state, size_t left)
+            : state_(state)
+            , left_(left)
+        {
+        }
+
+        Value operator*() const
+        {
+            return {};
+        }
+
+        Iterator& operator++()
+        {
+            --left_;
+            return *this;
+        }
+
+        bool operator!=(const Iterator&) const
+        {
+            if (left_ != 0)
+                return true;
+            state_->StopTiming();
+            return false;
+        }
+
+    private:
+        BenchState* state_;
+        size_t left_;
+    };
+
+    Iterator begin()
+    {
+        ResumeTiming();
+        return Iterator(this, iterations_);
+    }
+
+    Iterator end()
+    {
+        return Iterator(this, 0);
+    }
+
+    size_t Iterations() const
+    {
+        return iterations_;
+    }
+
+    // Исключают из замера подготовку данных внутри цикла
+    void PauseTiming()
+    {
+        StopTiming();
+    }
+
+    void ResumeTiming()
+    {
+        started_ = Clock::now();
+        running_ = true;
+    }
+
+    void SetItemsProcessed(size_t items_per_iteration)
+    {
+        items_per_iteration_ = items_per_iteration;
+    }
+
+    void AddLatency(std::chrono::nanoseconds sample)
+    {
+        latencies_.push_back(sample);
+    }
+
+    bool HasLatencies() const
+    {
+        return !latencies_.empty();
+    }
+
+    // Ближайший ранг по отсортированным задержкам, в наносекундах
+    double LatencyPercentile(double share)
+    {
+        if (latencies_.empty())
+            return 0;
+        size_t rank = static_cast<size_t>(std::ceil(share * static_cast<double>(latencies_.size())));
+        rank = std::clamp<size_t>(rank, 1, latencies_.size());
+        std::nth_element(latencies_.begin(), latencies_.begin() + (rank - 1), latencies_.end());
+        return static_cast<double>(latencies_[rank - 1].count());
+    }
+
+    // Не даёт компилятору выбросить вычисление результата
+    template <typename T>
+    static void DoNotOptimize(const T& value)
+    {
+#if defined(__GNUC__) || defined(__clang__)
+        asm volatile("" : : "r,m"(value) : "memory");
+#else
+        static volatile const void* sink;
+        sink = &value;
+#endif
+    }
+
+    std::chrono::nanoseconds Elapsed() const
+    {
+        return elapsed_;
+    }
+
+    size_t ItemsPerIteration() const
+    {
+        return items_per_iteration_;
+    }
+
+private:
+    void StopTiming()
+    {
+        if (!running_)
+            return;
+        elapsed_ += Clock::now() - started_;
+        running_ = false;
+    }
+
+    size_t iterations_;
+    size_t items_per_iteration_ = 0;
+    bool running_ = false;
+    Clock::time_point started_;
+    std::chrono::nanoseconds elapsed_{0};
+    std::vector<std::chrono::nanoseconds> latencies_;
+};
+
+
+class BenchRunner
+{
+public:
+    // --format=json|text, --filter=<подстрока имени>, --min-time=<секунды>
+    BenchRunner(int argc, char** argv)
+    {
+        for (int i = 1; i < argc; ++i)
+        {
+            std::string_view arg = argv[i];
+            if (arg.rfind("--format=", 0) == 0)
+                json_ = arg.substr(9) != "text";
+            else if (arg.rfind("--filter=", 0) == 0)
+                filter_ = std::string(arg.substr(9));
+            else if (arg.rfind("--min-time=", 0) == 0)
+                min_time_ = std::atof(std::string(arg.substr(11)).c_str());
+        }
+    }
+
+    template <class BenchFunc>
+    void RunBenchmark(BenchFunc func, const std::string& bench_name)
+    {
+        if (!filter_.empty() && bench_name.find(filter_) == std::string::npos)
+            return;
+
+        size_t iterations = 1;
+        while (true)
+        {
+            BenchState state(iterations);
+            func(state);
+
+            double seconds = std::chrono::duration<double>(state.Elapsed()).count();
+            if (seconds >= min_time_ || iterations >= MAX_ITERATIONS)
+            {
+                results_.push_back({ bench_name, iterations, seconds, state.ItemsPerIteration() });
+                if (state.HasLatencies())
+                {
+                    results_.back().has_latencies = true;
+                    results_.back().p50_ns = state.LatencyPercentile(0.50);
+                    results_.back().p99_ns = state.LatencyPercentile(0.99);
+                }
+                if (!json_)
+                    PrintText(results_.back());
+                return;
+            }
+
+            // Оцениваем число итераций по прошлому замеру с запасом
+            double factor = seconds > 0 ? min_time_ * 1.4 / seconds : 10.0;
+            factor = factor < 2.0 ? 2.0 : (factor > 10.0 ? 10.0 : factor);
+            iterations = static_cast<size_t>(static_cast<double>(iterations) * factor);
+        }
+    }
+
+    ~BenchRunner()
+    {
+        if (json_)
+            PrintJson();
+    }
+
+private:
+    struct Result
+    {
+        std::string name;
+        size_t iterations;
+        double seconds;
+        size_t items_per_iteration;
+        bool has_latencies = false;
+        double p50_ns = 0;
+        double p99_ns = 0;
+
+        double NsPerOp() const
+        {
+            return seconds * 1e9 / static_cast<double>(iterations);
+        }
+
+        double ItemsPerSecond() const
+        {
+            return static_cast<double>(items_per_iteration * iterations) / seconds;
+        }
+    };
+
+    void PrintText(const Result& result) const
+    {
+        std::cout << result.name << '\t' << result.iterations << " iterations\t"
+            << result.NsPerOp() << " ns/op";
+        if (result.items_per_iteration > 0)
+            std::cout << '\t' << result.ItemsPerSecond() << " items/s";
+        if (result.has_latencies)
+            std::cout << "\tp50 " << result.p50_ns << " ns\tp99 " << result.p99_ns << " ns";
+        std::cout << std::endl;
+    }
+
+    void PrintJson() const
+    {
+        std::cout << "{\n  \"benchmarks\": [";
+        bool first = true;
+        for (const Result& result : results_)
+        {
+            std::cout << (first ? "\n" : ",\n");
+            first = false;
+            std::cout << "    {\"name\": \"" << result.name << "\", \"iterations\": " << result.iterations
+                << ", \"ns_per_op\": " << result.NsPerOp();
+            if (result.items_per_iteration > 0)
+                std::cout << ", \"items_per_second\": " << result.ItemsPerSecond();
+            if (result.has_latencies)
+                std::cout << ", \"p50_ns\": " << result.p50_ns << ", \"p99_ns\": " << result.p99_ns;
+            std::cout << "}";
+        }
+        std::cout << "\n  ]\n}" << std::endl;
+    }
+
+    static constexpr size_t MAX_ITERATIONS = 1'000'000'000;
+
+    bool json_ = true;
+    std::string filter_;
+    double min_time_ = 0.2;
+    std::vector<Result> results_;
+};
+
+
+#define RUN_BENCHMARK(br, func) br.RunBenchmark(func, #func)
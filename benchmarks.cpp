@@ -0,0 +1,857 @@
+#include "bench_runner_p.h"
+#include "common.h"
+#include "formula.h"
+#include "position_set.h"
+#include "sheet.h"
+#include "workbook.h"
+
+#include <algorithm>
+#include <sstream>
+#include <thread>
+#include <unordered_set>
+
+namespace {
+    constexpr int CHAIN_LENGTH = 1000;
+    constexpr int FAN_WIDTH = 1000;
+
+    // Позиции обходят прямоугольник 1000x100, чтобы лист не рос бесконечно
+    Position CyclePosition(size_t i) {
+        return Position{ static_cast<int>(i / 100 % 1000), static_cast<int>(i % 100) };
+    }
+
+    void BenchSetCellText(BenchState& state) {
+        Sheet sheet;
+        size_t i = 0;
+        for (auto _ : state) {
+            sheet.SetCell(CyclePosition(i++), "some text");
+        }
+    }
+
+    void BenchSetCellFormula(BenchState& state) {
+        Sheet sheet;
+        size_t i = 0;
+        for (auto _ : state) {
+            // Формулы ссылаются на столбцы правее заполняемой области, циклов нет
+            sheet.SetCell(CyclePosition(i++), "=(CW1+CX2)*CY3/4-5");
+        }
+    }
+
+    // A1 <- A2 <- ... <- A1000: каждая итерация меняет начало цепочки и читает конец
+    void BenchGetValueChain(BenchState& state) {
+        Sheet sheet;
+        sheet.SetCell(Position{ 0, 0 }, "1");
+        for (int row = 1; row < CHAIN_LENGTH; ++row) {
+            sheet.SetCell(Position{ row, 0 }, "=" + Position{ row - 1, 0 }.ToString() + "+1");
+        }
+
+        size_t i = 0;
+        const Position last{ CHAIN_LENGTH - 1, 0 };
+        for (auto _ : state) {
+            sheet.SetCell(Position{ 0, 0 }, std::to_string(i++ % 7));
+            BenchState::DoNotOptimize(sheet.GetCell(last)->GetValue());
+        }
+        state.SetItemsProcessed(CHAIN_LENGTH);
+    }
+
+    // Нарастающий итог змейкой по трём столбцам (49152 формулы): та же правка начала
+    // и чтение конца. Без явного стека обхода такая цепочка переполняла стек
+    void BenchGetValueDeepChain(BenchState& state) {
+        constexpr int COLS = 3;
+        Sheet sheet;
+        sheet.SetCell(Position{ 0, 0 }, "1");
+        for (int col = 0; col < COLS; ++col) {
+            if (col > 0) {
+                sheet.SetCell(Position{ 0, col }, "=" + Position{ Position::MAX_ROWS - 1, col - 1 }.ToString() + "+1");
+            }
+            sheet.FillRange({ { 1, col }, { Position::MAX_ROWS - 1, col } }, "=" + Position{ 0, col }.ToString() + "+1");
+        }
+
+        size_t i = 0;
+        const Position last{ Position::MAX_ROWS - 1, COLS - 1 };
+        for (auto _ : state) {
+            sheet.SetCell(Position{ 0, 0 }, std::to_string(i++ % 7));
+            BenchState::DoNotOptimize(sheet.GetCell(last)->GetValue());
+        }
+        state.SetItemsProcessed(Position::MAX_ROWS * COLS);
+    }
+
+    // Та же цепочка, но конец читается с ограничением в 1 мс на вызов, пока значение
+    // не будет готово: накладные расходы опроса часов и повторного обхода
+    void BenchGetValueWithinDeepChain(BenchState& state) {
+        constexpr int COLS = 3;
+        Sheet sheet;
+        sheet.SetCell(Position{ 0, 0 }, "1");
+        for (int col = 0; col < COLS; ++col) {
+            if (col > 0) {
+                sheet.SetCell(Position{ 0, col }, "=" + Position{ Position::MAX_ROWS - 1, col - 1 }.ToString() + "+1");
+            }
+            sheet.FillRange({ { 1, col }, { Position::MAX_ROWS - 1, col } }, "=" + Position{ 0, col }.ToString() + "+1");
+        }
+
+        size_t i = 0;
+        const Position last{ Position::MAX_ROWS - 1, COLS - 1 };
+        for (auto _ : state) {
+            sheet.SetCell(Position{ 0, 0 }, std::to_string(i++ % 7));
+            std::optional<CellInterface::Value> value;
+            while (!(value = sheet.GetValueWithin(last, std::chrono::steady_clock::now() + std::chrono::milliseconds(1)))) {
+            }
+            BenchState::DoNotOptimize(*value);
+        }
+        state.SetItemsProcessed(Position::MAX_ROWS * COLS);
+    }
+
+    // Задержка горячих чтений, пришедших сразу за холодным чтением конца длинной цепочки.
+    // Синхронно горячее чтение ждёт весь конус холодного, асинхронно — не дольше кванта
+    // потока чтения. Время итерации — от холодного запроса до ответа на HOT_READS горячих;
+    // задержка каждого горячего чтения считается от того же холодного запроса до его
+    // ответа, по ним печатаются p50 и p99
+    constexpr int HOT_READS = 16;
+
+    void FillHotAndColdReads(Sheet& sheet) {
+        sheet.SetCell(Position{ 0, 0 }, "1");
+        sheet.FillRange({ { 1, 0 }, { Position::MAX_ROWS - 1, 0 } }, "=A1+1");
+        for (int row = 0; row < HOT_READS; ++row) {
+            sheet.SetCell(Position{ row, 1 }, "=" + std::to_string(row) + "*2");
+            sheet.GetCell(Position{ row, 1 })->GetValue();
+        }
+    }
+
+    void BenchHotReadsBehindColdSync(BenchState& state) {
+        using Clock = std::chrono::steady_clock;
+        Sheet sheet;
+        FillHotAndColdReads(sheet);
+        size_t i = 0;
+        const Position last{ Position::MAX_ROWS - 1, 0 };
+        for (auto _ : state) {
+            state.PauseTiming();
+            sheet.SetCell(Position{ 0, 0 }, std::to_string(i++ % 7));
+            state.ResumeTiming();
+            const auto arrived = Clock::now();
+            BenchState::DoNotOptimize(sheet.GetCell(last)->GetValue());
+            for (int row = 0; row < HOT_READS; ++row) {
+                BenchState::DoNotOptimize(sheet.GetCell(Position{ row, 1 })->GetValue());
+                state.AddLatency(Clock::now() - arrived);
+            }
+        }
+        state.SetItemsProcessed(HOT_READS);
+    }
+
+    void BenchHotReadsBehindColdAsync(BenchState& state) {
+        using Clock = std::chrono::steady_clock;
+        Sheet sheet;
+        FillHotAndColdReads(sheet);
+        size_t i = 0;
+        const Position last{ Position::MAX_ROWS - 1, 0 };
+        for (auto _ : state) {
+            state.PauseTiming();
+            sheet.SetCell(Position{ 0, 0 }, std::to_string(i++ % 7));
+            state.ResumeTiming();
+            const auto arrived = Clock::now();
+            auto cold = sheet.GetValueAsync(last);
+            for (int row = 0; row < HOT_READS; ++row) {
+                BenchState::DoNotOptimize(sheet.GetValueAsync(Position{ row, 1 }).get());
+                state.AddLatency(Clock::now() - arrived);
+            }
+            state.PauseTiming();
+            BenchState::DoNotOptimize(cold.get());
+            state.ResumeTiming();
+        }
+        state.SetItemsProcessed(HOT_READS);
+    }
+
+    // Одна ячейка, от которой зависят FAN_WIDTH формул: меняем её и читаем все
+    void BenchGetValueFanOut(BenchState& state) {
+        Sheet sheet;
+        sheet.SetCell(Position{ 0, 0 }, "1");
+        for (int row = 0; row < FAN_WIDTH; ++row) {
+            sheet.SetCell(Position{ row, 1 }, "=A1*" + std::to_string(row));
+        }
+
+        size_t i = 0;
+        for (auto _ : state) {
+            sheet.SetCell(Position{ 0, 0 }, std::to_string(i++ % 7));
+            for (int row = 0; row < FAN_WIDTH; ++row) {
+                BenchState::DoNotOptimize(sheet.GetCell(Position{ row, 1 })->GetValue());
+            }
+        }
+        state.SetItemsProcessed(FAN_WIDTH);
+    }
+
+    // Одна формула, которая суммирует 100 ячеек
+    void BenchGetValueFanIn(BenchState& state) {
+        constexpr int WIDTH = 100;
+        Sheet sheet;
+        std::string formula = "=A1";
+        for (int row = 0; row < WIDTH; ++row) {
+            sheet.SetCell(Position{ row, 0 }, std::to_string(row));
+            if (row > 0) {
+                formula += "+" + Position{ row, 0 }.ToString();
+            }
+        }
+        sheet.SetCell(Position{ 0, 1 }, formula);
+
+        size_t i = 0;
+        for (auto _ : state) {
+            sheet.SetCell(Position{ 0, 0 }, std::to_string(i++ % 7));
+            BenchState::DoNotOptimize(sheet.GetCell(Position{ 0, 1 })->GetValue());
+        }
+        state.SetItemsProcessed(WIDTH);
+    }
+
+    // То же, что BenchGetValueFanOut, но значения читает подписчик из списка изменений
+    void BenchNotifyFanOut(BenchState& state) {
+        Sheet sheet;
+        sheet.SetCell(Position{ 0, 0 }, "1");
+        for (int row = 0; row < FAN_WIDTH; ++row) {
+            sheet.SetCell(Position{ row, 1 }, "=A1*" + std::to_string(row));
+            sheet.GetCell(Position{ row, 1 })->GetValue();
+        }
+        sheet.Subscribe([&sheet](const std::vector<Position>& changed) {
+            for (Position pos : changed) {
+                BenchState::DoNotOptimize(sheet.GetCell(pos)->GetValue());
+            }
+        });
+
+        size_t i = 0;
+        for (auto _ : state) {
+            sheet.SetCell(Position{ 0, 0 }, std::to_string(i++ % 7));
+        }
+        state.SetItemsProcessed(FAN_WIDTH);
+    }
+
+    // BenchSetCellText с подписчиком: цена учёта и доставки изменений на одну запись
+    void BenchNotifySetCellText(BenchState& state) {
+        Sheet sheet;
+        size_t delivered = 0;
+        sheet.Subscribe([&delivered](const std::vector<Position>& changed) { delivered += changed.size(); });
+
+        size_t i = 0;
+        for (auto _ : state) {
+            sheet.SetCell(CyclePosition(i), "text " + std::to_string(i % 2));
+            ++i;
+        }
+        BenchState::DoNotOptimize(delivered);
+    }
+
+    // Полузаполненный шаблон: столбец B делит на нулевой C и даёт #DIV/0!,
+    // столбец D ссылается на текст и даёт #VALUE!, E и F протягивают ошибки дальше.
+    // Каждая итерация меняет Z1, от которой зависит весь столбец B
+    void BenchGetValueErrors(BenchState& state) {
+        constexpr int ROWS = 500;
+        Sheet sheet;
+        sheet.SetCell(Position{ 0, 25 }, "1");
+        for (int row = 0; row < ROWS; ++row) {
+            const std::string n = std::to_string(row + 1);
+            sheet.SetCell(Position{ row, 0 }, "label");
+            sheet.SetCell(Position{ row, 2 }, "0");
+            sheet.SetCell(Position{ row, 1 }, "=(Z1+" + n + ")/C" + n);
+            sheet.SetCell(Position{ row, 3 }, "=A" + n + "*Z1");
+            sheet.SetCell(Position{ row, 4 }, "=B" + n + "+D" + n);
+            sheet.SetCell(Position{ row, 5 }, "=E" + n + "*2-1");
+        }
+
+        size_t i = 0;
+        for (auto _ : state) {
+            sheet.SetCell(Position{ 0, 25 }, std::to_string(i++ % 7));
+            for (int row = 0; row < ROWS; ++row) {
+                BenchState::DoNotOptimize(sheet.GetCell(Position{ row, 5 })->GetValue());
+            }
+        }
+        state.SetItemsProcessed(ROWS * 4);
+    }
+
+    // Чтение пустых позиций внутри печатной области заполненного листа
+    void BenchGetCellEmpty(BenchState& state) {
+        Sheet sheet;
+        for (int row = 0; row < 100; ++row) {
+            for (int col = 0; col < 20; col += 2) {
+                sheet.SetCell(Position{ row, col }, "x");
+            }
+        }
+
+        size_t i = 0;
+        for (auto _ : state) {
+            BenchState::DoNotOptimize(sheet.GetCell(Position{ static_cast<int>(i % 100), static_cast<int>(i % 10 * 2 + 1) }));
+            ++i;
+        }
+    }
+
+    // Вставка строки в начало листа 1000x10, где каждая строка ссылается на
+    // предыдущую, и её удаление: переезжают все ячейки и переписываются все ссылки
+    void BenchInsertDeleteRows(BenchState& state) {
+        constexpr int ROWS = 1000;
+        constexpr int COLS = 10;
+        Sheet sheet;
+        for (int col = 0; col < COLS; ++col) {
+            sheet.SetCell(Position{ 0, col }, std::to_string(col));
+        }
+        for (int row = 1; row < ROWS; ++row) {
+            for (int col = 0; col < COLS; ++col) {
+                sheet.SetCell(Position{ row, col }, "=" + Position{ row - 1, col }.ToString() + "+1");
+            }
+        }
+
+        for (auto _ : state) {
+            sheet.InsertRows(0);
+            sheet.DeleteRows(0);
+        }
+        BenchState::DoNotOptimize(sheet.GetCell(Position{ ROWS - 1, COLS - 1 })->GetValue());
+        state.SetItemsProcessed(2 * ROWS * COLS);
+    }
+
+    // Операции над областью 1000x1000: формула каждой ячейки ссылается на ячейку
+    // соседней области 1000x1000 на том же месте. Массовые операции сравниваются
+    // с поячеечным циклом
+    constexpr int RANGE_SIDE = 1000;
+    const Range FILL_RANGE{ Position{ 0, RANGE_SIDE }, Position{ RANGE_SIDE - 1, 2 * RANGE_SIDE - 1 } };
+    const std::string FILL_TEXT = "=A1*2";
+
+    std::vector<std::string> FillTexts() {
+        std::vector<std::string> texts;
+        texts.reserve(FILL_RANGE.GetCellCount());
+        for (int row = FILL_RANGE.first.row; row <= FILL_RANGE.last.row; ++row) {
+            for (int col = FILL_RANGE.first.col; col <= FILL_RANGE.last.col; ++col) {
+                texts.push_back("=" + Position{ row, col - RANGE_SIDE }.ToString() + "*2");
+            }
+        }
+        return texts;
+    }
+
+    void BenchFillRange(BenchState& state) {
+        Sheet sheet;
+        for (auto _ : state) {
+            sheet.FillRange(FILL_RANGE, FILL_TEXT);
+        }
+        BenchState::DoNotOptimize(sheet.GetCell(FILL_RANGE.last)->GetValue());
+        state.SetItemsProcessed(FILL_RANGE.GetCellCount());
+    }
+
+    void BenchFillRangePerCell(BenchState& state) {
+        const auto texts = FillTexts();
+        Sheet sheet;
+        for (auto _ : state) {
+            size_t i = 0;
+            for (int row = FILL_RANGE.first.row; row <= FILL_RANGE.last.row; ++row) {
+                for (int col = FILL_RANGE.first.col; col <= FILL_RANGE.last.col; ++col) {
+                    sheet.SetCell(Position{ row, col }, texts[i++]);
+                }
+            }
+        }
+        BenchState::DoNotOptimize(sheet.GetCell(FILL_RANGE.last)->GetValue());
+        state.SetItemsProcessed(FILL_RANGE.GetCellCount());
+    }
+
+    void BenchCopyRange(BenchState& state) {
+        Sheet sheet;
+        sheet.FillRange(FILL_RANGE, FILL_TEXT);
+        const Position to{ RANGE_SIDE, RANGE_SIDE };
+        for (auto _ : state) {
+            sheet.CopyRange(FILL_RANGE, to);
+        }
+        BenchState::DoNotOptimize(sheet.GetCell(to)->GetValue());
+        state.SetItemsProcessed(FILL_RANGE.GetCellCount());
+    }
+
+    void BenchClearRange(BenchState& state) {
+        Sheet sheet;
+        for (auto _ : state) {
+            state.PauseTiming();
+            sheet.FillRange(FILL_RANGE, FILL_TEXT);
+            state.ResumeTiming();
+            sheet.ClearRange(FILL_RANGE);
+        }
+        BenchState::DoNotOptimize(sheet.GetStoredCellCount());
+        state.SetItemsProcessed(FILL_RANGE.GetCellCount());
+    }
+
+    void BenchClearRangePerCell(BenchState& state) {
+        Sheet sheet;
+        for (auto _ : state) {
+            state.PauseTiming();
+            sheet.FillRange(FILL_RANGE, FILL_TEXT);
+            state.ResumeTiming();
+            for (int row = FILL_RANGE.first.row; row <= FILL_RANGE.last.row; ++row) {
+                for (int col = FILL_RANGE.first.col; col <= FILL_RANGE.last.col; ++col) {
+                    sheet.ClearCell(Position{ row, col });
+                }
+            }
+        }
+        BenchState::DoNotOptimize(sheet.GetStoredCellCount());
+        state.SetItemsProcessed(FILL_RANGE.GetCellCount());
+    }
+
+    constexpr int WORKBOOK_SHEETS = 8;
+    constexpr int WORKBOOK_ROWS = 16000;
+
+    // Независимые листы, формулы которых зависят от их A1, и итоговый лист, читающий каждый из них
+    void FillWorkbook(Workbook& book) {
+        std::string total = "=0";
+        for (int i = 0; i < WORKBOOK_SHEETS; ++i) {
+            std::string name = "Data" + std::to_string(i);
+            Sheet& sheet = book.AddSheet(name);
+            sheet.SetCell(Position{ 0, 0 }, "1");
+            for (int row = 1; row < WORKBOOK_ROWS; ++row) {
+                sheet.SetCell(Position{ row, 0 }, "=A1*" + std::to_string(row) + "+A1/2");
+            }
+            total += "+" + name + "!A2";
+        }
+        book.AddSheet("Total").SetCell(Position{ 0, 0 }, total);
+    }
+
+    void RecalculateWorkbook(BenchState& state, size_t threads) {
+        Workbook book;
+        FillWorkbook(book);
+        int value = 0;
+        for (auto _ : state) {
+            state.PauseTiming();
+            for (int i = 0; i < WORKBOOK_SHEETS; ++i) {
+                book.GetSheet(i).SetCell(Position{ 0, 0 }, std::to_string(++value));
+            }
+            state.ResumeTiming();
+            book.Recalculate(threads);
+        }
+        BenchState::DoNotOptimize(book.GetSheet("Total")->GetCell(Position{ 0, 0 })->GetValue());
+        state.SetItemsProcessed(static_cast<size_t>(WORKBOOK_SHEETS) * WORKBOOK_ROWS);
+    }
+
+    // Независимые листы считаются параллельно
+    void BenchWorkbookRecalculate(BenchState& state) {
+        RecalculateWorkbook(state, 0);
+    }
+
+    void BenchWorkbookRecalculateSequential(BenchState& state) {
+        RecalculateWorkbook(state, 1);
+    }
+
+    void BenchPositionToString(BenchState& state) {
+        size_t i = 0;
+        for (auto _ : state) {
+            Position pos{ static_cast<int>(i * 7919 % Position::MAX_ROWS), static_cast<int>(i % Position::MAX_COLS) };
+            ++i;
+            BenchState::DoNotOptimize(pos.ToString());
+        }
+    }
+
+    void BenchPositionFromString(BenchState& state) {
+        std::vector<std::string> names;
+        for (int i = 0; i < 1024; ++i) {
+            names.push_back(Position{ i * 13 % Position::MAX_ROWS, i * 16 % Position::MAX_COLS }.ToString());
+        }
+
+        size_t i = 0;
+        for (auto _ : state) {
+            BenchState::DoNotOptimize(Position::FromString(names[i++ % names.size()]));
+        }
+    }
+
+    void BenchPositionToChars(BenchState& state) {
+        char buffer[Position::MAX_STRING_LENGTH];
+        size_t i = 0;
+        for (auto _ : state) {
+            Position pos{ static_cast<int>(i * 7919 % Position::MAX_ROWS), static_cast<int>(i % Position::MAX_COLS) };
+            ++i;
+            BenchState::DoNotOptimize(pos.ToChars(buffer));
+            BenchState::DoNotOptimize(buffer);
+        }
+    }
+
+    void BenchPositionFromChars(BenchState& state) {
+        std::vector<std::string> names;
+        for (int i = 0; i < 1024; ++i) {
+            names.push_back(Position{ i * 13 % Position::MAX_ROWS, i * 16 % Position::MAX_COLS }.ToString());
+        }
+
+        size_t i = 0;
+        for (auto _ : state) {
+            BenchState::DoNotOptimize(Position::FromChars(names[i++ % names.size()]));
+        }
+    }
+
+    // Пакетный разбор и запись 1024 имён, как при импорте
+    void BenchPositionBatchCodec(BenchState& state) {
+        constexpr size_t COUNT = 1024;
+        std::vector<std::string> storage;
+        for (size_t i = 0; i < COUNT; ++i) {
+            storage.push_back(Position{ static_cast<int>(i * 13 % Position::MAX_ROWS), static_cast<int>(i * 16 % Position::MAX_COLS) }.ToString());
+        }
+        std::vector<std::string_view> names(storage.begin(), storage.end());
+        std::vector<Position> positions(COUNT);
+        std::vector<char> text(COUNT * (Position::MAX_STRING_LENGTH + 1));
+
+        for (auto _ : state) {
+            ParsePositions(names.data(), COUNT, positions.data());
+            BenchState::DoNotOptimize(FormatPositions(positions.data(), COUNT, text.data(), ','));
+        }
+        state.SetItemsProcessed(COUNT);
+    }
+
+    void BenchParseFormula(BenchState& state) {
+        for (auto _ : state) {
+            BenchState::DoNotOptimize(ParseFormula("(A1+B2)*C3/4-5+-D4"));
+        }
+    }
+
+    // Разбор на всех ядрах: у каждого потока свои лексер и парсер, общий только
+    // кэш предсказаний. Время включает запуск потоков
+    void BenchParseFormulaParallel(BenchState& state) {
+        const unsigned threads = std::max(std::thread::hardware_concurrency(), 1u);
+        const int formulas = 1024;
+        for (auto _ : state) {
+            std::vector<std::thread> workers;
+            for (unsigned i = 0; i < threads; ++i) {
+                workers.emplace_back([] {
+                    for (int j = 0; j < formulas; ++j) {
+                        BenchState::DoNotOptimize(ParseFormula("(A1+B2)*C3/4-5+-D4"));
+                    }
+                });
+            }
+            for (auto& worker : workers) {
+                worker.join();
+            }
+        }
+        state.SetItemsProcessed(static_cast<size_t>(threads) * formulas);
+    }
+
+    // Формула с константными подвыражениями, которые сворачиваются при разборе
+    void BenchEvaluateConstantSubexpressions(BenchState& state) {
+        Sheet sheet;
+        sheet.SetCell(Position{ 0, 0 }, "3");
+        auto formula = ParseFormula("A1*(60*60*24)+(1+2)*(3+4)/(2*2)-+(-(-A1))/8");
+        for (auto _ : state) {
+            BenchState::DoNotOptimize(formula->Evaluate(sheet));
+        }
+    }
+
+    // Формула из 64 ссылок на числовые ячейки, вычисляемая без кэша ячейки
+    std::string FillReferenceSheet(Sheet& sheet) {
+        std::string expression;
+        for (int row = 0; row < 64; ++row) {
+            sheet.SetCell(Position{ row, 0 }, std::to_string(row));
+            expression += (row ? "+" : "") + Position{ row, 0 }.ToString();
+        }
+        return expression;
+    }
+
+    void BenchEvaluateReferencesInterface(BenchState& state) {
+        Sheet sheet;
+        auto formula = ParseFormula(FillReferenceSheet(sheet));
+        const SheetInterface& sheet_interface = sheet;
+        for (auto _ : state) {
+            BenchState::DoNotOptimize(formula->Evaluate(sheet_interface));
+        }
+        state.SetItemsProcessed(64);
+    }
+
+    void BenchEvaluateReferencesSheet(BenchState& state) {
+        Sheet sheet;
+        auto formula = ParseFormula(FillReferenceSheet(sheet));
+        auto operand = [&sheet](Position pos) { return sheet.GetFormulaOperand(pos); };
+        for (auto _ : state) {
+            BenchState::DoNotOptimize(formula->Evaluate(CellValue(operand)));
+        }
+        state.SetItemsProcessed(64);
+    }
+
+    void FillPrintSheet(Sheet& sheet) {
+        for (int row = 0; row < 100; ++row) {
+            for (int col = 0; col < 20; ++col) {
+                Position pos{ row, col };
+                if (col % 4 == 0) {
+                    sheet.SetCell(pos, "text " + std::to_string(row));
+                }
+                else if (col % 4 == 1) {
+                    sheet.SetCell(pos, std::to_string(row * col));
+                }
+                else if (col % 4 == 2) {
+                    sheet.SetCell(pos, "=" + Position{ row, col - 1 }.ToString() + "*2");
+                }
+            }
+        }
+    }
+
+    void BenchPrintValues(BenchState& state) {
+        Sheet sheet;
+        FillPrintSheet(sheet);
+        for (auto _ : state) {
+            std::ostringstream out;
+            sheet.PrintValues(out);
+            BenchState::DoNotOptimize(out.str());
+        }
+        state.SetItemsProcessed(100 * 20);
+    }
+
+    void BenchPrintTexts(BenchState& state) {
+        Sheet sheet;
+        FillPrintSheet(sheet);
+        for (auto _ : state) {
+            std::ostringstream out;
+            sheet.PrintTexts(out);
+            BenchState::DoNotOptimize(out.str());
+        }
+        state.SetItemsProcessed(100 * 20);
+    }
+
+    // Прокрутка окна 50x20 по листу в 16000 строк: каждая итерация сдвигает окно
+    // на 50 строк и печатает его значения. Формулы вне окна не вычисляются
+    void BenchPrintViewport(BenchState& state) {
+        constexpr int ROWS = 16000;
+        constexpr int VIEW_ROWS = 50;
+        constexpr int VIEW_COLS = 20;
+        Sheet sheet;
+        for (int row = 0; row < ROWS; ++row) {
+            sheet.SetCell(Position{ row, 0 }, std::to_string(row));
+            for (int col = 1; col < VIEW_COLS; ++col) {
+                sheet.SetCell(Position{ row, col }, "=" + Position{ row, col - 1 }.ToString() + "+1");
+            }
+        }
+
+        int first = 0;
+        for (auto _ : state) {
+            // Правка в окне сбрасывает его строку, поэтому окно всегда что-то вычисляет
+            sheet.SetCell(Position{ first, 0 }, std::to_string(first + 1));
+            std::ostringstream out;
+            sheet.PrintValues(out, { { first, 0 }, { first + VIEW_ROWS - 1, VIEW_COLS - 1 } });
+            BenchState::DoNotOptimize(out.str());
+            first = (first + VIEW_ROWS) % (ROWS - VIEW_ROWS);
+        }
+        state.SetItemsProcessed(VIEW_ROWS * VIEW_COLS);
+    }
+
+    // Правка общего входа сбрасывает 28000 формул, фоновый поток режима EAGER их
+    // пересчитывает. Замеряется время от правки до готовности окна 50x8 в конце
+    // листа, когда окно передано планировщику и когда нет; досчёт остального не входит
+    void BenchViewportLatency(BenchState& state, bool prioritized) {
+        constexpr int ROWS = 4000;
+        constexpr int COLS = 8;
+        const Range viewport{ { ROWS - 50, 0 }, { ROWS - 1, COLS - 1 } };
+        Sheet sheet;
+        sheet.SetCell(Position{ 0, 0 }, "0");
+        for (int row = 0; row < ROWS; ++row) {
+            for (int col = 1; col < COLS; ++col) {
+                sheet.SetCell(Position{ row, col }, "=A1+" + std::to_string(row * COLS + col));
+            }
+        }
+        // Фоновый поток пересчитывает только сброшенные значения, поэтому сначала всё считается
+        sheet.SetCalculationMode(CalculationMode::EAGER);
+        sheet.CalculateAll();
+        if (prioritized) {
+            sheet.SetViewport(viewport);
+        }
+
+        auto ready = [&sheet, &viewport] {
+            auto lock = sheet.Lock();
+            for (int row = viewport.first.row; row <= viewport.last.row; ++row) {
+                for (int col = 1; col <= viewport.last.col; ++col) {
+                    if (!sheet.FindCell(Position{ row, col })->HasActualCache()) {
+                        return false;
+                    }
+                }
+            }
+            return true;
+        };
+
+        int i = 0;
+        for (auto _ : state) {
+            sheet.SetCell(Position{ 0, 0 }, std::to_string(++i));
+            while (!ready()) {
+                std::this_thread::yield();
+            }
+            state.PauseTiming();
+            sheet.WaitForRecalculation();
+            state.ResumeTiming();
+        }
+    }
+
+    void BenchViewportLatencyPrioritized(BenchState& state) {
+        BenchViewportLatency(state, true);
+    }
+
+    void BenchViewportLatencyUnprioritized(BenchState& state) {
+        BenchViewportLatency(state, false);
+    }
+
+    // Синхронизация листа в 5000 строк, в котором между выгрузками меняются 4 ячейки:
+    // полная выгрузка значений против дельты с прошлой версии
+    void BenchExportValues(BenchState& state, bool delta) {
+        constexpr int ROWS = 5000;
+        Sheet sheet;
+        for (int row = 0; row < ROWS; ++row) {
+            sheet.SetCell(Position{ row, 0 }, std::to_string(row));
+            sheet.SetCell(Position{ row, 1 }, "=A" + std::to_string(row + 1) + "*2");
+            sheet.SetCell(Position{ row, 2 }, "text");
+        }
+        std::ostringstream warmup;
+        uint64_t version = sheet.PrintValuesSince(warmup, 0);
+
+        int i = 0;
+        for (auto _ : state) {
+            for (int k = 0; k < 4; ++k) {
+                sheet.SetCell(Position{ (i * 4 + k) * 7919 % ROWS, 0 }, std::to_string(i));
+            }
+            ++i;
+            std::ostringstream out;
+            if (delta) {
+                version = sheet.PrintValuesSince(out, version);
+            }
+            else {
+                sheet.PrintValues(out);
+            }
+            BenchState::DoNotOptimize(out.str());
+        }
+        state.SetItemsProcessed(ROWS);
+    }
+
+    void BenchExportValuesFull(BenchState& state) {
+        BenchExportValues(state, false);
+    }
+
+    void BenchExportValuesDelta(BenchState& state) {
+        BenchExportValues(state, true);
+    }
+
+    // Экспорт текста листа из одних формул и листа из строк той же длины
+    void BenchPrintTextsOf(BenchState& state, bool formulas) {
+        Sheet sheet;
+        for (int row = 0; row < 100; ++row) {
+            for (int col = 0; col < 20; ++col) {
+                std::string text = "=(" + Position{ row + 1, col }.ToString() + "+0.25)*3.5-" + std::to_string(col);
+                sheet.SetCell(Position{ row, col }, formulas ? text : text.substr(1));
+            }
+        }
+        for (auto _ : state) {
+            std::ostringstream out;
+            sheet.PrintTexts(out);
+            BenchState::DoNotOptimize(out.str());
+        }
+        state.SetItemsProcessed(100 * 20);
+    }
+
+    void BenchPrintTextsFormulas(BenchState& state) {
+        BenchPrintTextsOf(state, true);
+    }
+
+    void BenchPrintTextsPlain(BenchState& state) {
+        BenchPrintTextsOf(state, false);
+    }
+
+    // Прежний хеш: произведение std::hash<double> от строки и столбца.
+    // Все позиции нулевой строки и нулевого столбца попадают в одну корзину
+    struct LegacyHashPosition {
+        size_t operator()(const Position& pos) const {
+            return std::hash<double>{}(pos.col) * std::hash<double>{}(pos.row) * 10;
+        }
+    };
+
+    // Позиции нулевой строки и нулевого столбца — типичные заголовки таблиц
+    std::vector<Position> AxisPositions() {
+        std::vector<Position> positions;
+        for (int i = 0; i < 1000; ++i) {
+            positions.push_back(Position{ 0, i });
+            positions.push_back(Position{ i + 1, 0 });
+        }
+        return positions;
+    }
+
+    template <typename Set>
+    void BenchAxisLookup(BenchState& state) {
+        const auto positions = AxisPositions();
+        Set set(positions.begin(), positions.end());
+        for (auto _ : state) {
+            size_t found = 0;
+            for (Position pos : positions) {
+                found += set.count(pos);
+            }
+            BenchState::DoNotOptimize(found);
+        }
+        state.SetItemsProcessed(positions.size());
+    }
+
+    void BenchAxisLookupLegacyHash(BenchState& state) {
+        BenchAxisLookup<std::unordered_set<Position, LegacyHashPosition>>(state);
+    }
+
+    void BenchAxisLookupHashPosition(BenchState& state) {
+        BenchAxisLookup<std::unordered_set<Position, HashPosition>>(state);
+    }
+
+    void BenchAxisLookupPositionSet(BenchState& state) {
+        BenchAxisLookup<PositionSet>(state);
+    }
+
+    // Типичное множество рёбер ячейки: несколько ссылок, вставка и обход
+    template <typename Set>
+    void BenchSmallEdgeSet(BenchState& state) {
+        size_t i = 0;
+        for (auto _ : state) {
+            Set set;
+            for (int k = 0; k < 4; ++k) {
+                set.insert(Position{ static_cast<int>(i % 1000), k });
+            }
+            int sum = 0;
+            for (Position pos : set) {
+                sum += pos.col;
+            }
+            BenchState::DoNotOptimize(sum);
+            ++i;
+        }
+    }
+
+    void BenchSmallEdgeSetLegacyHash(BenchState& state) {
+        BenchSmallEdgeSet<std::unordered_set<Position, LegacyHashPosition>>(state);
+    }
+
+    void BenchSmallEdgeSetPositionSet(BenchState& state) {
+        BenchSmallEdgeSet<PositionSet>(state);
+    }
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    BenchRunner br(argc, argv);
+    RUN_BENCHMARK(br, BenchSetCellText);
+    RUN_BENCHMARK(br, BenchSetCellFormula);
+    RUN_BENCHMARK(br, BenchGetValueChain);
+    RUN_BENCHMARK(br, BenchGetValueDeepChain);
+    RUN_BENCHMARK(br, BenchGetValueWithinDeepChain);
+    RUN_BENCHMARK(br, BenchHotReadsBehindColdSync);
+    RUN_BENCHMARK(br, BenchHotReadsBehindColdAsync);
+    RUN_BENCHMARK(br, BenchGetValueFanOut);
+    RUN_BENCHMARK(br, BenchGetValueFanIn);
+    RUN_BENCHMARK(br, BenchNotifyFanOut);
+    RUN_BENCHMARK(br, BenchNotifySetCellText);
+    RUN_BENCHMARK(br, BenchGetValueErrors);
+    RUN_BENCHMARK(br, BenchGetCellEmpty);
+    RUN_BENCHMARK(br, BenchInsertDeleteRows);
+    RUN_BENCHMARK(br, BenchFillRange);
+    RUN_BENCHMARK(br, BenchFillRangePerCell);
+    RUN_BENCHMARK(br, BenchCopyRange);
+    RUN_BENCHMARK(br, BenchClearRange);
+    RUN_BENCHMARK(br, BenchClearRangePerCell);
+    RUN_BENCHMARK(br, BenchWorkbookRecalculate);
+    RUN_BENCHMARK(br, BenchWorkbookRecalculateSequential);
+    RUN_BENCHMARK(br, BenchPositionToString);
+    RUN_BENCHMARK(br, BenchPositionFromString);
+    RUN_BENCHMARK(br, BenchPositionToChars);
+    RUN_BENCHMARK(br, BenchPositionFromChars);
+    RUN_BENCHMARK(br, BenchPositionBatchCodec);
+    RUN_BENCHMARK(br, BenchParseFormula);
+    RUN_BENCHMARK(br, BenchParseFormulaParallel);
+    RUN_BENCHMARK(br, BenchEvaluateConstantSubexpressions);
+    RUN_BENCHMARK(br, BenchEvaluateReferencesInterface);
+    RUN_BENCHMARK(br, BenchEvaluateReferencesSheet);
+    RUN_BENCHMARK(br, BenchPrintValues);
+    RUN_BENCHMARK(br, BenchPrintTexts);
+    RUN_BENCHMARK(br, BenchPrintTextsFormulas);
+    RUN_BENCHMARK(br, BenchPrintTextsPlain);
+    RUN_BENCHMARK(br, BenchPrintViewport);
+    RUN_BENCHMARK(br, BenchViewportLatencyPrioritized);
+    RUN_BENCHMARK(br, BenchViewportLatencyUnprioritized);
+    RUN_BENCHMARK(br, BenchExportValuesFull);
+    RUN_BENCHMARK(br, BenchExportValuesDelta);
+    RUN_BENCHMARK(br, BenchAxisLookupLegacyHash);
+    RUN_BENCHMARK(br, BenchAxisLookupHashPosition);
+    RUN_BENCHMARK(br, BenchAxisLookupPositionSet);
+    RUN_BENCHMARK(br, BenchSmallEdgeSetLegacyHash);
+    RUN_BENCHMARK(br, BenchSmallEdgeSetPositionSet);
+    return 0;
+}
@@ -1,9 +1,57 @@
 #include "cell.h"
+#include "sheet.h"
+
+#include <algorithm>
+#include <ostream>
+
+namespace
+{
+    const Cell::SheetEdges NO_EDGES;
+    const std::vector<const Cell*> NO_CELLS;
+
+    const PositionSet* FindEdges(const Cell::SheetEdges& edges, const Sheet* sheet)
+    {
+        for (const auto& [other, positions] : edges)
+        {
+            if (other == sheet)
+                return &positions;
+        }
+        return nullptr;
+    }
+
+    PositionSet& AddEdges(Cell::SheetEdges& edges, Sheet* sheet)
+    {
+        for (auto& [other, positions] : edges)
+        {
+            if (other == sheet)
+                return positions;
+        }
+        return edges.emplace_back(sheet, PositionSet()).second;
+    }
+
+    void RemoveEmptyEdges(Cell::SheetEdges& edges)
+    {
+        edges.erase(std::remove_if(edges.begin(), edges.end(), [](const auto& edge) { return edge.second.empty(); }),
+            edges.end());
+    }
+
+    // Рёбра к удалённым ячейкам пропадают вместе с ними
+    PositionSet ShiftPositions(const PositionSet& positions, const PositionShift& shift)
+    {
+        PositionSet result;
+        for (Position pos : positions)
+        {
+            if (Position moved = shift.Apply(pos); moved.IsValid())
+                result.insert(moved);
+        }
+        return result;
+    }
+}  // namespace
 
 
 /********************   Cell   ********************/
 
-Cell::Cell(SheetInterface& sheet, Position pos)
+Cell::Cell(Sheet& sheet, Position pos)
     : sheet_(sheet)
     , pos_(pos)
     , impl_(std::make_unique<EmptyImpl>())
@@ -13,53 +61,326 @@ Cell::Cell(SheetInterface& sheet, Position pos)
 {
 }
 
-Cell::Cell(SheetInterface& sheet, Position pos, std::string text)
-    : sheet_(sheet)
-    , pos_(pos)
-    , dependents_()
-    , includes_()
-    , cache_(std::nullopt)
-{
-    Set(text);
-}
-
 void Cell::Set(std::string text)
 {
-    auto value = MakeImpl(std::move(text)); // Задаём значение ячейки
+    auto value = MakeImpl(std::move(text), sheet_); // Задаём значение ячейки
     if (CheckCyclicality(value))
         throw CircularDependencyException("Cyclic dependency detected");
 
-    ClearCache();
-    RemoveOldDependents();
-    AddReferencedCells(value->GetReferencedCells());
-    AddNewDependents(includes_);
+    Replace(std::move(value));
     ResetCacheDependents();
+}
+
+void Cell::SetContent(Content content)
+{
+    Replace(content.impl_ ? std::move(content.impl_) : std::make_unique<EmptyImpl>());
+}
 
+void Cell::Replace(std::unique_ptr<Impl> value)
+{
+    PositionSet old_includes = std::move(includes_);
+    includes_.clear();
+    SheetEdges old_external;
+    if (external_)
+        old_external = std::exchange(external_->includes, {});
+
+    auto cells = AddReferencedCells(value->GetReferencedCells());
+    AddExternalCells(value->GetExternalCells(), cells);
+    value->LinkReferences(std::move(cells));
+    RemoveOldReferences(old_includes);
+    RemoveOldExternalReferences(old_external);
     impl_ = std::move(value);
+
+    ClearCache();
+    if (IsFormula() && sheet_.GetCalculationMode() != CalculationMode::LAZY)
+        sheet_.MarkDirty(pos_);
 }
 
 void Cell::Clear()
 {
-    impl_ = std::make_unique<EmptyImpl>();
+    Set(std::string());
 }
 
 void Cell::ClearCache()
 {
     cache_.reset();
+    stale_ = false;
+}
+
+bool Cell::HasActualCache() const
+{
+    return cache_.has_value() && !stale_;
+}
+
+bool Cell::IsStale() const
+{
+    return cache_.has_value() && stale_;
+}
+
+const PositionSet& Cell::GetDependents() const
+{
+    return dependents_;
+}
+
+const PositionSet& Cell::GetIncludes() const
+{
+    return includes_;
+}
+
+const Cell::SheetEdges& Cell::GetExternalDependents() const
+{
+    return external_ ? external_->dependents : NO_EDGES;
+}
+
+const Cell::SheetEdges& Cell::GetExternalIncludes() const
+{
+    return external_ ? external_->includes : NO_EDGES;
 }
 
 Cell::Value Cell::GetValue() const
 {
-    if (!cache_.has_value())
-        cache_ = impl_->GetValue();
+    auto lock = sheet_.Lock();
+    EvaluationProfiler* profiler = sheet_.GetProfiler();
+    if (profiler)
+        profiler->OnCellRead();
+
+    if (cache_.has_value())
+    {
+        sheet_.GetCounters().Add(Counter::CACHE_HITS);
+        return cache_.value();
+    }
+    return Compute();
+}
+
+const Cell::Value& Cell::Compute() const
+{
+    EvaluationProfiler::Scope scope(sheet_.GetProfiler(), pos_, impl_->GetAstSize());
+    if (IsFormula())
+        ComputeReferences();
+    return Evaluate();
+}
+
+const Cell::Value& Cell::Evaluate() const
+{
+    sheet_.GetCounters().Add(Counter::CACHE_MISSES);
+    if (IsFormula())
+        sheet_.GetCounters().Add(Counter::AST_EVALUATIONS);
+
+    cache_ = impl_->GetValue();
     return cache_.value();
 }
 
+std::optional<Cell::Value> Cell::GetValueWithin(std::chrono::steady_clock::time_point deadline,
+                                                const CancellationToken* token,
+                                                std::vector<Position>* progress) const
+{
+    auto lock = sheet_.Lock();
+    if (cache_.has_value() || !IsFormula())
+        return GetValue();
+
+    // Срок проверяется до обхода; дальше часы опрашиваются раз в несколько ячеек,
+    // поэтому вызов, начатый до срока, всегда продвигает вычисление
+    Limit limit{ deadline, token, 0, progress };
+    if (limit.Expired())
+        return std::nullopt;
+
+    // Прерванный обход запоминается позициями ячеек своего листа, от корня к самой
+    // глубокой. Следующее чтение той же ячейки досчитывает их с конца и не спускается
+    // заново по всей цепочке. Позиции могли устареть после правок: тогда лишняя работа
+    // ограничена тем же сроком, а значение всё равно вычисляется обходом от этой ячейки
+    if (!limit.resume)
+    {
+        struct Resume
+        {
+            const Sheet*          sheet = nullptr;
+            Position              root;
+            std::vector<Position> cells;
+        };
+        thread_local Resume resume;
+        if (resume.sheet != &sheet_ || !(resume.root == pos_))
+        {
+            resume.sheet = &sheet_;
+            resume.root = pos_;
+            resume.cells.clear();
+        }
+        limit.resume = &resume.cells;
+    }
+
+    std::vector<Position>& cells = *limit.resume;
+    while (!cells.empty())
+    {
+        const Cell* cell = sheet_.FindCell(cells.back());
+        cells.pop_back();
+        if (!cell || !cell->IsFormula() || cell->cache_.has_value())
+            continue;
+        if (!cell->ComputeReferences(&limit))
+            return std::nullopt;
+        cell->Compute();
+    }
+    if (!ComputeReferences(&limit))
+        return std::nullopt;
+    return GetValue();
+}
+
+bool Cell::Limit::Expired()
+{
+    // Опрос часов дороже вычисления простой формулы
+    constexpr size_t CLOCK_PERIOD = 16;
+    if (token && token->IsCancelled())
+        return true;
+    return computed++ % CLOCK_PERIOD == 0 && std::chrono::steady_clock::now() >= deadline;
+}
+
+bool Cell::ComputeReferences(Limit* limit) const
+{
+    // Непосчитанные формулы, от которых зависит ячейка, вычисляются снизу вверх
+    // обходом в глубину с явным стеком. Формула вычисляется, когда посчитаны все её
+    // ссылки, поэтому её собственное вычисление читает только кэш, и глубина
+    // стека вызовов не зависит от длины цепочки зависимостей
+    auto pending = [](const Cell* cell) { return cell->IsFormula() && !cell->cache_.has_value(); };
+    const auto& own = impl_->GetLinkedCells();
+    if (std::none_of(own.begin(), own.end(), pending))
+        return true;
+
+    // Ячейка и следующая ссылка. Вложенные вычисления стек не трогают: к их началу все
+    // ссылки уже посчитаны, поэтому буфер потока переиспользуется без выделения памяти.
+    // Кадр профилировщика открывается, когда ячейка кладётся на стек, и закрывается
+    // после её вычисления, поэтому вложенность кадров повторяет цепочку ссылок, как
+    // при рекурсивном вычислении
+    thread_local std::vector<std::pair<const Cell*, size_t>> stack;
+    stack.clear();
+    stack.emplace_back(this, 0);
+    while (!stack.empty())
+    {
+        auto [cell, next] = stack.back();
+        const auto& references = cell->impl_->GetLinkedCells();
+        while (next < references.size() && !pending(references[next]))
+            ++next;
+        stack.back().second = next + 1;
+        if (next < references.size())
+        {
+            const Cell* reference = references[next];
+            if (EvaluationProfiler* profiler = reference->sheet_.GetProfiler())
+                profiler->BeginEvaluation(reference->pos_, reference->impl_->GetAstSize());
+            stack.emplace_back(reference, 0);
+            continue;
+        }
+
+        if (cell != this && limit && limit->Expired())
+        {
+            if (limit->resume)
+            {
+                for (const auto& entry : stack)
+                {
+                    if (&entry.first->sheet_ == &sheet_)
+                        limit->resume->push_back(entry.first->pos_);
+                }
+            }
+            // Прерванные вычисления остаются в профиле кадрами до момента остановки
+            for (size_t i = stack.size() - 1; i > 0; --i)
+            {
+                if (EvaluationProfiler* profiler = stack[i].first->sheet_.GetProfiler())
+                    profiler->EndEvaluation();
+            }
+            return false;
+        }
+        stack.pop_back();
+        if (cell != this)
+        {
+            auto lock = cell->sheet_.Lock();
+            cell->Evaluate();
+            if (EvaluationProfiler* profiler = cell->sheet_.GetProfiler())
+                profiler->EndEvaluation();
+        }
+    }
+    return true;
+}
+
+FormulaValue Cell::GetOperand() const
+{
+    if (Empty())
+        return 0.0;
+
+    auto value = GetValue();
+    if (std::holds_alternative<double>(value))
+        return std::get<double>(value);
+    if (std::holds_alternative<FormulaError>(value))
+        return std::get<FormulaError>(value);
+    return TextToOperand(impl_->GetText());
+}
+
+void Cell::LinkReferences()
+{
+    // Все ячейки, на которые ссылается формула, хранятся в таблице
+    // и не удаляются, пока на них есть ссылки
+    std::vector<const Cell*> cells;
+    for (Position pos : impl_->GetReferencedCells())
+    {
+        cells.push_back(sheet_.FindCell(pos));
+        assert(cells.back() != nullptr);
+    }
+    for (auto [sheet, pos] : impl_->GetExternalCells())
+    {
+        cells.push_back(sheet->FindCell(pos));
+        assert(cells.back() != nullptr);
+    }
+    impl_->LinkReferences(std::move(cells));
+}
+
+void Cell::Invalidate()
+{
+    InvalidateCache();
+    ResetCacheDependents();
+}
+
+bool Cell::Shift(const PositionShift& shift)
+{
+    pos_ = shift.Apply(pos_);
+    dependents_ = ShiftPositions(dependents_, shift);
+    includes_ = ShiftPositions(includes_, shift);
+    return impl_->ShiftReferences(shift, {});
+}
+
+bool Cell::ShiftExternal(const Sheet& sheet, const PositionShift& shift)
+{
+    if (external_)
+    {
+        for (SheetEdges* edges : { &external_->dependents, &external_->includes })
+        {
+            for (auto& [other, positions] : *edges)
+            {
+                if (other == &sheet)
+                    positions = ShiftPositions(positions, shift);
+            }
+            RemoveEmptyEdges(*edges);
+        }
+        DropEmptyExternalEdges();
+    }
+    return impl_->ShiftReferences(shift, sheet.GetName());
+}
+
+Cell::Content Cell::GetContent(int rows, int cols) const
+{
+    if (Empty())
+        return Content();
+    return Content(impl_->Translate(rows, cols));
+}
+
+void Cell::InvalidateDependents()
+{
+    ResetCacheDependents();
+}
+
 std::string Cell::GetText() const
 {
     return impl_->GetText();
 }
 
+void Cell::PrintText(std::ostream& out) const
+{
+    impl_->PrintText(out);
+}
+
 std::vector<Position> Cell::GetReferencedCells() const
 {
     return impl_->GetReferencedCells();
@@ -72,7 +393,7 @@ void Cell::SetPos(Position pos)
 
 bool Cell::IsReferenced() const
 {
-    return !dependents_.empty() || !includes_.empty();
+    return !dependents_.empty() || (external_ && !external_->dependents.empty());
 }
 
 bool Cell::Empty() const
@@ -80,90 +401,276 @@ bool Cell::Empty() const
     return impl_->GetType() == Impl::Type::EMPTY;
 }
 
-std::unique_ptr<Cell::Impl> Cell::MakeImpl(std::string text) const
+bool Cell::IsFormula() const
+{
+    return impl_->GetType() == Impl::Type::FORMULA;
+}
+
+std::unique_ptr<Cell::Impl> Cell::MakeImpl(std::string text, const Sheet& sheet)
 {
     Impl::Type value_type = Impl::DefineType(text);
+    PerfCounters& counters = sheet.GetCounters();
 
     if (value_type == Impl::Type::FORMULA)
-        return std::make_unique<FormulaImpl>(std::move(text), sheet_);
+    {
+        counters.Add(Counter::FORMULA_PARSES);
+        counters.Add(Counter::BYTES_ALLOCATED, sizeof(FormulaImpl) + text.size());
+        return std::make_unique<FormulaImpl>(std::move(text), sheet);
+    }
     else if (value_type == Impl::Type::EMPTY)
+    {
+        counters.Add(Counter::BYTES_ALLOCATED, sizeof(EmptyImpl));
         return std::make_unique<EmptyImpl>();
+    }
     else
+    {
+        counters.Add(Counter::BYTES_ALLOCATED, sizeof(TextImpl) + text.size());
         return std::make_unique<TextImpl>(std::move(text));
+    }
 }
 
 bool Cell::CheckCyclicality(std::unique_ptr<Cell::Impl>& impl) const
 {
     auto positions = impl->GetReferencedCells();
-    Positions dependents(positions.begin(), positions.end());
-    Positions checkeds;
-    return IsCyclic(dependents, checkeds);
+    PositionSet dependents(positions.begin(), positions.end());
+    Visited visited{ &sheet_, {}, {} };
+    std::vector<std::pair<const Sheet*, Position>> stack;
+    if (Visit(sheet_, dependents, visited, stack))
+        return true;
+
+    SheetEdges external;
+    for (auto [sheet, pos] : impl->GetExternalCells())
+        AddEdges(external, sheet).insert(pos);
+    for (const auto& [sheet, cells] : external)
+    {
+        if (Visit(*sheet, cells, visited, stack))
+            return true;
+    }
+
+    // Обход с явным стеком: длинные цепочки не расходуют стек вызовов
+    while (!stack.empty())
+    {
+        auto [sheet, pos] = stack.back();
+        stack.pop_back();
+        // Пустые ячейки без ссылок не хранятся и не могут замкнуть цикл
+        const Cell* cell = sheet->FindCell(pos);
+        if (!cell)
+            continue;
+        if (Visit(*sheet, cell->includes_, visited, stack))
+            return true;
+        for (const auto& [other, cells] : cell->GetExternalIncludes())
+        {
+            if (Visit(*other, cells, visited, stack))
+                return true;
+        }
+    }
+    return false;
 }
 
-bool Cell::IsCyclic(const Positions& dependents, Positions& verified) const
+bool Cell::Visit(const Sheet& sheet, const PositionSet& cells, Visited& visited,
+    std::vector<std::pair<const Sheet*, Position>>& stack) const
 {
-    if (dependents.count(pos_))
+    if (&sheet == &sheet_ && cells.count(pos_))
         return true;
-    for (Position pos : dependents)
+    if (cells.empty())
+        return false;
+    PositionSet& verified = visited.Of(sheet);
+    for (Position pos : cells)
     {
-        if (pos.IsValid() && !verified.count(pos))
+        if (pos.IsValid() && verified.insert(pos))
         {
-            verified.insert(pos);
-            auto cell = sheet_.GetCell(pos);
-            if (cell)
-            {
-                auto ref = cell->GetReferencedCells();
-                if (IsCyclic({ ref.begin(), ref.end() }, verified))
-                    return true;
-            }
+            sheet_.GetCounters().Add(Counter::CYCLE_CHECK_VISITS);
+            stack.emplace_back(&sheet, pos);
         }
     }
     return false;
 }
 
-void Cell::RemoveOldDependents()
+void Cell::RemoveOldReferences(const PositionSet& old_includes)
 {
-    for (Position pos : dependents_)
+    for (Position pos : old_includes)
     {
-        Cell* cell = dynamic_cast<Cell*>(sheet_.GetCell(pos));
-        if (!pos.IsValid() || !cell)
+        if (includes_.count(pos))
             continue;
-        cell->includes_.erase(pos);
+        Cell* cell = sheet_.FindCell(pos);
+        if (!cell)
+            continue;
+        cell->dependents_.erase(pos_);
+        if (cell->Empty() && !cell->IsReferenced())
+            sheet_.ReleaseCell(pos);
     }
 }
 
-void Cell::AddNewDependents(const Positions& new_dependents)
+void Cell::ResetCacheDependents()
 {
-    for (Position pos : new_dependents)
+    // Явный стек вместо рекурсии: длинные цепочки не расходуют стек вызовов
+    std::vector<Cell*> stack;
+    ResetCache(*this, stack);
+    while (!stack.empty())
     {
-        Cell* cell = dynamic_cast<Cell*>(sheet_.GetCell(pos));
-        if (!pos.IsValid() || !cell)
-            continue;
+        Cell* cell = stack.back();
+        stack.pop_back();
+        ResetCache(*cell, stack);
+    }
+}
 
-        cell->dependents_.insert(pos);
+void Cell::ResetCache(const Cell& cell, std::vector<Cell*>& stack)
+{
+    auto reset = [&stack](Sheet& sheet, const PositionSet& cells)
+    {
+        for (Position pos : cells)
+        {
+            Cell* dependent = sheet.FindCell(pos);
+            // Ячейка без актуального кэша уже сброшена или ждёт в стеке вместе с зависимыми
+            if (!dependent || !dependent->HasActualCache())
+                continue;
+            sheet.GetCounters().Add(Counter::INVALIDATIONS);
+            dependent->InvalidateCache();
+            stack.push_back(dependent);
+        }
+    };
+
+    reset(cell.sheet_, cell.dependents_);
+    if (cell.external_)
+    {
+        for (const auto& [sheet, positions] : cell.external_->dependents)
+            reset(*sheet, positions);
     }
 }
 
-void Cell::ResetCacheDependents()
+void Cell::InvalidateCache()
 {
-    for (Position pos : includes_)
+    sheet_.MarkRowChanged(pos_.row);
+    // Подписчикам таблицы нужно прежнее значение, чтобы понять, изменилось ли видимое
+    if (sheet_.IsObserved() && cache_)
+        sheet_.RecordChange(pos_, *cache_);
+
+    switch (sheet_.GetCalculationMode())
     {
-        Cell* cell = dynamic_cast<Cell*>(sheet_.GetCell(pos));
-        if (!pos.IsValid() || !cell)
-            continue;
-        cell->ClearCache();
-        cell->ResetCacheDependents();
+    case CalculationMode::LAZY:
+        ClearCache();
+        break;
+    case CalculationMode::EAGER:
+        ClearCache();
+        sheet_.MarkDirty(pos_);
+        break;
+    case CalculationMode::MANUAL:
+        // Старое значение остаётся видимым до явного пересчёта
+        stale_ = true;
+        sheet_.MarkDirty(pos_);
+        break;
     }
 }
 
-void Cell::AddReferencedCells(const std::vector<Position>& new_refs)
+std::vector<const Cell*> Cell::AddReferencedCells(const std::vector<Position>& new_refs)
 {
-    includes_.clear();
-    if (!new_refs.empty())
-        includes_.insert(new_refs.begin(), new_refs.end());
+    // Ячейка, на которую ссылаются, хранится даже пустой: она держит обратное ребро
+    std::vector<const Cell*> cells;
+    cells.reserve(new_refs.size());
+    for (Position pos : new_refs)
+    {
+        includes_.insert(pos);
+        Cell& cell = sheet_.GetOrCreateCell(pos);
+        cell.dependents_.insert(pos_);
+        cells.push_back(&cell);
+    }
+    return cells;
+}
+
+void Cell::AddExternalCells(const std::vector<ExternalCell>& new_refs, std::vector<const Cell*>& cells)
+{
+    for (auto [sheet, pos] : new_refs)
+    {
+        AddEdges(GetExternalEdges().includes, sheet).insert(pos);
+        Cell& cell = sheet->GetOrCreateCell(pos);
+        AddEdges(cell.GetExternalEdges().dependents, &sheet_).insert(pos_);
+        cells.push_back(&cell);
+    }
+}
+
+void Cell::RemoveOldExternalReferences(const SheetEdges& old_includes)
+{
+    for (const auto& [sheet, positions] : old_includes)
+    {
+        const PositionSet* current = FindEdges(GetExternalIncludes(), sheet);
+        for (Position pos : positions)
+        {
+            if (current && current->count(pos))
+                continue;
+            Cell* cell = sheet->FindCell(pos);
+            if (!cell || !cell->external_)
+                continue;
+            auto& dependents = cell->external_->dependents;
+            for (auto& [other, cells] : dependents)
+            {
+                if (other == &sheet_)
+                    cells.erase(pos_);
+            }
+            RemoveEmptyEdges(dependents);
+            cell->DropEmptyExternalEdges();
+            if (cell->Empty() && !cell->IsReferenced())
+                sheet->ReleaseCell(pos);
+        }
+    }
+    DropEmptyExternalEdges();
+}
 
+Cell::ExternalEdges& Cell::GetExternalEdges()
+{
+    if (!external_)
+        external_ = std::make_unique<ExternalEdges>();
+    return *external_;
 }
 
+void Cell::DropEmptyExternalEdges()
+{
+    if (external_ && external_->dependents.empty() && external_->includes.empty())
+        external_.reset();
+}
+
+
+
+/********************   Cell::Content   ********************/
+
+Cell::Content::Content() = default;
+Cell::Content::Content(Content&& other) noexcept = default;
+Cell::Content& Cell::Content::operator=(Content&& other) noexcept = default;
+Cell::Content::~Content() = default;
+
+Cell::Content::Content(std::unique_ptr<Impl> impl)
+    : impl_(std::move(impl))
+{
+}
+
+bool Cell::Content::Empty() const
+{
+    return !impl_ || impl_->GetType() == Impl::Type::EMPTY;
+}
+
+bool Cell::Content::IsFormula() const
+{
+    return impl_ && impl_->GetType() == Impl::Type::FORMULA;
+}
+
+std::vector<Position> Cell::Content::GetReferencedCells() const
+{
+    return impl_ ? impl_->GetReferencedCells() : std::vector<Position>();
+}
+
+std::vector<Cell::ExternalCell> Cell::Content::GetExternalCells() const
+{
+    return impl_ ? impl_->GetExternalCells() : std::vector<ExternalCell>();
+}
+
+Cell::Content Cell::Content::Translate(int rows, int cols) const
+{
+    return Content(impl_ ? impl_->Translate(rows, cols) : nullptr);
+}
+
+Cell::Content Cell::Parse(const Sheet& sheet, std::string text)
+{
+    return Content(MakeImpl(std::move(text), sheet));
+}
 
 
 /********************   Cell::Impl   ********************/
@@ -196,11 +703,44 @@ std::string Cell::EmptyImpl::GetText() const
     return std::string();
 }
 
+void Cell::EmptyImpl::PrintText(std::ostream& /*out*/) const
+{
+}
+
 std::vector<Position> Cell::EmptyImpl::GetReferencedCells() const
 {
     return {};
 }
 
+std::vector<Cell::ExternalCell> Cell::EmptyImpl::GetExternalCells() const
+{
+    return {};
+}
+
+size_t Cell::EmptyImpl::GetAstSize() const
+{
+    return 0;
+}
+
+void Cell::EmptyImpl::LinkReferences(std::vector<const Cell*> /*cells*/)
+{
+}
+
+const std::vector<const Cell*>& Cell::EmptyImpl::GetLinkedCells() const
+{
+    return NO_CELLS;
+}
+
+bool Cell::EmptyImpl::ShiftReferences(const PositionShift& /*shift*/, std::string_view /*sheet*/)
+{
+    return false;
+}
+
+std::unique_ptr<Cell::Impl> Cell::EmptyImpl::Translate(int /*rows*/, int /*cols*/) const
+{
+    return std::make_unique<EmptyImpl>();
+}
+
 
 /********************   Cell::TextImpl   ********************/
 
@@ -227,18 +767,62 @@ std::string Cell::TextImpl::GetText() const
     return value_;
 }
 
+void Cell::TextImpl::PrintText(std::ostream& out) const
+{
+    out << value_;
+}
+
 std::vector<Position> Cell::TextImpl::GetReferencedCells() const
 {
     return {};
 }
 
+std::vector<Cell::ExternalCell> Cell::TextImpl::GetExternalCells() const
+{
+    return {};
+}
+
+size_t Cell::TextImpl::GetAstSize() const
+{
+    return 0;
+}
+
+void Cell::TextImpl::LinkReferences(std::vector<const Cell*> /*cells*/)
+{
+}
+
+const std::vector<const Cell*>& Cell::TextImpl::GetLinkedCells() const
+{
+    return NO_CELLS;
+}
+
+bool Cell::TextImpl::ShiftReferences(const PositionShift& /*shift*/, std::string_view /*sheet*/)
+{
+    return false;
+}
+
+std::unique_ptr<Cell::Impl> Cell::TextImpl::Translate(int /*rows*/, int /*cols*/) const
+{
+    return std::make_unique<TextImpl>(value_);
+}
+
 
 /********************   Cell::FormulaImpl   ********************/
 
-Cell::FormulaImpl::FormulaImpl(std::string text, const SheetInterface& sheet)
+Cell::FormulaImpl::FormulaImpl(std::string text, const Sheet& sheet)
     : sheet_(sheet)
     , value_(ParseFormula(text.substr(1))) // Обрезаем '='
+{
+    for (const auto& cell : value_->GetExternalCells())
+    {
+        if (!sheet_.FindSheet(cell.sheet))
+            throw FormulaException("Unknown sheet: " + cell.sheet);
+    }
+}
 
+Cell::FormulaImpl::FormulaImpl(std::unique_ptr<FormulaInterface> formula, const Sheet& sheet)
+    : sheet_(sheet)
+    , value_(std::move(formula))
 {
 }
 
@@ -249,7 +833,9 @@ Cell::FormulaImpl::Type Cell::FormulaImpl::GetType() const
 
 Cell::Value Cell::FormulaImpl::GetValue() const
 {
-    auto out_value = value_->Evaluate(sheet_);
+    // Ячейки читаются по заранее найденным указателям, без поиска в таблице
+    auto operand = [this](Position, size_t index) { return references_[index]->GetOperand(); };
+    auto out_value = value_->Evaluate(CellValue(operand));
     if (std::holds_alternative<double>(out_value))
         return std::get<double>(out_value);
     else
@@ -258,10 +844,56 @@ Cell::Value Cell::FormulaImpl::GetValue() const
 
 std::string Cell::FormulaImpl::GetText() const
 {
-    return FORMULA_SIGN + value_->GetExpression();
+    // Канонический текст хранит только формула: отдельная копия в ячейке удвоила бы память
+    std::string text(1, FORMULA_SIGN);
+    value_->PrintExpression(text);
+    return text;
+}
+
+void Cell::FormulaImpl::PrintText(std::ostream& out) const
+{
+    out << FORMULA_SIGN;
+    value_->PrintExpression(out);
 }
 
 std::vector<Position> Cell::FormulaImpl::GetReferencedCells() const
 {
     return value_->GetReferencedCells();
-}
\ No newline at end of file
+}
+
+std::vector<Cell::ExternalCell> Cell::FormulaImpl::GetExternalCells() const
+{
+    // Листы книги не удаляются, поэтому имена, проверенные при разборе, всегда находятся
+    std::vector<ExternalCell> cells;
+    for (auto& [name, pos] : value_->GetExternalCells())
+    {
+        cells.push_back({ sheet_.FindSheet(name), pos });
+        assert(cells.back().sheet != nullptr);
+    }
+    return cells;
+}
+
+size_t Cell::FormulaImpl::GetAstSize() const
+{
+    return value_->GetAstSize();
+}
+
+void Cell::FormulaImpl::LinkReferences(std::vector<const Cell*> cells)
+{
+    references_ = std::move(cells);
+}
+
+const std::vector<const Cell*>& Cell::FormulaImpl::GetLinkedCells() const
+{
+    return references_;
+}
+
+bool Cell::FormulaImpl::ShiftReferences(const PositionShift& shift, std::string_view sheet)
+{
+    return value_->ShiftReferences(shift, sheet);
+}
+
+std::unique_ptr<Cell::Impl> Cell::FormulaImpl::Translate(int rows, int cols) const
+{
+    return std::make_unique<FormulaImpl>(value_->Translate(rows, cols), sheet_);
+}
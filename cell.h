@@ -2,31 +2,134 @@
 
 #include "common.h"
 #include "formula.h"
+#include "position_set.h"
 
+#include <atomic>
+#include <chrono>
 #include <functional>
 #include <optional>
 #include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 
 class Sheet;
 
 
-class Cell : public CellInterface
+// Токен отмены чтения с ограничением. Cancel можно вызывать из любого потока
+class CancellationToken
 {
 public:
-    Cell(SheetInterface& sheet, Position pos);
-    Cell(SheetInterface& sheet, Position pos, std::string text);
+    void Cancel()
+    {
+        cancelled_.store(true, std::memory_order_relaxed);
+    }
+
+    void Reset()
+    {
+        cancelled_.store(false, std::memory_order_relaxed);
+    }
+
+    bool IsCancelled() const
+    {
+        return cancelled_.load(std::memory_order_relaxed);
+    }
+
+private:
+    std::atomic<bool> cancelled_{ false };
+};
+
+
+class Cell final : public CellInterface
+{
+    class Impl;
+
+public:
+    // Ячейка другого листа книги, на которую ссылается формула
+    struct ExternalCell
+    {
+        Sheet*   sheet;
+        Position pos;
+    };
+
+    // Рёбра к ячейкам других листов книги, по листам
+    using SheetEdges = std::vector<std::pair<Sheet*, PositionSet>>;
+
+    // Разобранное содержимое ячейки. Формула разбирается один раз, а затем
+    // копируется в другие ячейки со сдвигом ссылок без повторного разбора.
+    // Пустое содержимое ничего не хранит
+    class Content
+    {
+    public:
+        Content();
+        Content(Content&& other) noexcept;
+        Content& operator=(Content&& other) noexcept;
+        ~Content();
+
+        bool                  Empty() const;
+        bool                  IsFormula() const;
+        std::vector<Position> GetReferencedCells() const;
+        std::vector<ExternalCell> GetExternalCells() const;
+        Content               Translate(int rows, int cols) const;  // Копия со ссылками, сдвинутыми как при копировании ячейки
+
+    private:
+        friend class Cell;
+        explicit Content(std::unique_ptr<Impl> impl);
+
+        std::unique_ptr<Impl> impl_;
+    };
+
+    // Разбирает текст ячейки. Бросает FormulaException для некорректной формулы
+    // и для ссылки на лист, которого нет в книге
+    static Content        Parse(const Sheet& sheet, std::string text);
+
+    Cell(Sheet& sheet, Position pos);
     virtual ~Cell() override = default;
 
     void                  Set(std::string text);
     void                  Clear();
     Value                 GetValue() const override;
+    // Значение, если его удалось вычислить до deadline и без отмены token, иначе
+    // std::nullopt. Вычисление прерывается между ячейками; посчитанные ячейки остаются
+    // в кэше, и следующий вызов продолжает с того же места. Место остановки хранится
+    // в progress, а без него — у потока для последней читавшейся так ячейки
+    std::optional<Value>  GetValueWithin(std::chrono::steady_clock::time_point deadline,
+                                         const CancellationToken* token = nullptr,
+                                         std::vector<Position>* progress = nullptr) const;
+    FormulaValue          GetOperand() const;               // Значение как операнд формулы
     std::string           GetText() const override;
+    void                  PrintText(std::ostream& out) const;  // Как GetText, но без копии текста
     std::vector<Position> GetReferencedCells() const override;
     void                  SetPos(Position pos);
     bool                  IsReferenced() const;
     bool                  Empty() const;
+    bool                  IsFormula() const;
     void                  ClearCache();
+    bool                  HasActualCache() const;           // Есть вычисленное и не устаревшее значение
+    bool                  IsStale() const;                  // Значение устарело, но ещё показывается (ручной пересчёт)
+    const PositionSet&      GetDependents() const;
+    const PositionSet&      GetIncludes() const;
+    const SheetEdges&     GetExternalDependents() const;
+    const SheetEdges&     GetExternalIncludes() const;
+    void                  LinkReferences();                 // Заново связывает формулу с ячейками, на которые она ссылается
+    void                  Invalidate();                     // Сбрасывает кэш ячейки и зависимых от неё с учётом режима пересчёта
+
+    // Переносит позицию ячейки, её рёбра и ссылки формулы при вставке или
+    // удалении строк и столбцов и переносе областей. Возвращает true, если формула
+    // потеряла ссылки или их порядок изменился и её нужно заново связать и пересчитать
+    bool                  Shift(const PositionShift& shift);
+    // То же для рёбер и ссылок формулы, ведущих на ячейки листа sheet книги,
+    // когда сдвигаются ячейки этого листа
+    bool                  ShiftExternal(const Sheet& sheet, const PositionShift& shift);
+
+    // Копия содержимого со ссылками, сдвинутыми на rows строк и cols столбцов
+    Content               GetContent(int rows = 0, int cols = 0) const;
+
+    // Записывает содержимое, не проверяя циклы и не сбрасывая кэш зависимых ячеек:
+    // массовые операции делают это один раз на всю область
+    void                  SetContent(Content content);
+    void                  InvalidateDependents();           // Сбрасывает кэш зависимых ячеек
 
 private:
     class Impl
@@ -37,25 +140,43 @@ private:
 
         virtual Value                 GetValue() const = 0;
         virtual std::string           GetText() const = 0;
+        virtual void                  PrintText(std::ostream& out) const = 0;
         virtual Type                  GetType() const = 0;
         virtual std::vector<Position> GetReferencedCells() const = 0;
+        virtual std::vector<ExternalCell> GetExternalCells() const = 0;
+        virtual size_t                GetAstSize() const = 0;
+        // Ячейки из GetReferencedCells, затем из GetExternalCells
+        virtual void                  LinkReferences(std::vector<const Cell*> cells) = 0;
+        virtual const std::vector<const Cell*>& GetLinkedCells() const = 0;
+        // Пустое имя листа — ссылки на свой лист
+        virtual bool                  ShiftReferences(const PositionShift& shift, std::string_view sheet) = 0;
+        virtual std::unique_ptr<Impl> Translate(int rows, int cols) const = 0;
         static Type                   DefineType(const std::string& text);
     };
 
     class FormulaImpl : public Impl
     {
     public:
-        FormulaImpl(std::string text, const SheetInterface& sheet);
+        FormulaImpl(std::string text, const Sheet& sheet);
+        FormulaImpl(std::unique_ptr<FormulaInterface> formula, const Sheet& sheet);
         virtual ~FormulaImpl() override = default;
 
         virtual Type          GetType() const override;
         virtual Value         GetValue() const override;
         virtual std::string   GetText() const override;
+        virtual void          PrintText(std::ostream& out) const override;
         std::vector<Position> GetReferencedCells() const override;
+        std::vector<ExternalCell> GetExternalCells() const override;
+        size_t                GetAstSize() const override;
+        void                  LinkReferences(std::vector<const Cell*> cells) override;
+        const std::vector<const Cell*>& GetLinkedCells() const override;
+        bool                  ShiftReferences(const PositionShift& shift, std::string_view sheet) override;
+        std::unique_ptr<Impl> Translate(int rows, int cols) const override;
 
     private:
-        const SheetInterface& sheet_;
+        const Sheet& sheet_;
         std::unique_ptr<FormulaInterface> value_;
+        std::vector<const Cell*> references_; // Ячейки из GetReferencedCells и GetExternalCells, в том же порядке
     };
 
     class EmptyImpl : public Impl
@@ -67,7 +188,14 @@ private:
         virtual Type          GetType() const override;
         virtual Value         GetValue() const override;
         virtual std::string   GetText() const override;
+        virtual void          PrintText(std::ostream& out) const override;
         std::vector<Position> GetReferencedCells() const override;
+        std::vector<ExternalCell> GetExternalCells() const override;
+        size_t                GetAstSize() const override;
+        void                  LinkReferences(std::vector<const Cell*> cells) override;
+        const std::vector<const Cell*>& GetLinkedCells() const override;
+        bool                  ShiftReferences(const PositionShift& shift, std::string_view sheet) override;
+        std::unique_ptr<Impl> Translate(int rows, int cols) const override;
     };
 
     class TextImpl : public Impl
@@ -79,30 +207,89 @@ private:
         virtual Type          GetType() const override;
         virtual Value         GetValue() const override;
         virtual std::string   GetText() const override;
+        virtual void          PrintText(std::ostream& out) const override;
         std::vector<Position> GetReferencedCells() const override;
+        std::vector<ExternalCell> GetExternalCells() const override;
+        size_t                GetAstSize() const override;
+        void                  LinkReferences(std::vector<const Cell*> cells) override;
+        const std::vector<const Cell*>& GetLinkedCells() const override;
+        bool                  ShiftReferences(const PositionShift& shift, std::string_view sheet) override;
+        std::unique_ptr<Impl> Translate(int rows, int cols) const override;
 
     private:
         std::string value_;
     };
 
 private:
-    std::unique_ptr<Impl> MakeImpl(std::string text) const;   // Создание конкретной реализации значения ячейки
+    // Создание конкретной реализации значения ячейки
+    static std::unique_ptr<Impl> MakeImpl(std::string text, const Sheet& sheet);
+    void Replace(std::unique_ptr<Impl> value);                 // Замена значения с обновлением рёбер
+    // Просмотренные при проверке циклов ячейки по листам. Свой лист хранится
+    // отдельно: проверка без ссылок на другие листы не ищет листы в словаре
+    struct Visited
+    {
+        const Sheet* own_sheet;
+        PositionSet  own;
+        std::unordered_map<const Sheet*, PositionSet> others;
+
+        PositionSet& Of(const Sheet& sheet)
+        {
+            return &sheet == own_sheet ? own : others[&sheet];
+        }
+    };
+
+    // Рёбра к другим листам; хранятся отдельно, чтобы не увеличивать ячейки без таких рёбер
+    struct ExternalEdges
+    {
+        SheetEdges dependents;
+        SheetEdges includes;
+    };
+
     bool CheckCyclicality(std::unique_ptr<Impl>& impl) const; // Проверка циклической зависимости
-    bool IsCyclic(const Positions& dependents, Positions& viewed) const;
+    // Ставит в стек обхода ещё не просмотренные ячейки cells листа sheet.
+    // Возвращает true, если среди них эта ячейка
+    bool Visit(const Sheet& sheet, const PositionSet& cells, Visited& visited,
+        std::vector<std::pair<const Sheet*, Position>>& stack) const;
+
+    // Срок и токен отмены вычисления. Часы опрашиваются не на каждой ячейке
+    struct Limit
+    {
+        std::chrono::steady_clock::time_point deadline;
+        const CancellationToken*              token = nullptr;
+        size_t                                computed = 0;
+        std::vector<Position>*                resume = nullptr; // Куда сложить непосчитанные ячейки при прерывании
+
+        bool Expired();
+    };
+
+    const Value& Compute() const;                              // Вычисляет значение и кладёт его в кэш
+    const Value& Evaluate() const;                             // То же, когда ссылки уже посчитаны; без кадра профилировщика
+    // Вычисляет непосчитанные формулы, от которых зависит ячейка. Возвращает false,
+    // если вычисление прервано по limit
+    bool ComputeReferences(Limit* limit = nullptr) const;
 
-    void RemoveOldDependents();
-    void AddNewDependents(const Positions& new_dependents);
-    void AddReferencedCells(const std::vector<Position>& new_refs);
+    void RemoveOldReferences(const PositionSet& old_includes);   // Удаление рёбер к ячейкам, на которые больше не ссылаемся
+    // Добавляет рёбра к ячейкам, создавая их, и возвращает эти ячейки в том же порядке
+    std::vector<const Cell*> AddReferencedCells(const std::vector<Position>& new_refs);
+    void AddExternalCells(const std::vector<ExternalCell>& new_refs, std::vector<const Cell*>& cells);
+    void RemoveOldExternalReferences(const SheetEdges& old_includes);
+    ExternalEdges& GetExternalEdges();                         // Создаёт рёбра к другим листам, если их ещё нет
+    void DropEmptyExternalEdges();
     void ResetCacheDependents();
+    // Сбрасывает кэш зависимых от cell ячеек и кладёт их в стек обхода
+    static void ResetCache(const Cell& cell, std::vector<Cell*>& stack);
+    void InvalidateCache();                                    // Сброс кэша с учётом режима пересчёта таблицы
 
 private:
-    SheetInterface& sheet_;               // Ссылка на таблицу, к которой принадлежит ячейка
+    Sheet& sheet_;                        // Ссылка на таблицу, к которой принадлежит ячейка
     
     Position              pos_;           // Позиция ячейки
     std::unique_ptr<Impl> impl_;          // Значение ячейки таблицы
 
-    Positions             dependents_;    // Зависимые ячейки (ячейки, на значения которых влияет данная ячейка)
-    Positions             includes_;      // Используемые ячейки (ячейки, значения которых используются в данной ячейке)
+    PositionSet             dependents_;    // Зависимые ячейки (ячейки, на значения которых влияет данная ячейка)
+    PositionSet             includes_;      // Используемые ячейки (ячейки, значения которых используются в данной ячейке)
+    std::unique_ptr<ExternalEdges> external_; // То же для ячеек других листов книги
     
     mutable std::optional<Value> cache_;  // Вычисленное значение
+    mutable bool          stale_ = false; // Значение в кэше устарело, но ещё показывается (ручной пересчёт)
 };
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <cstdint>
 #include <iosfwd>
 #include <memory>
 #include <stdexcept>
@@ -16,26 +17,130 @@ struct Position
     int row = 0;
     int col = 0;
 
-    bool operator==(Position rhs) const;
+    constexpr bool operator==(Position rhs) const;
     bool operator<(Position rhs) const;
 
-    bool IsValid() const;
+    constexpr bool IsValid() const;
     std::string ToString() const;
 
     static Position FromString(std::string_view str);
 
+    // Кодек A1 без выделения памяти. ToChars пишет имя ячейки в buffer
+    // (не меньше MAX_STRING_LENGTH байт, без завершающего нуля) и возвращает
+    // длину; для некорректной позиции возвращает 0. FromChars возвращает NONE
+    // для любой строки, которая не является именем существующей ячейки.
+    constexpr size_t ToChars(char* buffer) const;
+    static constexpr Position FromChars(std::string_view str);
+
     static const int MAX_ROWS = 16384;
     static const int MAX_COLS = 16384;
+    static const size_t MAX_STRING_LENGTH = 8;  // "XFD16384"
     static const Position NONE;
 };
 
+inline constexpr Position Position::NONE = { -1, -1 };
+
+constexpr bool Position::operator==(const Position rhs) const
+{
+    return row == rhs.row && col == rhs.col;
+}
+
+constexpr bool Position::IsValid() const
+{
+    return row >= 0 && col >= 0 && row < MAX_ROWS && col < MAX_COLS;
+}
+
+constexpr size_t Position::ToChars(char* buffer) const
+{
+    if (!IsValid())
+        return 0;
+
+    constexpr int LETTERS = 26;
+    size_t length = 0;
+
+    // Буквы столбца: биективная система счисления по основанию 26
+    char letters[3] = {};
+    size_t letter_count = 0;
+    for (int c = col; c >= 0; c = c / LETTERS - 1)
+        letters[letter_count++] = static_cast<char>('A' + c % LETTERS);
+    while (letter_count > 0)
+        buffer[length++] = letters[--letter_count];
+
+    char digits[5] = {};
+    size_t digit_count = 0;
+    for (int r = row + 1; r > 0; r /= 10)
+        digits[digit_count++] = static_cast<char>('0' + r % 10);
+    while (digit_count > 0)
+        buffer[length++] = digits[--digit_count];
+
+    return length;
+}
+
+constexpr Position Position::FromChars(std::string_view str)
+{
+    constexpr int LETTERS = 26;
+    constexpr size_t MAX_LETTERS = 3;
+
+    size_t i = 0;
+    int col = 0;
+    for (; i < str.size() && str[i] >= 'A' && str[i] <= 'Z'; ++i)
+    {
+        if (i == MAX_LETTERS)
+            return NONE;
+        col = col * LETTERS + (str[i] - 'A' + 1);
+    }
+    if (i == 0 || i == str.size())
+        return NONE;
+
+    int row = 0;
+    for (; i < str.size(); ++i)
+    {
+        if (str[i] < '0' || str[i] > '9')
+            return NONE;
+        row = row * 10 + (str[i] - '0');
+        if (row > MAX_ROWS)
+            return NONE;
+    }
+
+    Position pos{ row - 1, col - 1 };
+    return pos.IsValid() ? pos : NONE;
+}
+
+// Пакетные варианты кодека для импорта: пишут в буферы вызывающего кода.
+// FormatPositions разделяет имена separator и возвращает число записанных байт;
+// buffer должен вмещать count * (MAX_STRING_LENGTH + 1) байт
+void ParsePositions(const std::string_view* names, size_t count, Position* out);
+size_t FormatPositions(const Position* positions, size_t count, char* buffer, char separator);
+
+
+// Упаковка позиции в 32-битный ключ. Обратима для корректных позиций
+inline constexpr uint32_t PackPosition(Position pos)
+{
+    return static_cast<uint32_t>(pos.row) << 16 | (static_cast<uint32_t>(pos.col) & 0xFFFF);
+}
+
+inline constexpr Position UnpackPosition(uint32_t key)
+{
+    return { static_cast<int>(key >> 16), static_cast<int>(key & 0xFFFF) };
+}
+
+// Перемешивание ключа (финализатор splitmix64): соседние позиции
+// и позиции одной строки или столбца попадают в разные корзины
+inline constexpr uint64_t MixKey(uint64_t key)
+{
+    key ^= key >> 30;
+    key *= 0xBF58476D1CE4E5B9ULL;
+    key ^= key >> 27;
+    key *= 0x94D049BB133111EBULL;
+    key ^= key >> 31;
+    return key;
+}
 
 struct HashPosition
 {
     size_t operator() (const Position& pos) const
     {
-        return std::hash<double>{}(pos.col)*
-            std::hash<double>{}(pos.row) * 10;
+        return static_cast<size_t>(MixKey(PackPosition(pos)));
     }
 };
 
@@ -51,6 +156,108 @@ struct Size
 };
 
 
+// Прямоугольная область ячеек от first до last включительно.
+// Область по умолчанию пуста и не содержит ни одной позиции
+struct Range
+{
+    Position first = Position::NONE;
+    Position last = Position::NONE;
+
+    constexpr bool IsValid() const
+    {
+        return first.IsValid() && last.IsValid() && first.row <= last.row && first.col <= last.col;
+    }
+
+    constexpr bool Contains(Position pos) const
+    {
+        return pos.row >= first.row && pos.row <= last.row && pos.col >= first.col && pos.col <= last.col;
+    }
+
+    // Только для непустой области
+    constexpr Size GetSize() const
+    {
+        return { last.row - first.row + 1, last.col - first.col + 1 };
+    }
+
+    constexpr size_t GetCellCount() const
+    {
+        Size size = GetSize();
+        return static_cast<size_t>(size.rows) * static_cast<size_t>(size.cols);
+    }
+};
+
+
+// Перенос позиций: позиции из области moved сдвигаются на rows строк и cols
+// столбцов, остальные позиции из области deleted исчезают. Так описываются
+// вставка и удаление строк и столбцов и перенос области ячеек
+struct PositionShift
+{
+    enum class Axis
+    {
+        ROWS,
+        COLS,
+    };
+
+    Range moved;
+    int   rows = 0;
+    int   cols = 0;
+    Range deleted;
+
+    // Вставка count строк (столбцов) перед first либо удаление count строк
+    // (столбцов), начиная с first
+    static constexpr PositionShift Lines(Axis axis, int first, int count, bool insert)
+    {
+        const bool by_rows = axis == Axis::ROWS;
+        auto lines = [by_rows](int from, int to) -> Range
+        {
+            if (from > to)
+                return {};
+            return by_rows ? Range{ { from, 0 }, { to, Position::MAX_COLS - 1 } }
+                           : Range{ { 0, from }, { Position::MAX_ROWS - 1, to } };
+        };
+
+        const int limit = by_rows ? Position::MAX_ROWS : Position::MAX_COLS;
+        const int offset = insert ? count : -count;
+        PositionShift shift;
+        shift.moved = lines(insert ? first : first + count, limit - 1);
+        (by_rows ? shift.rows : shift.cols) = offset;
+        if (!insert)
+            shift.deleted = lines(first, first + count - 1);
+        return shift;
+    }
+
+    // Перенос области from в область того же размера с левым верхним углом to;
+    // ячейки, которые были на месте переносимых, исчезают
+    static constexpr PositionShift Move(Range from, Position to)
+    {
+        PositionShift shift;
+        shift.moved = from;
+        shift.rows = to.row - from.first.row;
+        shift.cols = to.col - from.first.col;
+        shift.deleted = { to, { from.last.row + shift.rows, from.last.col + shift.cols } };
+        return shift;
+    }
+
+    constexpr bool Affects(Position pos) const
+    {
+        return moved.Contains(pos) || deleted.Contains(pos);
+    }
+
+    // Новая позиция; NONE для удалённой или вытесненной за пределы таблицы
+    constexpr Position Apply(Position pos) const
+    {
+        if (!pos.IsValid())
+            return pos;
+        if (moved.Contains(pos))
+        {
+            Position to{ pos.row + rows, pos.col + cols };
+            return to.IsValid() ? to : Position::NONE;
+        }
+        return deleted.Contains(pos) ? Position::NONE : pos;
+    }
+};
+
+
 // Описывает ошибки, которые могут возникнуть при вычислении формулы.
 class FormulaError
 {
@@ -93,6 +300,24 @@ public:
 };
 
 
+// Исключение, выбрасываемое при попытке вставить строки или столбцы,
+// если непустые ячейки окажутся за пределами таблицы
+class TableTooBigException : public std::runtime_error
+{
+public:
+    using std::runtime_error::runtime_error;
+};
+
+
+// Исключение, выбрасываемое при попытке добавить в книгу лист с пустым
+// или уже занятым именем
+class InvalidSheetNameException : public std::invalid_argument
+{
+public:
+    using std::invalid_argument::invalid_argument;
+};
+
+
 // Исключение, выбрасываемое при попытке задать формулу, которая приводит к
 // циклической зависимости между ячейками
 class CircularDependencyException : public std::runtime_error
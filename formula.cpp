@@ -5,8 +5,8 @@
 #include <algorithm>
 #include <cassert>
 #include <cctype>
-#include <sstream>
-#include <set>
+#include <cerrno>
+#include <cstdlib>
 
 namespace
 {
@@ -18,10 +18,19 @@ namespace
         {
         }
 
+        explicit Formula(FormulaAST ast)
+            :ast_(std::move(ast))
+        {
+        }
+
         Value Evaluate(const SheetInterface& sheet) const override
         {
-            CellValue cell_value = [&sheet](Position pos)
+            // Другие листы через интерфейс одного листа недоступны
+            const size_t own_cells = GetReferencedCells().size();
+            auto cell_value = [&sheet, own_cells](Position pos, size_t index) -> ExprValue
             {
+                if (index >= own_cells)
+                    return FormulaError(FormulaError::Category::Ref);
                 if (!sheet.GetCell(pos))
                     return 0.0;
                 auto value = sheet.GetCell(pos)->GetValue();
@@ -31,51 +40,78 @@ namespace
                 }
                 else if (std::holds_alternative<std::string>(value))
                 {
-                    std::string text = sheet.GetCell(pos)->GetText();
-
-                    if (text.empty())
-                        return 0.0;
-                    if (text.front() == ESCAPE_SIGN)
-                        throw FormulaError(FormulaError::Category::Value);
-
-                    try
-                    {
-                        return std::stod(text);
-                    }
-                    catch (...)
-                    {
-                        throw FormulaError(FormulaError::Category::Value);
-                    }
+                    return TextToOperand(sheet.GetCell(pos)->GetText());
                 }
                 else
                 {
-                    throw std::get<FormulaError>(value);
+                    return std::get<FormulaError>(value);
                 }
             };
 
-            try
+            return ast_.Execute(cell_value);
+        }
+
+        Value Evaluate(CellValue cell_value) const override
+        {
+            return ast_.Execute(cell_value);
+        }
+
+        std::string GetExpression() const override
+        {
+            std::string expression;
+            ast_.PrintFormula(expression);
+            return expression;
+        }
+
+        void PrintExpression(std::ostream& out) const override
+        {
+            ast_.PrintFormula(out);
+        }
+
+        void PrintExpression(std::string& out) const override
+        {
+            ast_.PrintFormula(out);
+        }
+
+        std::vector<Position> GetReferencedCells() const override
+        {
+            std::vector<Position> cells;
+            // Ячейки других листов и удалённые ячейки (#REF!) идут в конце списка
+            for (const auto& cell : ast_.GetCells())
             {
-                return ast_.Execute(cell_value);
+                if (!cell.pos.IsValid() || !cell.sheet.empty())
+                    break;
+                cells.push_back(cell.pos);
             }
-            catch (const FormulaError& fe)
+            return cells;
+        }
+
+        std::vector<ExternalReference> GetExternalCells() const override
+        {
+            std::vector<ExternalReference> cells;
+            for (const auto& cell : ast_.GetCells())
             {
-                return fe;
+                if (!cell.pos.IsValid())
+                    break;
+                if (!cell.sheet.empty())
+                    cells.push_back({ cell.sheet, cell.pos });
             }
+            return cells;
+        }
 
+        bool ShiftReferences(const PositionShift& shift, std::string_view sheet) override
+        {
+            return ast_.ShiftReferences(shift, sheet);
         }
 
-        std::string GetExpression() const override
+        std::unique_ptr<FormulaInterface> Translate(int rows, int cols) const override
         {
-            std::ostringstream out;
-            ast_.PrintFormula(out);
-            return out.str();
+            return std::make_unique<Formula>(ast_.Translate(rows, cols));
         }
 
-        std::vector<Position> GetReferencedCells() const override
+        size_t GetAstSize() const override
         {
-            auto positions = ast_.GetCells();
-            std::set<Position> unique_ref = { positions.begin(), positions.end() };
-            return { unique_ref.begin(), unique_ref.end() };
+            return ast_.GetSize();
         }
 
         virtual ~Formula() override = default;
@@ -87,6 +123,22 @@ namespace
 }  // namespace
 
 
+FormulaValue TextToOperand(const std::string& text)
+{
+    if (text.empty())
+        return 0.0;
+    if (text.front() == ESCAPE_SIGN)
+        return FormulaError(FormulaError::Category::Value);
+
+    // strtod вместо stod: ошибки разбора не должны выражаться исключениями
+    char* end = nullptr;
+    errno = 0;
+    double result = std::strtod(text.c_str(), &end);
+    if (end != text.c_str() + text.size() || errno == ERANGE)
+        return FormulaError(FormulaError::Category::Value);
+    return result;
+}
+
 std::unique_ptr<FormulaInterface> ParseFormula(std::string expression)
 {
     return std::make_unique<Formula>(std::move(expression));
@@ -3,23 +3,113 @@
 #include "common.h"
 
 #include <memory>
+#include <string>
+#include <string_view>
+#include <type_traits>
 #include <vector>
 
 
+// Значение формулы или операнда формулы: число либо ошибка
+using FormulaValue = std::variant<double, FormulaError>;
+
+
+// Ссылка формулы на ячейку другого листа книги
+struct ExternalReference
+{
+    std::string sheet;  // Имя листа без кавычек
+    Position    pos;
+};
+
+
+// Ссылка на функцию, которая возвращает значение ячейки как операнд формулы.
+// Функция вызывается с позицией ячейки и её номером среди различных ячеек
+// формулы (в порядке GetReferencedCells, затем GetExternalCells) либо только
+// с позицией.
+// Не выделяет память и копируется как пара указателей, поэтому передаётся
+// по значению через всё дерево. Не владеет вызываемым объектом: он должен
+// жить, пока используется ссылка
+class CellValue
+{
+    template <typename Accessor>
+    static constexpr bool BY_INDEX = std::is_invocable_r_v<FormulaValue, const Accessor&, Position, size_t>;
+
+public:
+    template <typename Accessor,
+        typename = std::enable_if_t<!std::is_same_v<std::decay_t<Accessor>, CellValue>
+            && (BY_INDEX<Accessor> || std::is_invocable_r_v<FormulaValue, const Accessor&, Position>)>>
+    CellValue(const Accessor& accessor)
+        : accessor_(&accessor)
+        , call_([](const void* accessor, Position pos, size_t index) -> FormulaValue
+            {
+                const auto& call = *static_cast<const Accessor*>(accessor);
+                if constexpr (BY_INDEX<Accessor>)
+                    return call(pos, index);
+                else
+                    return call(pos);
+            })
+    {
+    }
+
+    FormulaValue operator()(Position pos, size_t index) const
+    {
+        return call_(accessor_, pos, index);
+    }
+
+private:
+    const void* accessor_;
+    FormulaValue (*call_)(const void*, Position, size_t);
+};
+
+
 class FormulaInterface
 {
 public:
-    using Value = std::variant<double, FormulaError>;
+    using Value = FormulaValue;
 
     virtual ~FormulaInterface() = default;
 
+    // Читает ячейки через интерфейс таблицы
     virtual Value Evaluate(const SheetInterface& sheet) const = 0;
 
+    // Читает ячейки через переданную функцию доступа
+    virtual Value Evaluate(CellValue cell_value) const = 0;
+
     virtual std::string GetExpression() const = 0;
+    // Печатает канонический текст формулы; в строку дописывает его в конец
+    virtual void PrintExpression(std::ostream& out) const = 0;
+    virtual void PrintExpression(std::string& out) const = 0;
 
+    // Ячейки своего листа
     virtual std::vector<Position> GetReferencedCells() const = 0;
+
+    // Ячейки других листов, заданные как Sheet2!A1
+    virtual std::vector<ExternalReference> GetExternalCells() const = 0;
+
+    // Количество узлов в дереве разбора формулы
+    virtual size_t GetAstSize() const = 0;
+
+    // Переносит ссылки на ячейки листа sheet (пустое имя — свой лист) при вставке
+    // и удалении строк и столбцов и переносе областей; ссылки на удалённые ячейки
+    // становятся #REF!. Возвращает true, если какие-то ссылки удалены или изменился
+    // их порядок: только тогда меняются значение или нумерация ссылок
+    virtual bool ShiftReferences(const PositionShift& shift, std::string_view sheet) = 0;
+
+    // Копия формулы со ссылками, сдвинутыми на rows строк и cols столбцов, как
+    // при копировании ячейки. Ссылки за пределы таблицы становятся #REF!.
+    // Текст формулы заново не разбирается
+    virtual std::unique_ptr<FormulaInterface> Translate(int rows, int cols) const = 0;
 };
 
+// Текст ячейки как операнд формулы: пустой текст — ноль, экранированный
+// текст и текст, который целиком не является числом, — ошибка #VALUE!
+FormulaValue TextToOperand(const std::string& text);
+
 // Парсит переданное выражение и возвращает объект формулы.
 // Бросает FormulaException в случае, если формула синтаксически некорректна.
-std::unique_ptr<FormulaInterface> ParseFormula(std::string expression);
\ No newline at end of file
+std::unique_ptr<FormulaInterface> ParseFormula(std::string expression);
+
+// Заполняет общий кэш предсказаний парсера разбором образцов всех конструкций
+// грамматики, чтобы первые формулы не разбирались заметно дольше остальных.
+// Выполняется один раз за время работы программы; вызывается при создании
+// таблицы и листа книги, но приложение может вызвать её раньше, при запуске
+void WarmUpFormulaParser();
\ No newline at end of file
@@ -0,0 +1,400 @@
+#include "common.h"
+#include "trace.h"
+#include "workload.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <streambuf>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/resource.h>
+#endif
+
+// Макробенчмарк: строит синтетические таблицы генератором нагрузки и прогоняет на
+// них сценарии целиком. Для каждой пары формы и сценария печатает пропускную
+// способность, медиану и 99-й перцентиль задержки одной операции и пиковый объём
+// памяти процесса к концу сценария.
+//
+//   spreadsheet_macrobench [--shape=<форма>|all] [--scenario=<сценарий>|all]
+//       [--rows=N] [--cols=N] [--depth=N] [--fan=N] [--seed=N] [--ops=N] [--repeat=N]
+//       [--format=json|text]
+//
+// Формы: chain, fan-in, fan-out, diamond, random-dag, text, errors. Сценарии:
+//   load       запись всех ячеек в пустую таблицу; операция — SetCell
+//   edits      шторм правок исходных чисел после вычисления всех ячеек; операция — SetCell
+//   print      правка одного исходного числа и PrintValues всей таблицы; операция — печать
+//   cold-read  чтение --ops случайных ячеек свежей таблицы; операция — GetValue
+//
+//   spreadsheet_macrobench --replay=<трасса> [--verify] [--format=json|text]
+//
+// Повторяет трассу, записанную RecordingSheet (trace.h), на пустой таблице и печатает
+// те же показатели по видам операций: записанные в трассе (recorded) и полученные при
+// повторе (replayed). С --verify сверяет значения и печать с записанными и завершается
+// с кодом 2, если что-то не совпало.
+
+namespace {
+    using Clock = std::chrono::steady_clock;
+
+    enum class Scenario { LOAD, EDITS, PRINT, COLD_READ };
+
+    constexpr Scenario SCENARIOS[] = { Scenario::LOAD, Scenario::EDITS, Scenario::PRINT, Scenario::COLD_READ };
+
+    std::string_view ToString(Scenario scenario) {
+        switch (scenario) {
+        case Scenario::LOAD:
+            return "load";
+        case Scenario::EDITS:
+            return "edits";
+        case Scenario::PRINT:
+            return "print";
+        case Scenario::COLD_READ:
+            return "cold-read";
+        }
+        return {};
+    }
+
+    struct Options {
+        std::vector<WorkloadShape> shapes{ std::begin(WORKLOAD_SHAPES), std::end(WORKLOAD_SHAPES) };
+        std::vector<Scenario> scenarios{ std::begin(SCENARIOS), std::end(SCENARIOS) };
+        WorkloadParams params;
+        size_t ops = 10000;
+        size_t repeat = 3;
+        bool json = true;
+        std::string replay;
+        bool verify = false;
+    };
+
+    struct Result {
+        std::string workload;
+        std::string scenario;
+        size_t ops = 0;
+        double seconds = 0;
+        double p50_us = 0;
+        double p99_us = 0;
+        long peak_rss_kb = 0;
+    };
+
+    // Отбрасывает вывод: печать замеряется без затрат на хранение текста
+    class NullBuffer : public std::streambuf {
+    protected:
+        int overflow(int c) override {
+            return c;
+        }
+
+        std::streamsize xsputn(const char*, std::streamsize count) override {
+            return count;
+        }
+    };
+
+    long PeakRssKb() {
+#if defined(__unix__) || defined(__APPLE__)
+        rusage usage{};
+        getrusage(RUSAGE_SELF, &usage);
+#if defined(__APPLE__)
+        return usage.ru_maxrss / 1024;
+#else
+        return usage.ru_maxrss;
+#endif
+#else
+        return 0;
+#endif
+    }
+
+    // Задержки операций сценария
+    class Latencies {
+    public:
+        template <typename Operation>
+        void Measure(Operation&& operation) {
+            const auto start = Clock::now();
+            operation();
+            samples_.push_back(Clock::now() - start);
+        }
+
+        void Add(Clock::duration sample) {
+            samples_.push_back(sample);
+        }
+
+        bool Empty() const {
+            return samples_.empty();
+        }
+
+        void Fill(Result& result) {
+            std::sort(samples_.begin(), samples_.end());
+            result.ops = samples_.size();
+            result.seconds = 0;
+            for (auto sample : samples_) {
+                result.seconds += std::chrono::duration<double>(sample).count();
+            }
+            result.p50_us = Percentile(0.50);
+            result.p99_us = Percentile(0.99);
+        }
+
+    private:
+        // Ближайший ранг по отсортированным задержкам
+        double Percentile(double share) const {
+            if (samples_.empty()) {
+                return 0;
+            }
+            size_t rank = static_cast<size_t>(std::ceil(share * static_cast<double>(samples_.size())));
+            rank = std::clamp<size_t>(rank, 1, samples_.size());
+            return std::chrono::duration<double, std::micro>(samples_[rank - 1]).count();
+        }
+
+        std::vector<Clock::duration> samples_;
+    };
+
+    std::unique_ptr<SheetInterface> Load(const Workload& workload) {
+        auto sheet = CreateSheet();
+        LoadWorkload(*sheet, workload);
+        return sheet;
+    }
+
+    // Не даёт компилятору выбросить прочитанные значения
+    volatile size_t value_sink = 0;
+
+    void ReadValue(const SheetInterface& sheet, Position pos) {
+        if (const CellInterface* cell = sheet.GetCell(pos)) {
+            value_sink = cell->GetValue().index();
+        }
+    }
+
+    void ReadAll(const SheetInterface& sheet, const Workload& workload) {
+        for (const auto& cell : workload.cells) {
+            ReadValue(sheet, cell.first);
+        }
+    }
+
+    Result Run(WorkloadShape shape, Scenario scenario, const Options& options) {
+        WorkloadParams params = options.params;
+        params.shape = shape;
+        const Workload workload = GenerateWorkload(params);
+        Latencies latencies;
+
+        switch (scenario) {
+        case Scenario::LOAD:
+            for (size_t round = 0; round < options.repeat; ++round) {
+                auto sheet = CreateSheet();
+                for (const auto& [pos, text] : workload.cells) {
+                    latencies.Measure([&] { sheet->SetCell(pos, text); });
+                }
+            }
+            break;
+        case Scenario::EDITS: {
+            auto sheet = Load(workload);
+            ReadAll(*sheet, workload);
+            for (const auto& [pos, text] : GenerateEdits(workload, options.ops, params.seed)) {
+                latencies.Measure([&] { sheet->SetCell(pos, text); });
+            }
+            break;
+        }
+        case Scenario::PRINT: {
+            auto sheet = Load(workload);
+            NullBuffer buffer;
+            std::ostream output(&buffer);
+            for (const auto& [pos, text] : GenerateEdits(workload, options.repeat, params.seed)) {
+                sheet->SetCell(pos, text);
+                latencies.Measure([&] { sheet->PrintValues(output); });
+            }
+            break;
+        }
+        case Scenario::COLD_READ:
+            for (size_t round = 0; round < options.repeat; ++round) {
+                auto sheet = Load(workload);
+                std::mt19937 random(params.seed + static_cast<uint32_t>(round));
+                for (size_t i = 0; i < options.ops; ++i) {
+                    const Position pos = workload.cells[random() % workload.cells.size()].first;
+                    latencies.Measure([&] { ReadValue(*sheet, pos); });
+                }
+            }
+            break;
+        }
+
+        Result result{ std::string(ToString(shape)), std::string(ToString(scenario)) };
+        latencies.Fill(result);
+        result.peak_rss_kb = PeakRssKb();
+        return result;
+    }
+
+    void PrintText(const Result& result) {
+        std::cout << result.workload << '\t' << result.scenario << '\t'
+            << result.ops << " ops\t" << (result.seconds > 0 ? result.ops / result.seconds : 0) << " ops/s\t"
+            << "p50 " << result.p50_us << " us\tp99 " << result.p99_us << " us\t"
+            << "peak RSS " << result.peak_rss_kb << " KB" << std::endl;
+    }
+
+    void PrintJson(const std::vector<Result>& results) {
+        std::cout << "{\n  \"runs\": [";
+        bool first = true;
+        for (const Result& result : results) {
+            std::cout << (first ? "\n" : ",\n");
+            first = false;
+            std::cout << "    {\"workload\": \"" << result.workload << "\", \"scenario\": \"" << result.scenario
+                << "\", \"ops\": " << result.ops << ", \"seconds\": " << result.seconds
+                << ", \"ops_per_second\": " << (result.seconds > 0 ? result.ops / result.seconds : 0)
+                << ", \"p50_us\": " << result.p50_us << ", \"p99_us\": " << result.p99_us
+                << ", \"peak_rss_kb\": " << result.peak_rss_kb << "}";
+        }
+        std::cout << "\n  ]\n}" << std::endl;
+    }
+
+    void Print(const std::vector<Result>& results, bool json) {
+        if (json) {
+            PrintJson(results);
+            return;
+        }
+        for (const Result& result : results) {
+            PrintText(result);
+        }
+    }
+
+    int Replay(const Options& options) {
+        std::ifstream input(options.replay, std::ios::binary);
+        if (!input) {
+            std::cerr << "cannot open " << options.replay << std::endl;
+            return 1;
+        }
+
+        auto sheet = CreateSheet();
+        std::vector<ReplayedOp> replayed;
+        try {
+            replayed = ReplayTrace(input, *sheet, options.verify);
+        } catch (const TraceFormatException& e) {
+            std::cerr << options.replay << ": " << e.what() << std::endl;
+            return 1;
+        }
+
+        std::vector<Result> results;
+        for (TraceOp op : TRACE_OPS) {
+            Latencies recorded;
+            Latencies repeated;
+            for (const ReplayedOp& entry : replayed) {
+                if (entry.op == op) {
+                    recorded.Add(entry.recorded);
+                    repeated.Add(entry.replayed);
+                }
+            }
+            if (recorded.Empty()) {
+                continue;
+            }
+            for (auto [name, latencies] : { std::pair{ "recorded", &recorded }, std::pair{ "replayed", &repeated } }) {
+                Result result{ name, std::string(ToString(op)) };
+                latencies->Fill(result);
+                result.peak_rss_kb = PeakRssKb();
+                results.push_back(result);
+            }
+        }
+        Print(results, options.json);
+
+        const auto mismatches = std::count_if(replayed.begin(), replayed.end(), [](const ReplayedOp& entry) { return !entry.matched; });
+        if (mismatches > 0) {
+            std::cerr << mismatches << " of " << replayed.size() << " operations did not match the trace" << std::endl;
+            return 2;
+        }
+        return 0;
+    }
+
+    bool ParseNumber(std::string_view text, long long& value) {
+        char* end = nullptr;
+        const std::string copy(text);
+        value = std::strtoll(copy.c_str(), &end, 10);
+        return !copy.empty() && *end == '\0' && value >= 0;
+    }
+
+    bool ParseOptions(int argc, char** argv, Options& options) {
+        for (int i = 1; i < argc; ++i) {
+            const std::string_view arg = argv[i];
+            if (arg == "--verify") {
+                options.verify = true;
+                continue;
+            }
+            const size_t eq = arg.find('=');
+            if (arg.rfind("--", 0) != 0 || eq == std::string_view::npos) {
+                return false;
+            }
+            const std::string_view name = arg.substr(2, eq - 2);
+            const std::string_view value = arg.substr(eq + 1);
+            long long number = 0;
+
+            if (name == "shape") {
+                options.shapes.clear();
+                if (value == "all") {
+                    options.shapes.assign(std::begin(WORKLOAD_SHAPES), std::end(WORKLOAD_SHAPES));
+                } else if (auto shape = ParseWorkloadShape(value)) {
+                    options.shapes.push_back(*shape);
+                } else {
+                    return false;
+                }
+            } else if (name == "scenario") {
+                options.scenarios.clear();
+                for (Scenario scenario : SCENARIOS) {
+                    if (value == "all" || value == ToString(scenario)) {
+                        options.scenarios.push_back(scenario);
+                    }
+                }
+                if (options.scenarios.empty()) {
+                    return false;
+                }
+            } else if (name == "format") {
+                options.json = value != "text";
+            } else if (name == "replay") {
+                options.replay = std::string(value);
+            } else if (!ParseNumber(value, number)) {
+                return false;
+            } else if (name == "rows") {
+                options.params.rows = static_cast<int>(std::min<long long>(number, Position::MAX_ROWS));
+            } else if (name == "cols") {
+                options.params.cols = static_cast<int>(std::min<long long>(number, Position::MAX_COLS));
+            } else if (name == "depth") {
+                options.params.depth = static_cast<int>(std::min<long long>(number, Position::MAX_ROWS));
+            } else if (name == "fan") {
+                options.params.fan = static_cast<int>(std::min<long long>(number, 1024));
+            } else if (name == "seed") {
+                options.params.seed = static_cast<uint32_t>(number);
+            } else if (name == "ops") {
+                options.ops = static_cast<size_t>(number);
+            } else if (name == "repeat") {
+                options.repeat = static_cast<size_t>(number);
+            } else {
+                return false;
+            }
+        }
+        return true;
+    }
+}
+
+int main(int argc, char** argv) {
+    Options options;
+    if (!ParseOptions(argc, argv, options)) {
+        std::cerr << "usage: " << argv[0] << " [--shape=chain|fan-in|fan-out|diamond|random-dag|text|errors|all]"
+            " [--scenario=load|edits|print|cold-read|all] [--rows=N] [--cols=N] [--depth=N] [--fan=N]"
+            " [--seed=N] [--ops=N] [--repeat=N] [--format=json|text]\n"
+            "       " << argv[0] << " --replay=<trace> [--verify] [--format=json|text]" << std::endl;
+        return 1;
+    }
+    if (!options.replay.empty()) {
+        return Replay(options);
+    }
+
+    std::vector<Result> results;
+    for (WorkloadShape shape : options.shapes) {
+        for (Scenario scenario : options.scenarios) {
+            results.push_back(Run(shape, scenario, options));
+            if (!options.json) {
+                PrintText(results.back());
+            }
+        }
+    }
+    if (options.json) {
+        PrintJson(results);
+    }
+    return 0;
+}
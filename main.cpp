@@ -1,6 +1,18 @@
 #include "common.h"
 #include "formula.h"
+#include "sheet.h"
 #include "test_runner_p.h"
+#include "trace.h"
+#include "workbook.h"
+#include "workload.h"
+
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <limits>
+#include <random>
+#include <thread>
+#include <unordered_set>
 
 inline std::ostream& operator<<(std::ostream& output, Position pos) {
     return output << "(" << pos.row << ", " << pos.col << ")";
@@ -76,6 +88,53 @@ namespace {
         ASSERT(!Position::FromString("ABCDEFGHIJKLMNOPQRS8").IsValid());
     }
 
+    void TestPositionCodec() {
+        static_assert(Position::FromChars("A1") == Position{ 0, 0 });
+        static_assert(Position::FromChars("XFD16384") == Position{ Position::MAX_ROWS - 1, Position::MAX_COLS - 1 });
+        static_assert(!Position::FromChars("XFE1").IsValid());
+        static_assert(!Position::FromChars("A16385").IsValid());
+
+        char buffer[Position::MAX_STRING_LENGTH];
+        ASSERT_EQUAL(std::string_view(buffer, Position{ 136, 2 }.ToChars(buffer)), "C137");
+        ASSERT_EQUAL(Position::NONE.ToChars(buffer), 0u);
+        ASSERT_EQUAL(Position::FromChars("A007"), (Position{ 6, 0 }));
+
+        const std::string_view names[] = { "A1", "ZZ10", "bad", "XFD16384" };
+        Position positions[4];
+        ParsePositions(names, 4, positions);
+        ASSERT_EQUAL(positions[1], (Position{ 9, 701 }));
+        ASSERT(!positions[2].IsValid());
+
+        char text[4 * (Position::MAX_STRING_LENGTH + 1)];
+        Position valid[] = { positions[0], positions[1], positions[3] };
+        ASSERT_EQUAL(std::string_view(text, FormatPositions(valid, 3, text, ',')), "A1,ZZ10,XFD16384");
+    }
+
+    void TestPositionCodecAxes() {
+        // Каждая строка и каждый столбец хотя бы по разу; вся сетка — в --exhaustive
+        char buffer[Position::MAX_STRING_LENGTH];
+        for (int i = 0; i < Position::MAX_ROWS; ++i) {
+            for (Position pos : { Position{ i, 0 }, Position{ i, Position::MAX_COLS - 1 }, Position{ 0, i },
+                                  Position{ Position::MAX_ROWS - 1, i } }) {
+                ASSERT_EQUAL(Position::FromChars(std::string_view(buffer, pos.ToChars(buffer))), pos);
+            }
+        }
+    }
+
+    void TestPositionCodecExhaustive() {
+        // Буквы столбца и цифры строки кодируются независимо, но проверяем всю сетку
+        char buffer[Position::MAX_STRING_LENGTH];
+        size_t mismatches = 0;
+        for (int row = 0; row < Position::MAX_ROWS; ++row) {
+            for (int col = 0; col < Position::MAX_COLS; ++col) {
+                Position pos{ row, col };
+                size_t length = pos.ToChars(buffer);
+                mismatches += !(Position::FromChars(std::string_view(buffer, length)) == pos);
+            }
+        }
+        ASSERT_EQUAL(mismatches, 0u);
+    }
+
     void TestEmpty() {
         auto sheet = CreateSheet();
         ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{ 0, 0 }));
@@ -182,6 +241,100 @@ namespace {
         ASSERT_EQUAL(reformat("(2*3)+4"), "2*3+4");
         ASSERT_EQUAL(reformat("(2*3)-4"), "2*3-4");
         ASSERT_EQUAL(reformat("( ( (  1) ) )"), "1");
+        ASSERT_EQUAL(reformat("A01+B007"), "A1+B7");  // Ведущие нули номера строки допустимы
+    }
+
+    void TestFormulaNumberRoundTrip() {
+        auto reformat = [](std::string expr) {
+            return ParseFormula(std::move(expr))->GetExpression();
+        };
+
+        // Числа печатаются кратчайшей записью, которая читается обратно без потерь
+        ASSERT_EQUAL(reformat("0.1"), "0.1");
+        ASSERT_EQUAL(reformat("2.50"), "2.5");
+        ASSERT_EQUAL(reformat("123456789"), "123456789");
+        ASSERT_EQUAL(reformat("1.2345678901"), "1.2345678901");
+        ASSERT_EQUAL(reformat("1/3"), "1/3");
+        ASSERT_EQUAL(reformat("1e300*A1"), "1e+300*A1");
+
+        for (double value : { 0.1, 1.0 / 3, 6.02214076e23, 5e-324, 1234.5678 }) {
+            std::ostringstream expr;
+            expr.precision(17);
+            expr << value;
+            auto text = reformat(expr.str());
+            ASSERT_EQUAL(std::get<double>(ParseFormula(text)->Evaluate(*CreateSheet())), value);
+            ASSERT_EQUAL(reformat(text), text);
+        }
+
+        auto sheet = CreateSheet();
+        sheet->SetCell("A1"_pos, "=  (1.50 + B2)  ");
+        ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetText(), "=1.5+B2");
+    }
+
+    void TestFormulaConstantFolding() {
+        auto sheet = CreateSheet();
+        sheet->SetCell("A1"_pos, "2");
+        sheet->SetCell("B2"_pos, "5");
+        auto evaluate = [&sheet](const FormulaInterface& formula) {
+            return std::get<double>(formula.Evaluate(*sheet));
+        };
+
+        // Текст формулы — канонический вид исходного выражения, а не свёрнутого
+        auto seconds = ParseFormula("A1*(60*60*24)");
+        ASSERT_EQUAL(seconds->GetExpression(), "A1*60*60*24");
+        ASSERT_EQUAL(seconds->GetAstSize(), 3u);
+        ASSERT_EQUAL(evaluate(*seconds), 172800.0);
+
+        auto signs = ParseFormula("+(-(3))*B2");
+        ASSERT_EQUAL(signs->GetExpression(), "+-3*B2");
+        ASSERT_EQUAL(signs->GetAstSize(), 3u);
+        ASSERT_EQUAL(evaluate(*signs), -15.0);
+
+        auto negation = ParseFormula("-(-B2)");
+        ASSERT_EQUAL(negation->GetAstSize(), 1u);
+        ASSERT_EQUAL(evaluate(*negation), 5.0);
+
+        // Деление на степень двойки заменяется умножением без потери точности
+        auto half = ParseFormula("B2/(1+1)");
+        ASSERT_EQUAL(half->GetAstSize(), 3u);
+        ASSERT_EQUAL(evaluate(*half), 2.5);
+        ASSERT_EQUAL(evaluate(*ParseFormula("B2/3")), 5.0 / 3);
+
+        // Ошибки константных подвыражений сохраняются
+        const auto div0 = FormulaInterface::Value(FormulaError::Category::Div0);
+        ASSERT(ParseFormula("1/0")->Evaluate(*sheet) == div0);
+        ASSERT(ParseFormula("B2+1/(2-2)")->Evaluate(*sheet) == div0);
+        ASSERT(ParseFormula("1e308*10/10")->Evaluate(*sheet) == div0);
+        ASSERT(ParseFormula("B2/1e-320")->Evaluate(*sheet) == div0);
+
+        sheet->SetCell("C3"_pos, "=1/0");
+        ASSERT_EQUAL(sheet->GetCell("C3"_pos)->GetText(), "=1/0");
+    }
+
+    void TestFormulaCellAccessor() {
+        auto formula = ParseFormula("A1*B2+ZZ100");
+        std::vector<Position> reads;
+        auto accessor = [&reads](Position pos) -> FormulaValue {
+            reads.push_back(pos);
+            if (pos == "ZZ100"_pos) {
+                return FormulaError(FormulaError::Category::Value);
+            }
+            return static_cast<double>(pos.row + 1);
+        };
+
+        ASSERT(formula->Evaluate(CellValue(accessor)) == FormulaValue(FormulaError::Category::Value));
+        ASSERT_EQUAL(reads, (std::vector{ "A1"_pos, "B2"_pos, "ZZ100"_pos }));
+
+        // Доступ напрямую к таблице даёт то же, что и чтение через интерфейс
+        Sheet sheet;
+        sheet.SetCell("A1"_pos, "3");
+        sheet.SetCell("B2"_pos, "'4");
+        sheet.SetCell("C3"_pos, "=A1/2");
+        for (Position pos : { "A1"_pos, "B2"_pos, "C3"_pos, "D4"_pos, "Z99"_pos }) {
+            auto operand = [&sheet](Position p) { return sheet.GetFormulaOperand(p); };
+            auto formula = ParseFormula(pos.ToString());
+            ASSERT(formula->Evaluate(CellValue(operand)) == formula->Evaluate(sheet));
+        }
     }
 
     void TestFormulaReferencedCells() {
@@ -210,6 +363,31 @@ namespace {
             CellInterface::Value(FormulaError::Category::Value));
     }
 
+    void TestErrorPropagation() {
+        auto sheet = CreateSheet();
+        const auto value_error = CellInterface::Value(FormulaError::Category::Value);
+        const auto div0 = CellInterface::Value(FormulaError::Category::Div0);
+
+        sheet->SetCell("A1"_pos, "text");
+        sheet->SetCell("A2"_pos, "=1/0");
+        sheet->SetCell("A3"_pos, " 7");
+        sheet->SetCell("A4"_pos, "1e999");
+
+        // Первая по порядку вычисления ошибка определяет результат
+        sheet->SetCell("B1"_pos, "=A1+A2");
+        ASSERT_EQUAL(sheet->GetCell("B1"_pos)->GetValue(), value_error);
+        sheet->SetCell("B1"_pos, "=A2+A1");
+        ASSERT_EQUAL(sheet->GetCell("B1"_pos)->GetValue(), div0);
+        sheet->SetCell("B1"_pos, "=-(A2)*2");
+        ASSERT_EQUAL(sheet->GetCell("B1"_pos)->GetValue(), div0);
+
+        // Пробелы в начале допустимы, выход за диапазон double — нет
+        sheet->SetCell("B2"_pos, "=A3*2");
+        ASSERT_EQUAL(sheet->GetCell("B2"_pos)->GetValue(), CellInterface::Value(14.0));
+        sheet->SetCell("B2"_pos, "=A4");
+        ASSERT_EQUAL(sheet->GetCell("B2"_pos)->GetValue(), value_error);
+    }
+
     void TestErrorDiv0() {
         auto sheet = CreateSheet();
 
@@ -256,7 +434,7 @@ namespace {
     void TestEmptyCellTreatedAsZero() {
         auto sheet = CreateSheet();
         sheet->SetCell("A1"_pos, "=B2");
-        ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(), CellInterface::Value(0));
+        ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(), CellInterface::Value(0.0));
     }
 
     void TestFormulaInvalidPosition() {
@@ -338,6 +516,38 @@ namespace {
         ASSERT(isIncorrect("2+4-"));
     }
 
+    void TestFormulaParseConcurrent() {
+        WarmUpFormulaParser();
+        WarmUpFormulaParser();
+
+        // Каждый поток разбирает формулы своими экземплярами лексера и парсера;
+        // ошибка разбора не портит разбор следующей формулы тем же потоком
+        auto parse = [](int thread, int& mismatches) {
+            for (int i = 0; i < 200; ++i) {
+                const std::string expression = Position{ i, thread }.ToString() + "*" + std::to_string(i) + "+1";
+                try {
+                    ParseFormula(expression + "+");
+                    ++mismatches;
+                }
+                catch (const FormulaException&) {
+                }
+                if (ParseFormula(expression)->GetExpression() != expression) {
+                    ++mismatches;
+                }
+            }
+        };
+
+        std::vector<int> mismatches(4, 0);
+        std::vector<std::thread> threads;
+        for (int thread = 0; thread < 4; ++thread) {
+            threads.emplace_back(parse, thread, std::ref(mismatches[thread]));
+        }
+        for (auto& thread : threads) {
+            thread.join();
+        }
+        ASSERT_EQUAL(mismatches, std::vector<int>(4, 0));
+    }
+
     void TestCellCircularReferences() {
         auto sheet = CreateSheet();
         sheet->SetCell("E2"_pos, "=E4");
@@ -357,6 +567,1233 @@ namespace {
         ASSERT_EQUAL(sheet->GetCell("M6"_pos)->GetText(), "Ready");
     }
 
+    void TestDependentsRecalculated() {
+        auto sheet = CreateSheet();
+        sheet->SetCell("A1"_pos, "1");
+        sheet->SetCell("B1"_pos, "=A1+1");
+        sheet->SetCell("C1"_pos, "=B1*2");
+        ASSERT_EQUAL(sheet->GetCell("C1"_pos)->GetValue(), CellInterface::Value(4.0));
+
+        sheet->SetCell("A1"_pos, "5");
+        ASSERT_EQUAL(sheet->GetCell("C1"_pos)->GetValue(), CellInterface::Value(12.0));
+
+        sheet->SetCell("A1"_pos, "abc");
+        auto value = sheet->GetCell("C1"_pos)->GetValue();
+        ASSERT_EQUAL(std::get<FormulaError>(value).ToString(), ToString(FormulaError::Category::Value));
+
+        sheet->ClearCell("A1"_pos);
+        ASSERT_EQUAL(sheet->GetCell("C1"_pos)->GetValue(), CellInterface::Value(2.0));
+    }
+
+    void TestDeepChains() {
+        // Нарастающий итог змейкой по трём столбцам: цепочка из 49152 формул
+        constexpr int ROWS = Position::MAX_ROWS;
+        constexpr int COLS = 3;
+        Sheet sheet;
+        sheet.SetCell("A1"_pos, "1");
+        for (int col = 0; col < COLS; ++col) {
+            if (col > 0) {
+                sheet.SetCell({ 0, col }, "=" + Position{ ROWS - 1, col - 1 }.ToString() + "+1");
+            }
+            sheet.FillRange({ { 1, col }, { ROWS - 1, col } }, "=" + Position{ 0, col }.ToString() + "+1");
+        }
+        const Position last{ ROWS - 1, COLS - 1 };
+        ASSERT_EQUAL(sheet.GetCell(last)->GetValue(), CellInterface::Value(double(ROWS * COLS)));
+
+        // Сброс кэша вдоль всей цепочки и повторное вычисление
+        sheet.SetCell("A1"_pos, "2");
+        ASSERT(!sheet.FindCell(last)->HasActualCache());
+        ASSERT_EQUAL(sheet.GetCell(last)->GetValue(), CellInterface::Value(double(ROWS * COLS + 1)));
+
+        // Проверка цикла проходит всю цепочку
+        try {
+            sheet.SetCell("A1"_pos, "=" + last.ToString());
+            ASSERT(false);
+        } catch (const CircularDependencyException&) {
+        }
+        ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetText(), "2");
+    }
+
+    void TestGetValueWithin() {
+        using Clock = std::chrono::steady_clock;
+        constexpr int LENGTH = 5000;
+        Sheet sheet;
+        sheet.SetCell("A1"_pos, "1");
+        sheet.FillRange({ "A2"_pos, { LENGTH - 1, 0 } }, "=A1+1");
+        const Position last{ LENGTH - 1, 0 };
+
+        // Срок истёк до начала: ничего не вычисляется
+        ASSERT(!sheet.GetValueWithin(last, Clock::now() - std::chrono::seconds(1)));
+        ASSERT(!sheet.FindCell("A2"_pos)->HasActualCache());
+        CancellationToken token;
+        token.Cancel();
+        ASSERT(!sheet.GetValueWithin(last, Clock::time_point::max(), &token));
+
+        // Короткие сроки: каждый вызов продолжает с места, где остановился предыдущий
+        std::optional<CellInterface::Value> value;
+        size_t calls = 0;
+        while (!(value = sheet.GetValueWithin(last, Clock::now() + std::chrono::microseconds(50)))) {
+            ++calls;
+            ASSERT(calls < LENGTH);
+        }
+        ASSERT_EQUAL(*value, CellInterface::Value(double(LENGTH)));
+
+        // Посчитанное значение готово при любом сроке; пустая позиция тоже
+        ASSERT_EQUAL(*sheet.GetValueWithin(last, Clock::now() - std::chrono::seconds(1), &token),
+            CellInterface::Value(double(LENGTH)));
+        ASSERT_EQUAL(*sheet.GetValueWithin("Z1"_pos, Clock::time_point::max()), CellInterface::Value(std::string()));
+        token.Reset();
+        sheet.SetCell("A1"_pos, "2");
+        ASSERT_EQUAL(*sheet.GetValueWithin(last, Clock::time_point::max(), &token),
+            CellInterface::Value(double(LENGTH + 1)));
+    }
+
+    void TestGetValueAsync() {
+        using namespace std::chrono_literals;
+        constexpr int LENGTH = 5000;
+        Sheet sheet;
+        sheet.SetCell("A1"_pos, "1");
+        sheet.FillRange({ "A2"_pos, { LENGTH - 1, 0 } }, "=A1+1");
+        sheet.SetCell("B1"_pos, "text");
+        sheet.SetCell("C1"_pos, "=2*3");
+        sheet.SetCell("C2"_pos, "=C1+1");
+        ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(6.0));
+
+        // Посчитанные значения, тексты и пустые ячейки готовы сразу
+        auto hot = sheet.GetValueAsync("C1"_pos);
+        ASSERT(hot.wait_for(0s) == std::future_status::ready);
+        ASSERT_EQUAL(hot.get(), CellInterface::Value(6.0));
+        ASSERT_EQUAL(sheet.GetValueAsync("B1"_pos).get(), CellInterface::Value(std::string("text")));
+        ASSERT_EQUAL(sheet.GetValueAsync("Z9"_pos).get(), CellInterface::Value(std::string()));
+
+        // Непосчитанные чтения считает поток чтения; длинное не задерживает короткое
+        auto cold = sheet.GetValueAsync({ LENGTH - 1, 0 });
+        auto short_read = sheet.GetValueAsync("C2"_pos);
+        ASSERT_EQUAL(short_read.get(), CellInterface::Value(7.0));
+        ASSERT_EQUAL(cold.get(), CellInterface::Value(double(LENGTH)));
+
+        // Таблица остаётся доступной для записи, пока поток чтения работает
+        sheet.SetCell("A1"_pos, "2");
+        ASSERT_EQUAL(sheet.GetValueAsync({ LENGTH - 1, 0 }).get(), CellInterface::Value(double(LENGTH + 1)));
+        sheet.SetCalculationMode(CalculationMode::EAGER);
+        sheet.SetCell("A1"_pos, "3");
+        ASSERT_EQUAL(sheet.GetValueAsync({ LENGTH - 1, 0 }).get(), CellInterface::Value(double(LENGTH + 2)));
+        sheet.SetCalculationMode(CalculationMode::LAZY);
+
+        try {
+            sheet.GetValueAsync(Position::NONE);
+            ASSERT(false);
+        } catch (const InvalidPositionException&) {
+        }
+        Workbook book;
+        try {
+            book.AddSheet("Data").GetValueAsync("A1"_pos);
+            ASSERT(false);
+        } catch (const std::logic_error&) {
+        }
+
+        // Отложенное чтение следует за ячейкой при вставке строк
+        sheet.SetCell("A1"_pos, "1");
+        auto moved = sheet.GetValueAsync({ LENGTH - 1, 0 });
+        sheet.InsertRows(0, 3);
+        ASSERT_EQUAL(moved.get(), CellInterface::Value(double(LENGTH)));
+
+        // Первые чтения из нескольких потоков запускают один поток чтения
+        Sheet shared;
+        shared.SetCell("A1"_pos, "1");
+        shared.FillRange({ "A2"_pos, { LENGTH - 1, 0 } }, "=A1+1");
+        std::vector<std::future<CellInterface::Value>> reads(4);
+        std::vector<std::thread> readers;
+        for (size_t i = 0; i < reads.size(); ++i) {
+            readers.emplace_back([&shared, &reads, i] { reads[i] = shared.GetValueAsync({ LENGTH - 1 - int(i), 0 }); });
+        }
+        for (auto& reader : readers) {
+            reader.join();
+        }
+        for (size_t i = 0; i < reads.size(); ++i) {
+            ASSERT_EQUAL(reads[i].get(), CellInterface::Value(double(LENGTH - i)));
+        }
+
+        // Недосчитанное к уничтожению таблицы чтение получает broken_promise
+        std::future<CellInterface::Value> orphan;
+        {
+            Sheet temporary;
+            temporary.SetCell("A1"_pos, "1");
+            temporary.FillRange({ "A2"_pos, { LENGTH - 1, 0 } }, "=A1+1");
+            orphan = temporary.GetValueAsync({ LENGTH - 1, 0 });
+        }
+        try {
+            ASSERT_EQUAL(orphan.get(), CellInterface::Value(double(LENGTH)));
+        } catch (const std::future_error& e) {
+            ASSERT(e.code() == std::future_errc::broken_promise);
+        }
+    }
+
+    void TestWorkloadGenerator() {
+        constexpr int ROWS = 60;
+        constexpr int COLS = 5;
+        for (WorkloadShape shape : WORKLOAD_SHAPES) {
+            ASSERT(ParseWorkloadShape(ToString(shape)) == shape);
+            const WorkloadParams params{ shape, ROWS, COLS, 6, 3, 7 };
+            const Workload workload = GenerateWorkload(params);
+            ASSERT_EQUAL(workload.cells.size(), size_t(ROWS * COLS));
+            ASSERT(workload.cells == GenerateWorkload(params).cells);
+
+            // Формулы ссылаются только на ячейки, записанные раньше, или на исходные числа
+            auto sheet = CreateSheet();
+            LoadWorkload(*sheet, workload);
+            ASSERT(sheet->GetPrintableSize() == (Size{ ROWS, COLS }));
+            std::unordered_set<Position, HashPosition> written;
+            size_t errors = 0;
+            for (const auto& [pos, text] : workload.cells) {
+                for (Position ref : sheet->GetCell(pos)->GetReferencedCells()) {
+                    ASSERT(written.count(ref) > 0 || std::count(workload.inputs.begin(), workload.inputs.end(), ref) > 0);
+                }
+                written.insert(pos);
+                errors += std::holds_alternative<FormulaError>(sheet->GetCell(pos)->GetValue());
+            }
+            ASSERT_EQUAL(errors > 0, shape == WorkloadShape::ERRORS);
+
+            for (const auto& [pos, text] : GenerateEdits(workload, 20, 3)) {
+                ASSERT(std::count(workload.inputs.begin(), workload.inputs.end(), pos) > 0);
+                sheet->SetCell(pos, text);
+            }
+        }
+        ASSERT(!ParseWorkloadShape("spiral"));
+
+        const Workload chain = GenerateWorkload({ WorkloadShape::CHAIN, ROWS, 1, 1, 1, 7 });
+        auto sheet = CreateSheet();
+        LoadWorkload(*sheet, chain);
+        const double first = std::stod(chain.cells.front().second);
+        ASSERT_EQUAL(sheet->GetCell({ ROWS - 1, 0 })->GetValue(), CellInterface::Value(first + ROWS - 1));
+    }
+
+    void TestTraceRecordReplay() {
+        Sheet live;
+        std::stringstream trace;
+        {
+            RecordingSheet recording(live, trace);
+            recording.SetCell("A1"_pos, "2");
+            recording.SetCell("A2"_pos, "=A1*3");
+            recording.SetCell("B1"_pos, "'=text");
+            recording.SetCell("B2"_pos, "=1/0");
+            ASSERT_EQUAL(recording.GetCell("A2"_pos)->GetValue(), CellInterface::Value(6.0));
+            ASSERT_EQUAL(recording.GetCell("B1"_pos)->GetValue(), CellInterface::Value(std::string("=text")));
+            const CellInterface* error = recording.GetCell("B2"_pos);
+            ASSERT(std::holds_alternative<FormulaError>(error->GetValue()));
+            ASSERT_EQUAL(recording.GetCell("B2"_pos)->GetText(), "=1/0");
+            ASSERT(recording.GetCell("Z99"_pos) == nullptr);
+            try {
+                recording.SetCell("A1"_pos, "=A2");
+                ASSERT(false);
+            } catch (const CircularDependencyException&) {
+            }
+            std::ostringstream values;
+            recording.PrintValues(values);
+            std::ostringstream expected;
+            live.PrintValues(expected);
+            ASSERT_EQUAL(values.str(), expected.str());
+            recording.ClearCell("B1"_pos);
+            recording.SetCell("A1"_pos, "5");
+            ASSERT_EQUAL(recording.GetCell("A2"_pos)->GetValue(), CellInterface::Value(15.0));
+            recording.PrintTexts(values);
+        }
+        const std::string recorded = trace.str();
+
+        // Повтор на пустой таблице совпадает с записью операция в операцию
+        {
+            Sheet sheet;
+            std::istringstream input(recorded);
+            const auto replayed = ReplayTrace(input, sheet, true);
+            ASSERT_EQUAL(replayed.size(), size_t(13));
+            ASSERT(std::all_of(replayed.begin(), replayed.end(), [](const ReplayedOp& op) { return op.matched; }));
+            ASSERT(replayed[4].op == TraceOp::GET_VALUE);
+            ASSERT(replayed.back().op == TraceOp::PRINT_TEXTS);
+            ASSERT_EQUAL(sheet.GetCell("A2"_pos)->GetValue(), CellInterface::Value(15.0));
+        }
+
+        // Другое исходное состояние меняет значения и напечатанный текст
+        {
+            Sheet sheet;
+            sheet.SetCell("C1"_pos, "extra");
+            std::istringstream input(recorded);
+            const auto replayed = ReplayTrace(input, sheet, true);
+            ASSERT(std::any_of(replayed.begin(), replayed.end(), [](const ReplayedOp& op) { return !op.matched; }));
+            ASSERT(replayed[4].matched);
+        }
+
+        // Обрезанная и чужая трассы
+        for (const std::string& broken : { recorded.substr(0, recorded.size() - 3), std::string("not a trace") }) {
+            Sheet sheet;
+            std::istringstream input(broken);
+            try {
+                ReplayTrace(input, sheet);
+                ASSERT(false);
+            } catch (const TraceFormatException&) {
+            }
+        }
+
+        // Печать через обёртку идёт с форматом потока вызывающего и ставит ему ошибки записи
+        {
+            Sheet sheet;
+            sheet.SetCell("A1"_pos, "=1/3");
+            std::ostringstream sink;
+            RecordingSheet recording(sheet, sink);
+            std::ostringstream values;
+            values.precision(3);
+            recording.PrintValues(values);
+            std::ostringstream expected;
+            expected.precision(3);
+            sheet.PrintValues(expected);
+            ASSERT_EQUAL(values.str(), expected.str());
+            ASSERT_EQUAL(values.str(), "0.333\n");
+
+            std::ofstream closed;
+            recording.PrintTexts(closed);
+            ASSERT(closed.bad());
+        }
+
+        // Формат чисел потока пишется в трассу, и повтор печатает с ним же
+        {
+            Sheet sheet;
+            sheet.SetCell("A1"_pos, "=1/3");
+            std::stringstream formatted;
+            {
+                RecordingSheet recording(sheet, formatted);
+                std::ostringstream values;
+                values << std::scientific << std::setprecision(2);
+                recording.PrintValues(values);
+                ASSERT_EQUAL(values.str(), "3.33e-01\n");
+                values << std::fixed << std::setprecision(4);
+                recording.PrintValues(values);
+                recording.PrintTexts(values);
+            }
+            Sheet replay;
+            replay.SetCell("A1"_pos, "=1/3");
+            std::istringstream input(formatted.str());
+            const auto replayed = ReplayTrace(input, replay, true);
+            ASSERT_EQUAL(replayed.size(), size_t(3));
+            ASSERT(std::all_of(replayed.begin(), replayed.end(), [](const ReplayedOp& op) { return op.matched; }));
+        }
+    }
+
+    void TestReadDoesNotMaterializeCells() {
+        Sheet sheet;
+        sheet.SetCell("Z100"_pos, "=A1+B2");
+        // Z100 и две ячейки, которые держат обратные рёбра
+        ASSERT_EQUAL(sheet.GetStoredCellCount(), 3u);
+
+        std::ostringstream out;
+        sheet.PrintValues(out);
+        sheet.PrintTexts(out);
+        ASSERT(sheet.GetCell("M50"_pos) != nullptr);
+        ASSERT_EQUAL(sheet.GetCell("M50"_pos)->GetText(), "");
+        ASSERT_EQUAL(sheet.GetStoredCellCount(), 3u);
+
+        sheet.SetCell("Z100"_pos, "text");
+        ASSERT_EQUAL(sheet.GetStoredCellCount(), 1u);
+
+        sheet.ClearCell("Z100"_pos);
+        ASSERT_EQUAL(sheet.GetStoredCellCount(), 0u);
+        ASSERT(sheet.GetCell("M50"_pos) == nullptr);
+    }
+
+    void TestPrintRange() {
+        Sheet sheet;
+        sheet.SetCell("A1"_pos, "1");
+        sheet.SetCell("B2"_pos, "=A1+1");
+        sheet.SetCell("C2"_pos, "'text");
+        sheet.SetCell("Z1000"_pos, "=B2*10");
+        sheet.SetCell("Y1000"_pos, "=A1*3");
+        const size_t stored = sheet.GetStoredCellCount();
+
+        // Окно вычисляет только свои формулы и то, от чего они зависят
+        std::ostringstream out;
+        sheet.PrintValues(out, { "Z999"_pos, "AA1000"_pos });
+        ASSERT_EQUAL(out.str(), "\t\n20\t\n");
+        ASSERT(sheet.FindCell("B2"_pos)->HasActualCache());
+        ASSERT(!sheet.FindCell("Y1000"_pos)->HasActualCache());
+        ASSERT_EQUAL(sheet.GetStoredCellCount(), stored);
+
+        out.str({});
+        sheet.PrintTexts(out, { "B2"_pos, "D2"_pos });
+        ASSERT_EQUAL(out.str(), "=A1+1\t'text\t\n");
+
+        std::vector<Position> visited;
+        auto visit = [&visited](Position pos, const Cell& cell) {
+            visited.push_back(pos);
+            ASSERT(!cell.Empty());
+        };
+        sheet.VisitRange({ "A1"_pos, "Z1000"_pos }, visit);
+        ASSERT_EQUAL(visited, (std::vector{ "A1"_pos, "B2"_pos, "C2"_pos, "Y1000"_pos, "Z1000"_pos }));
+        visited.clear();
+        sheet.VisitRange({ "B1"_pos, "C2"_pos }, visit);
+        ASSERT_EQUAL(visited, (std::vector{ "B2"_pos, "C2"_pos }));
+        ASSERT_EQUAL(sheet.GetStoredCellCount(), stored);
+    }
+
+    void TestPrintableSizeTracking() {
+        Sheet sheet;
+        std::mt19937 generator(7);
+        std::uniform_int_distribution<int> coordinate(0, 11);
+        for (int step = 0; step < 2000; ++step) {
+            Position pos{ coordinate(generator), coordinate(generator) };
+            if (generator() % 3 == 0) {
+                sheet.ClearCell(pos);
+            }
+            else {
+                sheet.SetCell(pos, generator() % 4 == 0 ? "" : "x");
+            }
+
+            Size expected;
+            for (int row = 0; row < 12; ++row) {
+                for (int col = 0; col < 12; ++col) {
+                    const Cell* cell = sheet.FindCell(Position{ row, col });
+                    if (cell && !cell->Empty()) {
+                        expected.rows = std::max(expected.rows, row + 1);
+                        expected.cols = std::max(expected.cols, col + 1);
+                    }
+                }
+            }
+            ASSERT_EQUAL(sheet.GetPrintableSize(), expected);
+        }
+    }
+
+    void TestFormulaReferenceLinks() {
+        Sheet sheet;
+        sheet.SetCell("B1"_pos, "=A1+A1*C1");
+        ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(0.0));
+
+        sheet.SetCell("A1"_pos, "2");
+        sheet.SetCell("C1"_pos, "3");
+        ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(8.0));
+
+        // Ссылки указывают на ячейки, а не на их содержимое
+        sheet.SetCell("A1"_pos, "=C1");
+        ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(12.0));
+        sheet.ClearCell("C1"_pos);
+        ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(0.0));
+        sheet.SetCell("C1"_pos, "text");
+        ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Value));
+
+        // Формула заменяется, старые ссылки освобождаются, новые связываются
+        sheet.SetCell("B1"_pos, "=D4*2");
+        sheet.SetCell("D4"_pos, "5");
+        ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(10.0));
+        sheet.ClearCell("A1"_pos);
+        sheet.ClearCell("C1"_pos);
+        ASSERT_EQUAL(sheet.GetStoredCellCount(), 2u);
+        ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(10.0));
+    }
+
+    void TestInsertRowsAndCols() {
+        Sheet sheet;
+        sheet.SetCell("A1"_pos, "1");
+        sheet.SetCell("A2"_pos, "=A1+1");
+        sheet.SetCell("B3"_pos, "=A2*A1+C9");
+
+        sheet.InsertRows(1, 2);
+        ASSERT_EQUAL(sheet.GetCell("A4"_pos)->GetText(), "=A1+1");
+        ASSERT_EQUAL(sheet.GetCell("B5"_pos)->GetText(), "=A4*A1+C11");
+        ASSERT_EQUAL(sheet.GetCell("B5"_pos)->GetValue(), CellInterface::Value(2.0));
+        ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{ 5, 2 }));
+        ASSERT(sheet.FindCell("A2"_pos) == nullptr);
+
+        sheet.InsertCols(0);
+        ASSERT_EQUAL(sheet.GetCell("C5"_pos)->GetText(), "=B4*B1+D11");
+        ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{ 5, 3 }));
+
+        // Рёбра переехали вместе с ячейками
+        sheet.SetCell("B1"_pos, "3");
+        ASSERT_EQUAL(sheet.GetCell("C5"_pos)->GetValue(), CellInterface::Value(12.0));
+        sheet.SetCell("D11"_pos, "10");
+        ASSERT_EQUAL(sheet.GetCell("C5"_pos)->GetValue(), CellInterface::Value(22.0));
+
+        // Вставка за пределами заполненной области ничего не сдвигает
+        sheet.InsertRows(100, 5);
+        ASSERT_EQUAL(sheet.GetCell("C5"_pos)->GetText(), "=B4*B1+D11");
+
+        // Непустые ячейки нельзя вытеснить за пределы таблицы
+        sheet.SetCell(Position{ Position::MAX_ROWS - 1, 0 }, "edge");
+        try {
+            sheet.InsertRows(0);
+            ASSERT(false);
+        }
+        catch (const TableTooBigException&) {
+        }
+        ASSERT_EQUAL(sheet.GetCell("C5"_pos)->GetText(), "=B4*B1+D11");
+
+        // Огромное число строк не переполняет проверку размера и сдвиг ссылок
+        sheet.ClearCell(Position{ Position::MAX_ROWS - 1, 0 });
+        try {
+            sheet.InsertRows(0, std::numeric_limits<int>::max());
+            ASSERT(false);
+        }
+        catch (const TableTooBigException&) {
+        }
+        sheet.SetCell("E1"_pos, "=A200");
+        sheet.InsertRows(100, std::numeric_limits<int>::max());
+        ASSERT_EQUAL(sheet.GetCell("E1"_pos)->GetText(), "=#REF!");
+        ASSERT_EQUAL(sheet.GetCell("C5"_pos)->GetText(), "=B4*B1+D11");
+    }
+
+    void TestDeleteRowsAndCols() {
+        Sheet sheet;
+        sheet.SetCell("A1"_pos, "1");
+        sheet.SetCell("A2"_pos, "2");
+        sheet.SetCell("A4"_pos, "=A1+A2");
+        sheet.SetCell("B4"_pos, "=A4*2");
+        sheet.SetCell("C1"_pos, "=A2");
+        ASSERT_EQUAL(sheet.GetCell("B4"_pos)->GetValue(), CellInterface::Value(6.0));
+
+        sheet.DeleteRows(1);
+        ASSERT_EQUAL(sheet.GetCell("A3"_pos)->GetText(), "=A1+#REF!");
+        ASSERT_EQUAL(sheet.GetCell("A3"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Ref));
+        ASSERT_EQUAL(sheet.GetCell("B3"_pos)->GetText(), "=A3*2");
+        ASSERT_EQUAL(sheet.GetCell("B3"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Ref));
+        ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetText(), "=#REF!");
+        ASSERT_EQUAL(sheet.GetCell("A3"_pos)->GetReferencedCells(), (std::vector{ "A1"_pos }));
+        ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{ 3, 3 }));
+
+        // Оставшиеся рёбра работают, ячейки без ссылок не хранятся
+        sheet.SetCell("A3"_pos, "=A1*5");
+        ASSERT_EQUAL(sheet.GetCell("B3"_pos)->GetValue(), CellInterface::Value(10.0));
+        sheet.SetCell("C1"_pos, "");
+        ASSERT_EQUAL(sheet.GetStoredCellCount(), 3u);
+
+        sheet.DeleteCols(0);
+        ASSERT_EQUAL(sheet.GetCell("A3"_pos)->GetText(), "=#REF!*2");
+        ASSERT_EQUAL(sheet.GetCell("A3"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Ref));
+        ASSERT_EQUAL(sheet.GetStoredCellCount(), 1u);
+
+        sheet.DeleteRows(0, Position::MAX_ROWS);
+        ASSERT_EQUAL(sheet.GetStoredCellCount(), 0u);
+        ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{ 0, 0 }));
+    }
+
+    // Вставки не меняют значений: лист, собранный заново из текстов ячеек
+    // после вставок, совпадает со сдвинутым исходным
+    void TestInsertMatchesRebuild() {
+        std::mt19937 generator(11);
+        std::uniform_int_distribution<int> coordinate(0, 7);
+        Sheet sheet;
+        for (int i = 0; i < 60; ++i) {
+            Position pos{ coordinate(generator), coordinate(generator) };
+            std::string text = generator() % 2 ? std::to_string(generator() % 100)
+                : "=" + Position{ coordinate(generator), coordinate(generator) }.ToString() + "+"
+                    + Position{ coordinate(generator), coordinate(generator) }.ToString();
+            try {
+                sheet.SetCell(pos, text);
+            }
+            catch (const CircularDependencyException&) {
+            }
+        }
+
+        for (int step = 0; step < 10; ++step) {
+            if (generator() % 2) {
+                sheet.InsertRows(coordinate(generator), 1 + generator() % 3);
+            }
+            else {
+                sheet.InsertCols(coordinate(generator), 1 + generator() % 3);
+            }
+        }
+
+        Sheet rebuilt;
+        Size size = sheet.GetPrintableSize();
+        for (int row = 0; row < size.rows; ++row) {
+            for (int col = 0; col < size.cols; ++col) {
+                const Cell* cell = sheet.FindCell(Position{ row, col });
+                if (cell && !cell->Empty()) {
+                    rebuilt.SetCell(Position{ row, col }, cell->GetText());
+                }
+            }
+        }
+        std::ostringstream expected, actual;
+        rebuilt.PrintValues(expected);
+        rebuilt.PrintTexts(expected);
+        sheet.PrintValues(actual);
+        sheet.PrintTexts(actual);
+        ASSERT_EQUAL(actual.str(), expected.str());
+        ASSERT_EQUAL(sheet.GetStoredCellCount(), rebuilt.GetStoredCellCount());
+    }
+
+    void TestFillRange() {
+        Sheet sheet;
+        sheet.SetCell("A1"_pos, "1");
+        sheet.ResetStats();
+        sheet.FillRange({ "A2"_pos, "B5"_pos }, "=A1+1");
+        ASSERT_EQUAL(sheet.GetStats().formula_parses, 1u);
+        ASSERT_EQUAL(sheet.GetCell("A5"_pos)->GetText(), "=A4+1");
+        ASSERT_EQUAL(sheet.GetCell("B5"_pos)->GetText(), "=B4+1");
+        ASSERT_EQUAL(sheet.GetCell("A5"_pos)->GetValue(), CellInterface::Value(5.0));
+        ASSERT_EQUAL(sheet.GetCell("B5"_pos)->GetValue(), CellInterface::Value(4.0));
+
+        // Запись области сбрасывает зависимые ячейки
+        sheet.SetCell("C1"_pos, "=A5*B5");
+        ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(20.0));
+        sheet.FillRange({ "A3"_pos, "A3"_pos }, "10");
+        ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(48.0));
+
+        // Ссылки, вышедшие за пределы таблицы, становятся #REF!
+        Position last{ Position::MAX_ROWS - 1, 3 };
+        sheet.FillRange({ Position{ last.row - 1, 3 }, last }, "=D16384");
+        ASSERT_EQUAL(sheet.GetCell(last)->GetText(), "=#REF!");
+        ASSERT_EQUAL(sheet.GetCell(last)->GetValue(), CellInterface::Value(FormulaError::Category::Ref));
+
+        // Цикл обнаруживается до записи, таблица не меняется
+        sheet.SetCell("G1"_pos, "=F2");
+        size_t stored = sheet.GetStoredCellCount();
+        try {
+            sheet.FillRange({ "F2"_pos, "F3"_pos }, "=G1");
+            ASSERT(false);
+        }
+        catch (const CircularDependencyException&) {
+        }
+        ASSERT_EQUAL(sheet.GetCell("F2"_pos)->GetText(), "");
+        ASSERT_EQUAL(sheet.GetStoredCellCount(), stored);
+
+        sheet.ClearRange({ "A1"_pos, "B4"_pos });
+        ASSERT_EQUAL(sheet.GetCell("A5"_pos)->GetValue(), CellInterface::Value(1.0));
+        ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(1.0));
+        sheet.ClearRange({ "A1"_pos, last });
+        ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{ 1, 7 }));
+        sheet.ClearRange({ "G1"_pos, "G1"_pos });
+        ASSERT_EQUAL(sheet.GetStoredCellCount(), 0u);
+        ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{ 0, 0 }));
+    }
+
+    void TestCopyRange() {
+        Sheet sheet;
+        sheet.SetCell("A1"_pos, "1");
+        sheet.SetCell("B1"_pos, "=A1*2");
+        sheet.SetCell("A2"_pos, "'text");
+        sheet.CopyRange({ "A1"_pos, "B2"_pos }, "A4"_pos);
+        ASSERT_EQUAL(sheet.GetCell("A4"_pos)->GetText(), "1");
+        ASSERT_EQUAL(sheet.GetCell("B4"_pos)->GetText(), "=A4*2");
+        ASSERT_EQUAL(sheet.GetCell("A5"_pos)->GetText(), "'text");
+        ASSERT_EQUAL(sheet.GetCell("B4"_pos)->GetValue(), CellInterface::Value(2.0));
+
+        // Области пересекаются: источник читается до записи,
+        // пустая B2 очищает C2
+        sheet.SetCell("C2"_pos, "x");
+        sheet.CopyRange({ "A1"_pos, "B2"_pos }, "B1"_pos);
+        ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetText(), "1");
+        ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetText(), "=B1*2");
+        ASSERT_EQUAL(sheet.GetCell("B2"_pos)->GetText(), "'text");
+        ASSERT_EQUAL(sheet.GetCell("C2"_pos)->GetText(), "");
+        ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(2.0));
+
+        try {
+            sheet.CopyRange({ "A1"_pos, "B2"_pos }, Position{ Position::MAX_ROWS - 1, 0 });
+            ASSERT(false);
+        }
+        catch (const InvalidPositionException&) {
+        }
+    }
+
+    void TestMoveRange() {
+        Sheet sheet;
+        sheet.SetCell("A1"_pos, "1");
+        sheet.SetCell("A2"_pos, "=A1+1");
+        sheet.SetCell("B1"_pos, "=A2*10");
+        sheet.SetCell("C3"_pos, "99");
+        sheet.SetCell("D1"_pos, "=C3");
+        ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(20.0));
+
+        // Ссылки следуют за перенесёнными ячейками, ссылки на замещённую C3 удаляются
+        sheet.MoveRange({ "A1"_pos, "A2"_pos }, "C2"_pos);
+        ASSERT_EQUAL(sheet.GetCell("C3"_pos)->GetText(), "=C2+1");
+        ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetText(), "=C3*10");
+        ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetText(), "=#REF!");
+        ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(20.0));
+        ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Ref));
+        ASSERT(sheet.FindCell("A1"_pos) == nullptr);
+        ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{ 3, 4 }));
+
+        sheet.SetCell("C2"_pos, "5");
+        ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(60.0));
+
+        // Перенос меняет порядок ссылок формулы: она связывается заново
+        sheet.SetCell("E1"_pos, "=C2+B1*10");
+        ASSERT_EQUAL(sheet.GetCell("E1"_pos)->GetValue(), CellInterface::Value(605.0));
+        sheet.MoveRange({ "B1"_pos, "B1"_pos }, "B9"_pos);
+        ASSERT_EQUAL(sheet.GetCell("E1"_pos)->GetText(), "=C2+B9*10");
+        ASSERT_EQUAL(sheet.GetCell("E1"_pos)->GetReferencedCells(), (std::vector{ "C2"_pos, "B9"_pos }));
+        sheet.SetCell("C2"_pos, "1");
+        ASSERT_EQUAL(sheet.GetCell("E1"_pos)->GetValue(), CellInterface::Value(201.0));
+        sheet.SetCell("B9"_pos, "7");
+        ASSERT_EQUAL(sheet.GetCell("E1"_pos)->GetValue(), CellInterface::Value(71.0));
+    }
+
+    void TestWorkbookReferences() {
+        auto formula = ParseFormula("Sheet2!A1+'Q1 ''24'!B2*A1+Sheet2!A1");
+        ASSERT_EQUAL(formula->GetExpression(), "Sheet2!A1+'Q1 ''24'!B2*A1+Sheet2!A1");
+        ASSERT_EQUAL(formula->GetReferencedCells(), (std::vector{ "A1"_pos }));
+        auto external = formula->GetExternalCells();
+        ASSERT_EQUAL(external.size(), 2u);
+        ASSERT_EQUAL(external[0].sheet, "Q1 '24");
+        ASSERT_EQUAL(external[0].pos, "B2"_pos);
+        ASSERT_EQUAL(external[1].sheet, "Sheet2");
+        ASSERT_EQUAL(ParseFormula("'Sheet2'!A1")->GetExpression(), "Sheet2!A1");
+        // Отдельный лист не видит других листов
+        ASSERT(formula->Evaluate(*CreateSheet()) == FormulaValue(FormulaError::Category::Ref));
+
+        Workbook book;
+        Sheet& data = book.AddSheet("Data");
+        Sheet& report = book.AddSheet("Report 1");
+        ASSERT(book.GetSheet("Data") == &data);
+        ASSERT(book.GetSheet("Missing") == nullptr);
+        try {
+            book.AddSheet("Data");
+            ASSERT(false);
+        } catch (const InvalidSheetNameException&) {
+        }
+
+        data.SetCell("A1"_pos, "2");
+        report.SetCell("A1"_pos, "=Data!A1*10+Data!B1");
+        ASSERT_EQUAL(report.GetCell("A1"_pos)->GetValue(), CellInterface::Value(20.0));
+        ASSERT(data.FindCell("B1"_pos) != nullptr);
+        ASSERT_EQUAL(data.GetPrintableSize(), (Size{ 1, 1 }));
+
+        // Запись на одном листе сбрасывает кэш зависимых ячеек на другом
+        data.SetCell("B1"_pos, "=A1+1");
+        ASSERT_EQUAL(report.GetCell("A1"_pos)->GetValue(), CellInterface::Value(23.0));
+        data.SetCell("C1"_pos, "='Report 1'!A1");
+        ASSERT_EQUAL(data.GetCell("C1"_pos)->GetValue(), CellInterface::Value(23.0));
+
+        // Циклы через несколько листов и ссылки на неизвестные листы отвергаются
+        try {
+            data.SetCell("A1"_pos, "='Report 1'!A1");
+            ASSERT(false);
+        } catch (const CircularDependencyException&) {
+        }
+        try {
+            data.FillRange({ "A1"_pos, "A1"_pos }, "=Data!C1");
+            ASSERT(false);
+        } catch (const CircularDependencyException&) {
+        }
+        try {
+            data.SetCell("D1"_pos, "=Other!A1");
+            ASSERT(false);
+        } catch (const FormulaException&) {
+        }
+        ASSERT_EQUAL(data.GetCell("A1"_pos)->GetText(), "2");
+
+        // Очистка формулы освобождает пустые ячейки, на которые больше никто не ссылается
+        report.ClearCell("A1"_pos);
+        data.ClearCell("C1"_pos);
+        data.ClearCell("B1"_pos);
+        ASSERT_EQUAL(data.GetStoredCellCount(), 1u);
+        ASSERT_EQUAL(report.GetStoredCellCount(), 0u);
+    }
+
+    void TestWorkbookShift() {
+        Workbook book;
+        Sheet& data = book.AddSheet("Data");
+        Sheet& report = book.AddSheet("Report");
+        for (int i = 0; i < 5; ++i) {
+            data.SetCell(Position{ i, 0 }, std::to_string(i + 1));
+        }
+        report.SetCell("A1"_pos, "=Data!A2+Data!A4");
+        data.SetCell("B1"_pos, "=Data!A5*100");
+        ASSERT_EQUAL(report.GetCell("A1"_pos)->GetValue(), CellInterface::Value(6.0));
+
+        // Ссылки других листов и ссылки листа на себя по имени следуют за ячейками
+        data.InsertRows(0, 2);
+        ASSERT_EQUAL(report.GetCell("A1"_pos)->GetText(), "=Data!A4+Data!A6");
+        ASSERT_EQUAL(data.GetCell("B3"_pos)->GetText(), "=Data!A7*100");
+        data.SetCell("A4"_pos, "10");
+        ASSERT_EQUAL(report.GetCell("A1"_pos)->GetValue(), CellInterface::Value(14.0));
+        ASSERT_EQUAL(data.GetCell("B3"_pos)->GetValue(), CellInterface::Value(500.0));
+
+        // Вставка на другом листе не трогает эти ссылки
+        report.InsertCols(0);
+        ASSERT_EQUAL(report.GetCell("B1"_pos)->GetText(), "=Data!A4+Data!A6");
+
+        data.DeleteRows(5);
+        ASSERT_EQUAL(report.GetCell("B1"_pos)->GetText(), "=Data!A4+#REF!");
+        ASSERT_EQUAL(report.GetCell("B1"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Ref));
+        data.DeleteRows(0);
+        ASSERT_EQUAL(report.GetCell("B1"_pos)->GetText(), "=Data!A3+#REF!");
+        ASSERT_EQUAL(data.GetCell("B2"_pos)->GetText(), "=Data!A5*100");
+        ASSERT_EQUAL(data.GetCell("B2"_pos)->GetValue(), CellInterface::Value(500.0));
+
+        // Перенос области с ячейкой, на которую ссылается другой лист
+        report.SetCell("C1"_pos, "=Data!A3");
+        data.MoveRange({ "A3"_pos, "A3"_pos }, "D9"_pos);
+        ASSERT_EQUAL(report.GetCell("C1"_pos)->GetText(), "=Data!D9");
+        data.SetCell("D9"_pos, "8");
+        ASSERT_EQUAL(report.GetCell("C1"_pos)->GetValue(), CellInterface::Value(8.0));
+    }
+
+    void TestWorkbookRecalculate() {
+        // Data1 и Data2 независимы, Loop1 и Loop2 ссылаются друг на друга, Total читает всех
+        Workbook book;
+        std::vector<Sheet*> data = { &book.AddSheet("Data1"), &book.AddSheet("Data2") };
+        Sheet& loop1 = book.AddSheet("Loop1");
+        Sheet& loop2 = book.AddSheet("Loop2");
+        Sheet& total = book.AddSheet("Total");
+        for (Sheet* sheet : data) {
+            sheet->SetCell("A1"_pos, "1");
+            for (int i = 1; i < 200; ++i) {
+                sheet->SetCell(Position{ i, 0 }, "=A" + std::to_string(i) + "+1");
+            }
+        }
+        loop1.SetCell("A1"_pos, "=Data1!A200+Loop2!B1");
+        loop2.SetCell("B1"_pos, "=3");
+        loop2.SetCell("A1"_pos, "=Loop1!A1*2");
+        total.SetCell("A1"_pos, "=Data2!A200+Loop2!A1");
+
+        book.Recalculate(4);
+        auto reports = book.GetReports();
+        ASSERT_EQUAL(reports.size(), 5u);
+        ASSERT_EQUAL(reports[0].name, "Data1");
+        ASSERT_EQUAL(reports[0].recalculated_cells, 200u);
+        ASSERT_EQUAL(reports[0].recalc_wave, 0u);
+        ASSERT_EQUAL(reports[1].recalc_wave, 0u);
+        ASSERT_EQUAL(reports[2].recalc_wave, 1u);
+        ASSERT_EQUAL(reports[3].recalc_wave, 1u);
+        ASSERT_EQUAL(reports[4].recalc_wave, 2u);
+        ASSERT_EQUAL(reports[4].stored_cells, 1u);
+        ASSERT(total.FindCell("A1"_pos)->HasActualCache());
+        ASSERT_EQUAL(total.GetCell("A1"_pos)->GetValue(), CellInterface::Value(606.0));
+
+        // Пересчитываются только сброшенные ячейки
+        data[0]->SetCell("A1"_pos, "2");
+        book.Recalculate();
+        reports = book.GetReports();
+        ASSERT_EQUAL(reports[0].recalculated_cells, 200u);
+        ASSERT_EQUAL(reports[1].recalculated_cells, 0u);
+        ASSERT_EQUAL(reports[2].recalculated_cells, 1u);
+        ASSERT_EQUAL(reports[4].recalculated_cells, 1u);
+        ASSERT_EQUAL(total.GetCell("A1"_pos)->GetValue(), CellInterface::Value(608.0));
+
+        // Профилируемые листы считаются в вызывающем потоке
+        for (Sheet* sheet : data) {
+            sheet->EnableProfiling(true);
+            sheet->SetCell("A1"_pos, "3");
+        }
+        book.Recalculate(4);
+        for (Sheet* sheet : data) {
+            sheet->SetCell("A2"_pos, "=A1+2");
+            sheet->GetCell("A2"_pos)->GetValue();
+            const auto& samples = sheet->GetProfiler()->GetSamples();
+            ASSERT_EQUAL(samples.size(), 201u);
+            for (const auto& sample : samples) {
+                ASSERT_EQUAL(sample.thread, samples.back().thread);
+            }
+        }
+    }
+
+    void TestEagerCalculation() {
+        Sheet sheet;
+        sheet.SetCalculationMode(CalculationMode::EAGER);
+        sheet.SetCell("A1"_pos, "1");
+        for (int i = 1; i < 100; ++i) {
+            sheet.SetCell(Position{ i, 0 }, "=A" + std::to_string(i) + "+1");
+        }
+        sheet.WaitForRecalculation();
+        ASSERT_EQUAL(sheet.GetCell("A100"_pos)->GetValue(), CellInterface::Value(100.0));
+
+        sheet.SetCell("A1"_pos, "11");
+        ASSERT_EQUAL(sheet.GetCell("A100"_pos)->GetValue(), CellInterface::Value(110.0));
+        sheet.WaitForRecalculation();
+        ASSERT_EQUAL(sheet.GetCell("A50"_pos)->GetValue(), CellInterface::Value(60.0));
+
+        sheet.SetCalculationMode(CalculationMode::LAZY);
+        sheet.SetCell("A1"_pos, "0");
+        ASSERT_EQUAL(sheet.GetCell("A100"_pos)->GetValue(), CellInterface::Value(99.0));
+    }
+
+    void TestManualCalculation() {
+        Sheet sheet;
+        sheet.SetCalculationMode(CalculationMode::MANUAL);
+        sheet.SetCell("A1"_pos, "1");
+        sheet.SetCell("B1"_pos, "=A1+1");
+        ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(2.0));
+
+        // До пересчёта видно последнее вычисленное значение
+        sheet.SetCell("A1"_pos, "5");
+        sheet.SetCell("C1"_pos, "=B1*10");
+        ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(2.0));
+        ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(20.0));
+
+        sheet.Recalculate();
+        sheet.WaitForRecalculation();
+        ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(6.0));
+        ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(60.0));
+
+        sheet.SetCell("A1"_pos, "7");
+        sheet.SetCalculationMode(CalculationMode::LAZY);
+        ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(80.0));
+    }
+
+    void TestDeltaExport() {
+        Sheet sheet;
+        ASSERT_EQUAL(sheet.GetVersion(), 0u);
+        sheet.SetCell("A1"_pos, "1");
+        sheet.SetCell("B2"_pos, "=A1+1");
+        sheet.SetCell("A4"_pos, "text");
+
+        std::ostringstream out;
+        uint64_t version = sheet.PrintValuesSince(out, 0);
+        ASSERT_EQUAL(out.str(), "4\t2\n1\t1\t\n2\t\t2\n4\ttext\t\n");
+
+        // Без изменений выводится только печатная область, версия не растёт
+        out.str({});
+        ASSERT_EQUAL(sheet.PrintValuesSince(out, version), version);
+        ASSERT_EQUAL(out.str(), "4\t2\n");
+
+        // Сброс кэша отмечает строки зависимых ячеек
+        sheet.SetCell("A1"_pos, "5");
+        out.str({});
+        uint64_t next = sheet.PrintValuesSince(out, version);
+        ASSERT(next > version);
+        ASSERT_EQUAL(out.str(), "4\t2\n1\t5\t\n2\t\t6\n");
+        version = next;
+
+        sheet.SetCell("A4"_pos, "new");
+        out.str({});
+        version = sheet.PrintTextsSince(out, version);
+        ASSERT_EQUAL(out.str(), "4\t2\n4\tnew\t\n");
+
+        // Отклонённая запись не отмечает строку
+        try {
+            sheet.SetCell("C3"_pos, "=A4+");
+        }
+        catch (const FormulaException&) {
+        }
+        try {
+            sheet.SetCell("B2"_pos, "=B2");
+        }
+        catch (const CircularDependencyException&) {
+        }
+        out.str({});
+        ASSERT_EQUAL(sheet.PrintTextsSince(out, version), version);
+        ASSERT_EQUAL(out.str(), "4\t2\n");
+
+        // Удаление строки меняет все сдвинутые строки; строка за печатной областью пуста
+        sheet.DeleteRows(0);
+        out.str({});
+        version = sheet.PrintValuesSince(out, version);
+        ASSERT_EQUAL(out.str(), "3\t2\n1\t\t#REF!\n2\t\t\n3\tnew\t\n4\n");
+
+        // В ручном режиме строки отмечаются снова при пересчёте
+        Sheet manual;
+        manual.SetCalculationMode(CalculationMode::MANUAL);
+        manual.SetCell("A1"_pos, "1");
+        manual.SetCell("B1"_pos, "=A1*2");
+        ASSERT_EQUAL(manual.GetCell("B1"_pos)->GetValue(), CellInterface::Value(2.0));
+        version = manual.GetVersion();
+        manual.SetCell("A1"_pos, "3");
+        out.str({});
+        version = manual.PrintValuesSince(out, version);
+        ASSERT_EQUAL(out.str(), "1\t2\n1\t3\t2\n");
+        manual.Recalculate();
+        manual.WaitForRecalculation();
+        out.str({});
+        manual.PrintValuesSince(out, version);
+        ASSERT_EQUAL(out.str(), "1\t2\n1\t3\t6\n");
+    }
+
+    void TestRecalculationPriorities() {
+        Sheet sheet;
+        sheet.SetCalculationMode(CalculationMode::MANUAL);
+        sheet.SetCell("A1"_pos, "1");
+        for (int row = 0; row < 600; ++row) {
+            sheet.SetCell({ row, 1 }, "=A1+" + std::to_string(row));
+            sheet.GetCell({ row, 1 })->GetValue();
+        }
+        sheet.Recalculate();
+        sheet.WaitForRecalculation();
+        sheet.SetViewport({ { 500, 0 }, { 509, 5 } });
+        sheet.PinCell("B300"_pos);
+        sheet.EnableProfiling(true);
+
+        sheet.SetCell("A1"_pos, "2");
+        RecalcQueueDepth depth = sheet.GetQueueDepth();
+        ASSERT_EQUAL(depth.unscheduled, 600u);
+        sheet.Recalculate();
+        sheet.WaitForRecalculation();
+
+        // Сначала окно, затем закреплённая ячейка, затем остальные
+        std::vector<Position> order;
+        for (const auto& sample : sheet.GetProfiler()->GetSamples()) {
+            if (sample.depth == 0) {
+                order.push_back(sample.pos);
+            }
+        }
+        ASSERT_EQUAL(order.size(), 600u);
+        for (size_t i = 0; i < 10; ++i) {
+            ASSERT(order[i].row >= 500 && order[i].row < 510);
+        }
+        ASSERT_EQUAL(order[10], "B300"_pos);
+        ASSERT_EQUAL(sheet.GetCell("B600"_pos)->GetValue(), CellInterface::Value(601.0));
+
+        depth = sheet.GetQueueDepth();
+        ASSERT_EQUAL(depth.viewport + depth.pinned + depth.background + depth.unscheduled, 0u);
+        ASSERT(depth.peak >= 600u);
+        sheet.ResetStats();
+        ASSERT_EQUAL(sheet.GetQueueDepth().peak, 0u);
+    }
+
+    void TestSubscriptions() {
+        Sheet sheet;
+        std::vector<std::vector<Position>> deliveries;
+        size_t id = sheet.Subscribe([&](const std::vector<Position>& changed) { deliveries.push_back(changed); });
+
+        sheet.SetCell("A1"_pos, "=1");
+        sheet.SetCell("B1"_pos, "=A1*2");
+        sheet.SetCell("C1"_pos, "=B1-B1");
+        ASSERT_EQUAL(deliveries, (std::vector<std::vector<Position>>{ { "A1"_pos }, { "B1"_pos }, { "C1"_pos } }));
+
+        // Сообщаются только ячейки, видимое значение которых действительно изменилось
+        deliveries.clear();
+        sheet.SetCell("A1"_pos, "=2");
+        ASSERT_EQUAL(deliveries, (std::vector<std::vector<Position>>{ { "A1"_pos, "B1"_pos } }));
+        deliveries.clear();
+        sheet.SetCell("A1"_pos, "=1+1");
+        ASSERT(deliveries.empty());
+
+        // Пакет доставляется одним списком; значение, возвращённое к прежнему, не сообщается
+        sheet.BeginBatch();
+        sheet.SetCell("A1"_pos, "=5");
+        sheet.SetCell("D1"_pos, "text");
+        sheet.SetCell("A1"_pos, "=2");
+        ASSERT(deliveries.empty());
+        sheet.EndBatch();
+        ASSERT_EQUAL(deliveries, (std::vector<std::vector<Position>>{ { "D1"_pos } }));
+
+        // Вставка строки перемещает значения: меняются и старые, и новые позиции
+        deliveries.clear();
+        sheet.InsertRows(0);
+        ASSERT_EQUAL(deliveries,
+            (std::vector<std::vector<Position>>{ { "A1"_pos, "B1"_pos, "C1"_pos, "D1"_pos, "A2"_pos, "B2"_pos, "C2"_pos, "D2"_pos } }));
+        deliveries.clear();
+        sheet.ClearRange({ "A2"_pos, "A2"_pos });
+        ASSERT_EQUAL(deliveries, (std::vector<std::vector<Position>>{ { "A2"_pos, "B2"_pos } }));
+
+        // Обработчик может менять таблицу: его изменения приходят следующим списком
+        deliveries.clear();
+        size_t writer = sheet.Subscribe([&](const std::vector<Position>& changed) {
+            if (changed.front() == "E1"_pos)
+                sheet.SetCell("F1"_pos, "=E1");
+        });
+        sheet.SetCell("E1"_pos, "3");
+        ASSERT_EQUAL(deliveries, (std::vector<std::vector<Position>>{ { "E1"_pos }, { "F1"_pos } }));
+        sheet.Unsubscribe(writer);
+        sheet.Unsubscribe(id);
+        ASSERT(!sheet.IsObserved());
+        deliveries.clear();
+        sheet.SetCell("E1"_pos, "4");
+        ASSERT(deliveries.empty());
+
+        // В ручном режиме зависимые ячейки сообщаются после пересчёта
+        Sheet manual;
+        manual.SetCalculationMode(CalculationMode::MANUAL);
+        manual.SetCell("A1"_pos, "1");
+        manual.SetCell("B1"_pos, "=A1+1");
+        ASSERT_EQUAL(manual.GetCell("B1"_pos)->GetValue(), CellInterface::Value(2.0));
+        manual.Subscribe([&](const std::vector<Position>& changed) { deliveries.push_back(changed); });
+        manual.SetCell("A1"_pos, "5");
+        ASSERT_EQUAL(deliveries, (std::vector<std::vector<Position>>{ { "A1"_pos } }));
+        manual.Recalculate();
+        manual.WaitForRecalculation();
+        ASSERT_EQUAL(deliveries, (std::vector<std::vector<Position>>{ { "A1"_pos }, { "B1"_pos } }));
+
+        // Подписчик листа книги узнаёт об изменениях из-за записи в другой лист
+        Workbook book;
+        Sheet& data = book.AddSheet("Data");
+        Sheet& report = book.AddSheet("Report");
+        data.SetCell("A1"_pos, "1");
+        report.SetCell("A1"_pos, "=Data!A1+1");
+        ASSERT_EQUAL(report.GetCell("A1"_pos)->GetValue(), CellInterface::Value(2.0));
+        deliveries.clear();
+        report.Subscribe([&](const std::vector<Position>& changed) { deliveries.push_back(changed); });
+        data.SetCell("A1"_pos, "2");
+        ASSERT_EQUAL(deliveries, (std::vector<std::vector<Position>>{ { "A1"_pos } }));
+
+        // Прежнее значение невычисленной формулы не вычисляется ради подписчиков:
+        // ячейка сообщается как изменившаяся
+        Sheet lazy;
+        lazy.SetCell("C1"_pos, "1");
+        lazy.SetCell("B1"_pos, "=C1+1");
+        lazy.SetCell("A1"_pos, "=B1+1");
+        deliveries.clear();
+        lazy.Subscribe([&](const std::vector<Position>& changed) { deliveries.push_back(changed); });
+        lazy.ResetStats();
+        lazy.SetCell("A1"_pos, "3");
+        ASSERT_EQUAL(deliveries, (std::vector<std::vector<Position>>{ { "A1"_pos } }));
+        ASSERT_EQUAL(lazy.GetStats().ast_evaluations, 0u);
+
+        // Отклонённые записи не сообщаются
+        deliveries.clear();
+        try {
+            lazy.SetCell("B1"_pos, "=B1");
+        }
+        catch (const CircularDependencyException&) {
+        }
+        try {
+            lazy.SetCell("D1"_pos, "=(");
+        }
+        catch (const FormulaException&) {
+        }
+        lazy.SetCell("E1"_pos, "text");
+        ASSERT_EQUAL(deliveries, (std::vector<std::vector<Position>>{ { "E1"_pos } }));
+
+        // Исключение обработчика выходит из записи и не глушит следующие доставки
+        Sheet throwing;
+        deliveries.clear();
+        bool thrown = false;
+        throwing.Subscribe([&](const std::vector<Position>& changed) {
+            deliveries.push_back(changed);
+            if (!std::exchange(thrown, true))
+                throw std::runtime_error("listener");
+        });
+        try {
+            throwing.SetCell("A1"_pos, "1");
+            ASSERT(false);
+        }
+        catch (const std::runtime_error&) {
+        }
+        ASSERT_EQUAL(throwing.GetCell("A1"_pos)->GetText(), "1");
+        throwing.SetCell("A2"_pos, "2");
+        throwing.SetCell("A3"_pos, "3");
+        ASSERT_EQUAL(deliveries, (std::vector<std::vector<Position>>{ { "A1"_pos }, { "A2"_pos }, { "A3"_pos } }));
+
+        // Из фонового потока исключение отбрасывается
+        throwing.SetCell("B1"_pos, "=A1+1");
+        throwing.GetCell("B1"_pos)->GetValue();
+        throwing.SetCalculationMode(CalculationMode::MANUAL);
+        throwing.SetCell("A1"_pos, "5");
+        thrown = false;
+        throwing.Recalculate();
+        throwing.WaitForRecalculation();
+        ASSERT(thrown);
+        deliveries.clear();
+        throwing.SetCell("A2"_pos, "7");
+        ASSERT_EQUAL(deliveries, (std::vector<std::vector<Position>>{ { "A2"_pos } }));
+    }
+
+    void TestStats() {
+        Sheet sheet;
+        sheet.SetCell("A1"_pos, "1");
+        sheet.SetCell("B1"_pos, "=A1+C1");
+        sheet.GetCell("B1"_pos)->GetValue();
+        sheet.GetCell("B1"_pos)->GetValue();
+        sheet.SetCell("A1"_pos, "2");
+
+        SheetStats stats = sheet.GetStats();
+        if constexpr (PerfCounters::ENABLED) {
+            ASSERT_EQUAL(stats.formula_parses, 1u);
+            ASSERT_EQUAL(stats.ast_evaluations, 1u);
+            ASSERT_EQUAL(stats.cache_hits, 1u);
+            ASSERT_EQUAL(stats.cache_misses, 2u);  // B1 и A1; пустая C1 не читается
+            ASSERT_EQUAL(stats.invalidations, 1u);
+            ASSERT_EQUAL(stats.cells_materialized, 3u);
+            ASSERT(stats.bytes_allocated > 0);
+        }
+        else {
+            ASSERT_EQUAL(stats.cache_misses, 0u);
+        }
+
+        sheet.ResetStats();
+        ASSERT_EQUAL(sheet.GetStats().cache_misses, 0u);
+    }
+
+    void TestProfiler() {
+        Sheet sheet;
+        ASSERT(sheet.GetProfiler() == nullptr);
+        sheet.EnableProfiling(true);
+
+        sheet.SetCell("A1"_pos, "1");
+        sheet.SetCell("A2"_pos, "=A1+1");
+        sheet.SetCell("A3"_pos, "=A2*2+A1");
+        ASSERT_EQUAL(sheet.GetCell("A3"_pos)->GetValue(), CellInterface::Value(5.0));
+
+        const auto& samples = sheet.GetProfiler()->GetSamples();
+        ASSERT_EQUAL(samples.size(), 3u);
+        ASSERT_EQUAL(samples[0].pos, "A3"_pos);
+        ASSERT_EQUAL(samples[0].depth, 0u);
+        ASSERT_EQUAL(samples[0].ast_size, 5u);
+        ASSERT_EQUAL(samples[0].cells_read, 2u);
+        ASSERT_EQUAL(samples[1].pos, "A2"_pos);
+        ASSERT_EQUAL(samples[1].depth, 1u);
+        ASSERT_EQUAL(samples[2].pos, "A1"_pos);
+        ASSERT_EQUAL(samples[2].depth, 2u);
+        ASSERT(samples[0].duration >= samples[1].duration);
+
+        std::ostringstream report;
+        sheet.GetProfiler()->PrintHottestCells(report, 2);
+        ASSERT(report.str().find("cell\tevaluations") == 0);
+
+        std::ostringstream trace;
+        sheet.GetProfiler()->WriteChromeTrace(trace);
+        ASSERT(trace.str().find("\"traceEvents\"") != std::string::npos);
+        ASSERT(trace.str().find("\"name\":\"A3\"") != std::string::npos);
+
+        // Кадры цепочки вложены так же, как при рекурсивном вычислении
+        sheet.GetProfiler()->Clear();
+        sheet.SetCell("C4"_pos, "1");
+        sheet.SetCell("C3"_pos, "=C4+1");
+        sheet.SetCell("C2"_pos, "=C3+1");
+        sheet.SetCell("C1"_pos, "=C2+1");
+        ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(4.0));
+        ASSERT_EQUAL(samples.size(), 4u);
+        for (size_t i = 0; i < samples.size(); ++i) {
+            ASSERT_EQUAL(samples[i].pos, (Position{ static_cast<int>(i), 2 }));
+            ASSERT_EQUAL(samples[i].depth, i);
+            ASSERT_EQUAL(samples[i].cells_read, i + 1 < samples.size() ? 1u : 0u);
+            if (i > 0) {
+                ASSERT(samples[i].start >= samples[i - 1].start);
+                ASSERT(samples[i].duration <= samples[i - 1].duration - samples[i - 1].self);
+            }
+        }
+
+        sheet.EnableProfiling(false);
+        ASSERT(sheet.GetProfiler() == nullptr);
+    }
+
+    void TestHashPositionSpread() {
+        // Позиции одной строки и одного столбца не должны давать одинаковый хеш
+        std::set<size_t> hashes;
+        for (int i = 0; i < 1000; ++i) {
+            hashes.insert(HashPosition{}(Position{ 0, i }));
+            hashes.insert(HashPosition{}(Position{ i, 0 }));
+        }
+        ASSERT_EQUAL(hashes.size(), 1999u);
+
+        for (Position pos : { Position{ 0, 0 }, Position{ 16383, 16383 }, Position{ 136, 2 } }) {
+            ASSERT_EQUAL(UnpackPosition(PackPosition(pos)), pos);
+        }
+    }
+
+    void TestPositionSet() {
+        PositionSet set;
+        std::set<Position> expected;
+        std::mt19937 rng(42);
+        std::uniform_int_distribution<int> coord(0, 40);
+
+        for (int step = 0; step < 20000; ++step) {
+            Position pos{ coord(rng), coord(rng) };
+            if (rng() % 3 == 0) {
+                ASSERT_EQUAL(set.erase(pos), expected.erase(pos) == 1);
+            }
+            else {
+                ASSERT_EQUAL(set.insert(pos), expected.insert(pos).second);
+            }
+            ASSERT_EQUAL(set.count(pos), expected.count(pos));
+            ASSERT_EQUAL(set.size(), expected.size());
+        }
+
+        ASSERT_EQUAL(std::set<Position>(set.begin(), set.end()), expected);
+
+        PositionSet copy = set;
+        set.clear();
+        ASSERT(set.empty());
+        ASSERT_EQUAL(std::set<Position>(copy.begin(), copy.end()), expected);
+    }
+
     void TestClearPrint()
     {
         auto PrintSheet = [](std::unique_ptr<SheetInterface>& sheet)
@@ -383,12 +1820,20 @@ namespace {
 
 }  // namespace
 
-int main() {
+int main(int argc, char** argv) {
     TestRunner tr;
+    // Долгие проверки запускаются отдельным тестом ctest
+    if (argc > 1 && std::string_view(argv[1]) == "--exhaustive") {
+        RUN_TEST(tr, TestPositionCodecExhaustive);
+        return 0;
+    }
+
     RUN_TEST(tr, TestClearPrint);
     RUN_TEST(tr, TestPositionAndStringConversion);
     RUN_TEST(tr, TestPositionToStringInvalid);
     RUN_TEST(tr, TestStringToPositionInvalid);
+    RUN_TEST(tr, TestPositionCodec);
+    RUN_TEST(tr, TestPositionCodecAxes);
     RUN_TEST(tr, TestEmpty);
     RUN_TEST(tr, TestInvalidPosition);
     RUN_TEST(tr, TestSetCellPlainText);
@@ -396,14 +1841,47 @@ int main() {
     RUN_TEST(tr, TestFormulaArithmetic);
     RUN_TEST(tr, TestFormulaReferences);
     RUN_TEST(tr, TestFormulaExpressionFormatting);
+    RUN_TEST(tr, TestFormulaNumberRoundTrip);
+    RUN_TEST(tr, TestFormulaConstantFolding);
+    RUN_TEST(tr, TestFormulaCellAccessor);
     RUN_TEST(tr, TestFormulaReferencedCells);
     RUN_TEST(tr, TestErrorValue);
+    RUN_TEST(tr, TestErrorPropagation);
     RUN_TEST(tr, TestErrorDiv0);
     RUN_TEST(tr, TestEmptyCellTreatedAsZero);
     RUN_TEST(tr, TestFormulaInvalidPosition);
     RUN_TEST(tr, TestPrint);
     RUN_TEST(tr, TestCellReferences);
     RUN_TEST(tr, TestFormulaIncorrect);
+    RUN_TEST(tr, TestFormulaParseConcurrent);
     RUN_TEST(tr, TestCellCircularReferences);
+    RUN_TEST(tr, TestDependentsRecalculated);
+    RUN_TEST(tr, TestDeepChains);
+    RUN_TEST(tr, TestGetValueWithin);
+    RUN_TEST(tr, TestGetValueAsync);
+    RUN_TEST(tr, TestWorkloadGenerator);
+    RUN_TEST(tr, TestTraceRecordReplay);
+    RUN_TEST(tr, TestReadDoesNotMaterializeCells);
+    RUN_TEST(tr, TestPrintableSizeTracking);
+    RUN_TEST(tr, TestPrintRange);
+    RUN_TEST(tr, TestFormulaReferenceLinks);
+    RUN_TEST(tr, TestInsertRowsAndCols);
+    RUN_TEST(tr, TestDeleteRowsAndCols);
+    RUN_TEST(tr, TestInsertMatchesRebuild);
+    RUN_TEST(tr, TestFillRange);
+    RUN_TEST(tr, TestCopyRange);
+    RUN_TEST(tr, TestMoveRange);
+    RUN_TEST(tr, TestWorkbookReferences);
+    RUN_TEST(tr, TestWorkbookShift);
+    RUN_TEST(tr, TestWorkbookRecalculate);
+    RUN_TEST(tr, TestEagerCalculation);
+    RUN_TEST(tr, TestManualCalculation);
+    RUN_TEST(tr, TestRecalculationPriorities);
+    RUN_TEST(tr, TestSubscriptions);
+    RUN_TEST(tr, TestDeltaExport);
+    RUN_TEST(tr, TestStats);
+    RUN_TEST(tr, TestProfiler);
+    RUN_TEST(tr, TestHashPositionSpread);
+    RUN_TEST(tr, TestPositionSet);
     return 0;
 }
\ No newline at end of file
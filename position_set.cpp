@@ -0,0 +1,262 @@
+#include "position_set.h"
+
+#include <algorithm>
+#include <cstring>
+#include <utility>
+
+
+/********************   PositionSet::Iterator   ********************/
+
+PositionSet::Iterator::Iterator(const uint32_t* current, const uint32_t* end)
+    : current_(current)
+    , end_(end)
+{
+    SkipEmpty();
+}
+
+Position PositionSet::Iterator::operator*() const
+{
+    return UnpackPosition(*current_);
+}
+
+PositionSet::Iterator& PositionSet::Iterator::operator++()
+{
+    ++current_;
+    SkipEmpty();
+    return *this;
+}
+
+PositionSet::Iterator PositionSet::Iterator::operator++(int)
+{
+    Iterator old = *this;
+    ++*this;
+    return old;
+}
+
+bool PositionSet::Iterator::operator==(const Iterator& rhs) const
+{
+    return current_ == rhs.current_;
+}
+
+bool PositionSet::Iterator::operator!=(const Iterator& rhs) const
+{
+    return current_ != rhs.current_;
+}
+
+void PositionSet::Iterator::SkipEmpty()
+{
+    while (current_ != end_ && *current_ == EMPTY_KEY)
+        ++current_;
+}
+
+
+/********************   PositionSet   ********************/
+
+PositionSet::PositionSet(const PositionSet& other)
+    : size_(other.size_)
+    , capacity_(other.capacity_)
+{
+    if (other.IsInline())
+    {
+        std::copy(other.inline_, other.inline_ + other.size_, inline_);
+    }
+    else
+    {
+        slots_ = new uint32_t[capacity_];
+        std::copy(other.slots_, other.slots_ + capacity_, slots_);
+    }
+}
+
+PositionSet::PositionSet(PositionSet&& other) noexcept
+{
+    swap(*this, other);
+}
+
+PositionSet& PositionSet::operator=(PositionSet other) noexcept
+{
+    swap(*this, other);
+    return *this;
+}
+
+PositionSet::~PositionSet()
+{
+    if (!IsInline())
+        delete[] slots_;
+}
+
+void swap(PositionSet& lhs, PositionSet& rhs) noexcept
+{
+    // Объединение копируется целиком: в нём либо ключи, либо указатель
+    uint32_t buffer[PositionSet::INLINE_CAPACITY];
+    std::memcpy(buffer, lhs.inline_, sizeof(buffer));
+    std::memcpy(lhs.inline_, rhs.inline_, sizeof(buffer));
+    std::memcpy(rhs.inline_, buffer, sizeof(buffer));
+    std::swap(lhs.size_, rhs.size_);
+    std::swap(lhs.capacity_, rhs.capacity_);
+}
+
+bool PositionSet::insert(Position pos)
+{
+    const uint32_t key = PackPosition(pos);
+    if (IsInline())
+    {
+        if (std::find(inline_, inline_ + size_, key) != inline_ + size_)
+            return false;
+        if (size_ < INLINE_CAPACITY)
+        {
+            inline_[size_++] = key;
+            return true;
+        }
+        Rehash(MIN_TABLE_CAPACITY);
+    }
+
+    uint32_t* slot = FindSlot(key);
+    if (*slot == key)
+        return false;
+
+    // Заполненность не выше 3/4, иначе цепочки пробирования растут
+    if ((size_ + 1) * 4 > capacity_ * 3)
+    {
+        Rehash(capacity_ * 2);
+        slot = FindSlot(key);
+    }
+    *slot = key;
+    ++size_;
+    return true;
+}
+
+bool PositionSet::erase(Position pos)
+{
+    const uint32_t key = PackPosition(pos);
+    if (IsInline())
+    {
+        uint32_t* it = std::find(inline_, inline_ + size_, key);
+        if (it == inline_ + size_)
+            return false;
+        *it = inline_[--size_];
+        return true;
+    }
+
+    uint32_t* slot = FindSlot(key);
+    if (*slot != key)
+        return false;
+
+    // Удаление со сдвигом назад: без надгробий поиск остаётся коротким
+    const uint32_t mask = capacity_ - 1;
+    uint32_t hole = static_cast<uint32_t>(slot - slots_);
+    uint32_t next = hole;
+    while (true)
+    {
+        next = (next + 1) & mask;
+        if (slots_[next] == EMPTY_KEY)
+            break;
+        uint32_t home = Home(slots_[next]);
+        // Ключ можно сдвинуть в дыру, если его домашний слот не лежит в (hole, next]
+        bool stays = hole <= next ? (hole < home && home <= next) : (hole < home || home <= next);
+        if (!stays)
+        {
+            slots_[hole] = slots_[next];
+            hole = next;
+        }
+    }
+    slots_[hole] = EMPTY_KEY;
+    --size_;
+    return true;
+}
+
+size_t PositionSet::count(Position pos) const
+{
+    const uint32_t key = PackPosition(pos);
+    if (IsInline())
+        return std::find(inline_, inline_ + size_, key) != inline_ + size_ ? 1 : 0;
+    return *FindSlot(key) == key ? 1 : 0;
+}
+
+size_t PositionSet::size() const
+{
+    return size_;
+}
+
+bool PositionSet::empty() const
+{
+    return size_ == 0;
+}
+
+void PositionSet::clear()
+{
+    if (!IsInline())
+        delete[] slots_;
+    size_ = 0;
+    capacity_ = 0;
+}
+
+PositionSet::Iterator PositionSet::begin() const
+{
+    return Iterator(Data(), Data() + StorageSize());
+}
+
+PositionSet::Iterator PositionSet::end() const
+{
+    return Iterator(Data() + StorageSize(), Data() + StorageSize());
+}
+
+bool PositionSet::IsInline() const
+{
+    return capacity_ == 0;
+}
+
+const uint32_t* PositionSet::Data() const
+{
+    return IsInline() ? inline_ : slots_;
+}
+
+uint32_t* PositionSet::Data()
+{
+    return IsInline() ? inline_ : slots_;
+}
+
+uint32_t PositionSet::StorageSize() const
+{
+    return IsInline() ? size_ : capacity_;
+}
+
+uint32_t PositionSet::Home(uint32_t key) const
+{
+    return static_cast<uint32_t>(MixKey(key)) & (capacity_ - 1);
+}
+
+uint32_t* PositionSet::FindSlot(uint32_t key) const
+{
+    // Возвращает слот с ключом или первый пустой слот на его пути
+    const uint32_t mask = capacity_ - 1;
+    uint32_t index = Home(key);
+    while (slots_[index] != EMPTY_KEY && slots_[index] != key)
+        index = (index + 1) & mask;
+    return slots_ + index;
+}
+
+void PositionSet::Rehash(uint32_t capacity)
+{
+    uint32_t* new_slots = new uint32_t[capacity];
+    std::fill(new_slots, new_slots + capacity, EMPTY_KEY);
+
+    const uint32_t* old_begin = Data();
+    const uint32_t* old_end = old_begin + StorageSize();
+    const bool was_inline = IsInline();
+    uint32_t* old_slots = was_inline ? nullptr : slots_;
+
+    const uint32_t mask = capacity - 1;
+    for (const uint32_t* it = old_begin; it != old_end; ++it)
+    {
+        if (*it == EMPTY_KEY)
+            continue;
+        uint32_t index = static_cast<uint32_t>(MixKey(*it)) & mask;
+        while (new_slots[index] != EMPTY_KEY)
+            index = (index + 1) & mask;
+        new_slots[index] = *it;
+    }
+
+    delete[] old_slots;
+    slots_ = new_slots;
+    capacity_ = capacity;
+}
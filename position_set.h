@@ -0,0 +1,88 @@
+#pragma once
+
+#include "common.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+
+// Компактное множество позиций для рёбер зависимостей. Позиции хранятся
+// упакованными 32-битными ключами: до INLINE_CAPACITY штук прямо в объекте,
+// дальше — в открытой хеш-таблице с линейным пробированием.
+// Порядок обхода не определён.
+class PositionSet
+{
+public:
+    class Iterator
+    {
+    public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = Position;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const Position*;
+        using reference = Position;
+
+        Iterator(const uint32_t* current, const uint32_t* end);
+
+        Position operator*() const;
+        Iterator& operator++();
+        Iterator operator++(int);
+        bool operator==(const Iterator& rhs) const;
+        bool operator!=(const Iterator& rhs) const;
+
+    private:
+        void SkipEmpty();
+
+        const uint32_t* current_;
+        const uint32_t* end_;
+    };
+
+    PositionSet() = default;
+    PositionSet(const PositionSet& other);
+    PositionSet(PositionSet&& other) noexcept;
+    PositionSet& operator=(PositionSet other) noexcept;
+    ~PositionSet();
+
+    template <typename It>
+    PositionSet(It first, It last)
+    {
+        for (; first != last; ++first)
+            insert(*first);
+    }
+
+    // Возвращают true, если множество изменилось
+    bool insert(Position pos);
+    bool erase(Position pos);
+
+    size_t count(Position pos) const;
+    size_t size() const;
+    bool empty() const;
+    void clear();
+
+    Iterator begin() const;
+    Iterator end() const;
+
+    friend void swap(PositionSet& lhs, PositionSet& rhs) noexcept;
+
+private:
+    static constexpr uint32_t EMPTY_KEY = UINT32_MAX;
+    static constexpr uint32_t INLINE_CAPACITY = 6;
+    static constexpr uint32_t MIN_TABLE_CAPACITY = 16;
+
+    bool IsInline() const;
+    const uint32_t* Data() const;
+    uint32_t* Data();
+    uint32_t StorageSize() const;   // Сколько слотов обходить
+
+    uint32_t Home(uint32_t key) const;
+    uint32_t* FindSlot(uint32_t key) const;
+    void Rehash(uint32_t capacity);
+
+    uint32_t size_ = 0;
+    uint32_t capacity_ = 0;         // 0 — ключи лежат в inline_
+    union
+    {
+        uint32_t inline_[INLINE_CAPACITY] = {};
+        uint32_t* slots_;
+    };
+};
@@ -0,0 +1,151 @@
+#include "profiler.h"
+
+#include <algorithm>
+#include <iomanip>
+#include <iostream>
+#include <map>
+
+using namespace std::chrono;
+
+
+/********************   EvaluationProfiler::Scope   ********************/
+
+EvaluationProfiler::Scope::Scope(EvaluationProfiler* profiler, Position pos, size_t ast_size)
+    : profiler_(profiler)
+{
+    if (profiler_)
+        profiler_->BeginEvaluation(pos, ast_size);
+}
+
+EvaluationProfiler::Scope::~Scope()
+{
+    if (profiler_)
+        profiler_->EndEvaluation();
+}
+
+
+/********************   EvaluationProfiler   ********************/
+
+EvaluationProfiler::EvaluationProfiler()
+    : origin_(Clock::now())
+{
+}
+
+void EvaluationProfiler::BeginEvaluation(Position pos, size_t ast_size)
+{
+    Sample sample;
+    sample.pos = pos;
+    sample.ast_size = ast_size;
+    sample.depth = stack_.size();
+    sample.thread = ThreadIndex();
+
+    Clock::time_point now = Clock::now();
+    sample.start = duration_cast<nanoseconds>(now - origin_);
+
+    stack_.push_back({ samples_.size(), now });
+    samples_.push_back(sample);
+}
+
+void EvaluationProfiler::EndEvaluation()
+{
+    Frame frame = stack_.back();
+    stack_.pop_back();
+
+    Sample& sample = samples_[frame.sample];
+    sample.duration = duration_cast<nanoseconds>(Clock::now() - frame.start);
+    sample.self = sample.duration - frame.children;
+
+    if (!stack_.empty())
+        stack_.back().children += sample.duration;
+}
+
+void EvaluationProfiler::OnCellRead()
+{
+    if (!stack_.empty())
+        ++samples_[stack_.back().sample].cells_read;
+}
+
+const std::vector<EvaluationProfiler::Sample>& EvaluationProfiler::GetSamples() const
+{
+    return samples_;
+}
+
+void EvaluationProfiler::Clear()
+{
+    samples_.clear();
+    origin_ = Clock::now();
+}
+
+void EvaluationProfiler::PrintHottestCells(std::ostream& output, size_t limit) const
+{
+    struct Total
+    {
+        size_t      evaluations = 0;
+        nanoseconds self{0};
+        nanoseconds duration{0};
+        size_t      ast_size = 0;
+        size_t      cells_read = 0;
+        size_t      max_depth = 0;
+    };
+
+    std::map<Position, Total> totals;
+    for (const Sample& sample : samples_)
+    {
+        Total& total = totals[sample.pos];
+        ++total.evaluations;
+        total.self += sample.self;
+        total.duration += sample.duration;
+        total.ast_size = sample.ast_size;
+        total.cells_read += sample.cells_read;
+        total.max_depth = std::max(total.max_depth, sample.depth);
+    }
+
+    std::vector<std::pair<Position, Total>> hottest(totals.begin(), totals.end());
+    std::sort(hottest.begin(), hottest.end(), [](const auto& lhs, const auto& rhs)
+        {
+            return lhs.second.self > rhs.second.self;
+        });
+    if (hottest.size() > limit)
+        hottest.resize(limit);
+
+    auto micros = [](nanoseconds ns) { return duration<double, std::micro>(ns).count(); };
+
+    output << "cell\tevaluations\tself_us\ttotal_us\tast_size\tcells_read\tmax_depth\n";
+    for (const auto& [pos, total] : hottest)
+    {
+        output << pos.ToString() << '\t' << total.evaluations << '\t'
+            << std::fixed << std::setprecision(3) << micros(total.self) << '\t' << micros(total.duration)
+            << std::defaultfloat << '\t' << total.ast_size << '\t' << total.cells_read << '\t'
+            << total.max_depth << '\n';
+    }
+}
+
+void EvaluationProfiler::WriteChromeTrace(std::ostream& output) const
+{
+    auto micros = [](nanoseconds ns) { return duration<double, std::micro>(ns).count(); };
+
+    // Полные события ("ph": "X") с вложенными интервалами образуют дерево вызовов
+    output << "{\"traceEvents\":[";
+    bool first = true;
+    for (const Sample& sample : samples_)
+    {
+        if (!first)
+            output << ',';
+        first = false;
+
+        output << "\n{\"name\":\"" << sample.pos.ToString() << "\",\"cat\":\"eval\",\"ph\":\"X\""
+            << std::fixed << std::setprecision(3)
+            << ",\"ts\":" << micros(sample.start) << ",\"dur\":" << micros(sample.duration)
+            << std::defaultfloat
+            << ",\"pid\":1,\"tid\":" << sample.thread
+            << ",\"args\":{\"ast_size\":" << sample.ast_size << ",\"cells_read\":" << sample.cells_read
+            << ",\"depth\":" << sample.depth << "}}";
+    }
+    output << "\n],\"displayTimeUnit\":\"ns\"}\n";
+}
+
+size_t EvaluationProfiler::ThreadIndex()
+{
+    auto [it, inserted] = threads_.emplace(std::this_thread::get_id(), threads_.size() + 1);
+    return it->second;
+}
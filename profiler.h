@@ -0,0 +1,77 @@
+#pragma once
+
+#include "common.h"
+
+#include <chrono>
+#include <iosfwd>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// Профилировщик вычислений ячеек. Записывает каждый промах кэша
+// в Cell::GetValue: время вычисления, размер AST, число прочитанных
+// ячеек и глубину рекурсии. Вычисление одной таблицы идёт в одном потоке
+// за раз (под блокировкой таблицы), поэтому стек вызовов общий.
+class EvaluationProfiler
+{
+    using Clock = std::chrono::steady_clock;
+
+public:
+    struct Sample
+    {
+        Position                 pos;
+        std::chrono::nanoseconds start{0};     // От момента создания профилировщика
+        std::chrono::nanoseconds duration{0};  // Вместе с вложенными вычислениями
+        std::chrono::nanoseconds self{0};      // Без вложенных вычислений
+        size_t                   ast_size = 0;
+        size_t                   cells_read = 0;  // Ячейки, прочитанные формулой напрямую
+        size_t                   depth = 0;       // 0 — вычисление, запрошенное снаружи
+        size_t                   thread = 0;
+    };
+
+    // Открывает и закрывает кадр вычисления; ничего не делает для nullptr
+    class Scope
+    {
+    public:
+        Scope(EvaluationProfiler* profiler, Position pos, size_t ast_size);
+        ~Scope();
+
+        Scope(const Scope&) = delete;
+        Scope& operator=(const Scope&) = delete;
+
+    private:
+        EvaluationProfiler* profiler_;
+    };
+
+    EvaluationProfiler();
+
+    void BeginEvaluation(Position pos, size_t ast_size);
+    void EndEvaluation();
+
+    // Чтение ячейки изнутри вычисляемой формулы
+    void OnCellRead();
+
+    const std::vector<Sample>& GetSamples() const;
+    void Clear();
+
+    // Ячейки с наибольшим собственным временем вычисления
+    void PrintHottestCells(std::ostream& output, size_t limit = 10) const;
+
+    // JSON в формате Chrome trace events (chrome://tracing, Perfetto)
+    void WriteChromeTrace(std::ostream& output) const;
+
+private:
+    struct Frame
+    {
+        size_t                   sample;
+        Clock::time_point        start;
+        std::chrono::nanoseconds children{0};
+    };
+
+    size_t ThreadIndex();
+
+    Clock::time_point                         origin_;
+    std::vector<Frame>                        stack_;
+    std::vector<Sample>                       samples_;
+    std::unordered_map<std::thread::id, size_t> threads_;
+};
@@ -1,13 +1,57 @@
 #include "sheet.h"
+#include "workbook.h"
 
 #include <algorithm>
 #include <functional>
 #include <iostream>
+#include <tuple>
+#include <utility>
 
 using namespace std::literals;
 
+namespace
+{
+    // Общая пустая ячейка, которую возвращает GetCell для незаполненных позиций
+    class EmptyCell final : public CellInterface
+    {
+    public:
+        Value GetValue() const override
+        {
+            return std::string();
+        }
+
+        std::string GetText() const override
+        {
+            return std::string();
+        }
+
+        std::vector<Position> GetReferencedCells() const override
+        {
+            return {};
+        }
+    };
+
+    EmptyCell empty_cell;
+
+    // Область того же размера, что from, с левым верхним углом to
+    Range TargetRange(const Range& from, Position to)
+    {
+        Size size = from.GetSize();
+        return { to, { to.row + size.rows - 1, to.col + size.cols - 1 } };
+    }
+}  // namespace
+
+
+Sheet::Sheet(Workbook& workbook, std::string name)
+    : workbook_(&workbook)
+    , name_(std::move(name))
+{
+}
+
 Sheet::~Sheet()
 {
+    StopReader();
+    StopWorker();
 }
 
 void Sheet::SetCell(Position pos, std::string text)
@@ -15,51 +59,693 @@ void Sheet::SetCell(Position pos, std::string text)
     if (!pos.IsValid())
         throw InvalidPositionException("Sheet::SetCell: Invalid position");
 
-    if (!text.empty())
-        positions_.insert(pos);
+    auto lock = Lock();
+    // Прежнее значение запоминается до записи, а изменение отмечается только после неё:
+    // отклонённая запись не меняет ни версии строк, ни изменения для подписчиков
+    auto previous = PreviousValue(pos);
+    // Set создаёт ячейки, на которые ссылается формула, и может перестроить таблицу,
+    // поэтому после него используется указатель на ячейку, а не итератор
+    Cell* cell = FindCell(pos);
+    if (!cell)
+    {
+        auto created = std::make_unique<Cell>(*this, pos);
+        created->Set(std::move(text));
+        cell = table_.emplace(pos, std::move(created)).first->second.get();
+        counters_.Add(Counter::CELLS_MATERIALIZED);
+        counters_.Add(Counter::BYTES_ALLOCATED, sizeof(Cell));
+    }
+    else
+    {
+        cell->Set(std::move(text));
+    }
+    RecordChange(pos, std::move(previous));
+    MarkRowChanged(pos.row);
 
-    if (!table_.count(pos))
-        table_[pos] = std::make_unique<Cell>(*this, pos, std::move(text));
+    if (cell->Empty())
+    {
+        RemovePrintable(pos);
+        ReleaseCell(pos);
+    }
     else
-        table_[pos]->Set(std::move(text));
+    {
+        AddPrintable(pos);
+    }
+    NotifyChanges();
 }
 
 const CellInterface* Sheet::GetCell(Position pos) const
 {
-    return const_cast<Sheet*>(this)->GetCell(pos);
+    if (!pos.IsValid())
+        throw InvalidPositionException("Sheet::GetCell: Invalid position");
+
+    auto lock = Lock();
+    const Cell* cell = FindCell(pos);
+    if (cell && !cell->Empty())
+        return cell;
+
+    if (!IsCellAvailable(pos))
+        return nullptr;
+
+    return cell ? static_cast<const CellInterface*>(cell) : &empty_cell;
 }
 
 CellInterface* Sheet::GetCell(Position pos)
+{
+    return const_cast<CellInterface*>(std::as_const(*this).GetCell(pos));
+}
+
+void Sheet::ClearCell(Position pos)
 {
     if (!pos.IsValid())
-        throw InvalidPositionException("Sheet::GetCell: Invalid position");
+        throw InvalidPositionException("Sheet::ClearCell: Invalid position");
+
+    auto lock = Lock();
+    Cell* cell = FindCell(pos);
+    if (!cell)
+        return;
+
+    auto previous = PreviousValue(pos);
+    cell->Clear();
+    RecordChange(pos, std::move(previous));
+    MarkRowChanged(pos.row);
+    RemovePrintable(pos);
+    ReleaseCell(pos);
+    NotifyChanges();
+}
+
+void Sheet::InsertRows(int before, int count)
+{
+    InsertLines(PositionShift::Axis::ROWS, before, count);
+}
+
+void Sheet::InsertCols(int before, int count)
+{
+    InsertLines(PositionShift::Axis::COLS, before, count);
+}
+
+void Sheet::DeleteRows(int first, int count)
+{
+    DeleteLines(PositionShift::Axis::ROWS, first, count);
+}
+
+void Sheet::DeleteCols(int first, int count)
+{
+    DeleteLines(PositionShift::Axis::COLS, first, count);
+}
+
+void Sheet::InsertLines(PositionShift::Axis axis, int before, int count)
+{
+    const bool rows = axis == PositionShift::Axis::ROWS;
+    const int limit = rows ? Position::MAX_ROWS : Position::MAX_COLS;
+    if (before < 0 || before >= limit || count < 0)
+        throw InvalidPositionException("Sheet::InsertLines: Invalid position");
+
+    auto lock = Lock();
+    Size size = GetPrintableSize();
+    const int used = rows ? size.rows : size.cols;
+    // Сравнение без сложения: used + count переполняется при count около INT_MAX
+    if (used > before && count > limit - used)
+        throw TableTooBigException("Sheet::InsertLines: Cells would be moved out of the table");
+
+    // Сдвиг больше limit - before вытесняет за пределы таблицы то же, что и сдвиг на limit - before
+    ShiftCells(PositionShift::Lines(axis, before, std::min(count, limit - before), true));
+    NotifyChanges();
+}
+
+void Sheet::DeleteLines(PositionShift::Axis axis, int first, int count)
+{
+    const int limit = axis == PositionShift::Axis::ROWS ? Position::MAX_ROWS : Position::MAX_COLS;
+    if (first < 0 || first >= limit || count < 0)
+        throw InvalidPositionException("Sheet::DeleteLines: Invalid position");
+
+    auto lock = Lock();
+    ShiftCells(PositionShift::Lines(axis, first, std::min(count, limit - first), false));
+    NotifyChanges();
+}
+
+void Sheet::ShiftCells(const PositionShift& shift)
+{
+    if (shift.rows == 0 && shift.cols == 0)
+        return;
+
+    // Хранимые ячейки в затронутых областях. Любая ячейка, на которую ссылается
+    // формула, хранится, поэтому других ссылок в эти области нет
+    std::vector<Table::iterator> moved = FindCells(shift.moved);
+    for (auto it : FindCells(shift.deleted))
+    {
+        if (!shift.moved.Contains(it->first))
+            moved.push_back(it);
+    }
+    if (moved.empty())
+        return;
+
+    // Видимые значения меняются там, откуда уходят и куда приходят непустые ячейки
+    for (auto it : moved)
+    {
+        if (it->second->Empty())
+            continue;
+        RecordChange(it->first);
+        MarkRowChanged(it->first.row);
+        if (Position to = shift.Apply(it->first); to.IsValid())
+        {
+            RecordChange(to);
+            MarkRowChanged(to.row);
+        }
+    }
+
+    // Ячейки, связанные со сдвигаемыми ячейками рёбрами между листами книги, включая
+    // ссылки листа на себя по имени. Их рёбра и ссылки на этот лист сдвигаются отдельно
+    std::vector<std::tuple<Sheet*, Position, Cell*>> linked;
+    for (auto it : moved)
+    {
+        const Cell& cell = *it->second;
+        for (const Cell::SheetEdges* edges : { &cell.GetExternalDependents(), &cell.GetExternalIncludes() })
+        {
+            for (const auto& [sheet, positions] : *edges)
+            {
+                for (Position pos : positions)
+                    linked.emplace_back(sheet, pos, sheet->FindCell(pos));
+            }
+        }
+    }
+    auto by_cell = [](const auto& lhs, const auto& rhs) { return std::get<Cell*>(lhs) < std::get<Cell*>(rhs); };
+    auto same_cell = [](const auto& lhs, const auto& rhs) { return std::get<Cell*>(lhs) == std::get<Cell*>(rhs); };
+    std::sort(linked.begin(), linked.end(), by_cell);
+    linked.erase(std::unique(linked.begin(), linked.end(), same_cell), linked.end());
+
+    // Ячейки, чьи позиции, рёбра или ссылки меняются: сдвигаемые и связанные с ними рёбрами.
+    // Сдвигаемые отмечаются первыми, чтобы не искать их в таблице повторно
+    PositionSet visited;
+    std::vector<std::pair<Position, Cell*>> touched;
+    for (auto it : moved)
+    {
+        visited.insert(it->first);
+        touched.emplace_back(it->first, it->second.get());
+    }
+    for (auto it : moved)
+    {
+        for (const PositionSet* edges : { &it->second->GetDependents(), &it->second->GetIncludes() })
+        {
+            for (Position pos : *edges)
+            {
+                if (visited.insert(pos))
+                    touched.emplace_back(pos, FindCell(pos));
+            }
+        }
+    }
+
+    // Указатели на ячейки не меняются, поэтому связывать заново нужно только формулы,
+    // потерявшие ссылки или изменившие их порядок
+    std::vector<Cell*> relinked;
+    for (auto [pos, cell] : touched)
+    {
+        if (cell->Shift(shift) && shift.Apply(pos).IsValid())
+            relinked.push_back(cell);
+    }
+    for (auto [sheet, pos, cell] : linked)
+    {
+        if (cell->ShiftExternal(*this, shift) && (sheet != this || shift.Apply(pos).IsValid()))
+            relinked.push_back(cell);
+    }
 
-    if (IsCellAvailable(pos))
+    // Узлы таблицы переносятся целиком, сами ячейки не копируются.
+    // Удалённые ячейки живут до конца метода
+    std::vector<Table::node_type> nodes;
+    nodes.reserve(moved.size());
+    for (auto it : moved)
+    {
+        positions_.erase(it->first);
+        nodes.push_back(table_.extract(it));
+    }
+    std::vector<Table::node_type> deleted;
+    for (auto& node : nodes)
     {
-        if (!table_.count(pos))
-            SetCell(pos, std::string());
+        Position to = shift.Apply(node.key());
+        if (!to.IsValid())
+        {
+            deleted.push_back(std::move(node));
+            continue;
+        }
+        node.key() = to;
+        if (!node.mapped()->Empty())
+            positions_.insert(to);
+        table_.insert(std::move(node));
+    }
+    printable_size_actual_ = false;
 
-        return table_.at(pos).get();
+    // Очереди пересчёта и закреплённые ячейки следуют за ячейками
+    auto shift_positions = [&shift](std::vector<Position>& positions)
+    {
+        for (Position& pos : positions)
+            pos = shift.Apply(pos);
+        positions.erase(std::remove_if(positions.begin(), positions.end(), [](Position pos) { return !pos.IsValid(); }),
+            positions.end());
+    };
+    shift_positions(dirty_);
+    for (auto& queue : queues_)
+        shift_positions(queue);
+    if (!pinned_.empty())
+    {
+        PositionSet pinned;
+        for (Position pos : pinned_)
+        {
+            if (Position to = shift.Apply(pos); to.IsValid())
+                pinned.insert(to);
+        }
+        pinned_ = std::move(pinned);
+    }
+    // Отложенные асинхронные чтения тоже; чтение удалённой ячейки вернёт пустое значение
+    for (AsyncRead& read : reads_)
+    {
+        read.pos = shift.Apply(read.pos);
+        shift_positions(read.progress);
+    }
+
+    for (Cell* cell : relinked)
+    {
+        cell->LinkReferences();
+        cell->Invalidate();
+    }
+
+    // Пустые ячейки, на которые ссылались только удалённые формулы, больше не нужны
+    if (!deleted.empty())
+    {
+        for (auto [pos, cell] : touched)
+        {
+            if (Position to = shift.Apply(pos); to.IsValid())
+                ReleaseCell(to);
+        }
+        for (auto [sheet, pos, cell] : linked)
+            sheet->ReleaseCell(sheet == this ? shift.Apply(pos) : pos);
+    }
+}
+
+void Sheet::FillRange(const Range& range, std::string text)
+{
+    if (!range.IsValid())
+        throw InvalidPositionException("Sheet::FillRange: Invalid range");
+
+    auto lock = Lock();
+    Cell::Content content = Cell::Parse(*this, std::move(text));
+    Size size = range.GetSize();
+    std::vector<Cell::Content> contents;
+    contents.reserve(range.GetCellCount());
+    for (int row = 0; row < size.rows; ++row)
+    {
+        for (int col = 0; col < size.cols; ++col)
+            contents.push_back(content.Translate(row, col));
+    }
+    WriteRange(range, std::move(contents));
+    NotifyChanges();
+}
+
+void Sheet::CopyRange(const Range& from, Position to)
+{
+    if (!from.IsValid() || !TargetRange(from, to).IsValid())
+        throw InvalidPositionException("Sheet::CopyRange: Invalid range");
+
+    auto lock = Lock();
+    // Источник читается целиком до записи, поэтому области могут пересекаться
+    const int rows = to.row - from.first.row;
+    const int cols = to.col - from.first.col;
+    const int width = from.GetSize().cols;
+    std::vector<Cell::Content> contents(from.GetCellCount());
+    for (auto it : FindCells(from))
+    {
+        Position pos = it->first;
+        size_t index = static_cast<size_t>(pos.row - from.first.row) * width + (pos.col - from.first.col);
+        contents[index] = it->second->GetContent(rows, cols);
+    }
+    WriteRange(TargetRange(from, to), std::move(contents));
+    NotifyChanges();
+}
+
+void Sheet::MoveRange(const Range& from, Position to)
+{
+    if (!from.IsValid() || !TargetRange(from, to).IsValid())
+        throw InvalidPositionException("Sheet::MoveRange: Invalid range");
+
+    auto lock = Lock();
+    ShiftCells(PositionShift::Move(from, to));
+    NotifyChanges();
+}
+
+void Sheet::ClearRange(const Range& range)
+{
+    if (!range.IsValid())
+        throw InvalidPositionException("Sheet::ClearRange: Invalid range");
+
+    auto lock = Lock();
+    std::vector<std::pair<Position, Cell*>> cleared;
+    for (auto it : FindCells(range))
+    {
+        if (!it->second->Empty())
+            cleared.emplace_back(it->first, it->second.get());
+    }
+    // Прежние значения запоминаются до очистки: от очищаемых ячеек могут зависеть другие ячейки области
+    for (auto [pos, cell] : cleared)
+        RecordChange(pos);
+    // Освободить можно только пустую ячейку, поэтому непустая ячейка
+    // остаётся в таблице, пока её не очистили
+    for (auto [pos, cell] : cleared)
+        WriteCell(pos, *cell, {});
+    NotifyChanges();
+}
+
+void Sheet::WriteRange(const Range& range, std::vector<Cell::Content> contents)
+{
+    if (HasCycle(range, contents))
+        throw CircularDependencyException("Cyclic dependency detected");
+
+    // Прежние значения запоминаются до записи: ячейки области могут зависеть друг от друга
+    if (IsObserved())
+    {
+        auto content = contents.begin();
+        for (int row = range.first.row; row <= range.last.row; ++row)
+        {
+            for (int col = range.first.col; col <= range.last.col; ++col, ++content)
+            {
+                Position pos{ row, col };
+                if (!content->Empty() || FindCell(pos))
+                    RecordChange(pos);
+            }
+        }
+    }
+
+    table_.reserve(table_.size() + contents.size());
+    auto content = contents.begin();
+    for (int row = range.first.row; row <= range.last.row; ++row)
+    {
+        for (int col = range.first.col; col <= range.last.col; ++col, ++content)
+        {
+            Position pos{ row, col };
+            Cell* cell = content->Empty() ? FindCell(pos) : &GetOrCreateCell(pos);
+            if (cell && !(content->Empty() && cell->Empty()))
+                WriteCell(pos, *cell, std::move(*content));
+        }
+    }
+}
+
+void Sheet::WriteCell(Position pos, Cell& cell, Cell::Content content)
+{
+    const bool was_empty = cell.Empty();
+    MarkRowChanged(pos.row);
+    cell.SetContent(std::move(content));
+    // Обход зависимых останавливается на ячейках с уже сброшенным кэшем,
+    // поэтому при записи области каждая зависимая ячейка сбрасывается один раз
+    cell.InvalidateDependents();
+    if (cell.Empty())
+    {
+        RemovePrintable(pos);
+        ReleaseCell(pos);
+    }
+    else if (was_empty)
+    {
+        AddPrintable(pos);
+    }
+}
+
+bool Sheet::HasCycle(const Range& range, const std::vector<Cell::Content>& contents) const
+{
+    // Старый граф ацикличен, поэтому любой цикл проходит через новую формулу области.
+    // Обход в глубину идёт по новым ссылкам ячеек области и старым рёбрам остальных ячеек,
+    // в том числе ячеек других листов книги
+    using Node = std::pair<const Sheet*, Position>;
+    struct Frame
+    {
+        Node node;
+        std::vector<Node> next;
+        size_t visited = 0;
+    };
+    // Пройденные ячейки и ячейки текущего пути. Другие листы заводятся, только если обход до них дошёл
+    struct Marks
+    {
+        PositionSet done;
+        PositionSet path;
+    };
+
+    const int width = range.GetSize().cols;
+    auto references = [this](const Cell::Content& content)
+    {
+        std::vector<Node> next;
+        for (Position pos : content.GetReferencedCells())
+            next.emplace_back(this, pos);
+        for (auto [sheet, pos] : content.GetExternalCells())
+            next.emplace_back(sheet, pos);
+        return next;
+    };
+
+    Marks own;
+    std::unordered_map<const Sheet*, Marks> others;
+    auto marks = [&](const Sheet* sheet) -> Marks& { return sheet == this ? own : others[sheet]; };
+    std::vector<Frame> stack;
+    for (size_t i = 0; i < contents.size(); ++i)
+    {
+        Position root{ range.first.row + static_cast<int>(i / width), range.first.col + static_cast<int>(i % width) };
+        if (!contents[i].IsFormula() || own.done.count(root))
+            continue;
+
+        own.path.insert(root);
+        stack.push_back({ { this, root }, references(contents[i]) });
+        while (!stack.empty())
+        {
+            Frame& frame = stack.back();
+            if (frame.visited == frame.next.size())
+            {
+                Marks& frame_marks = marks(frame.node.first);
+                frame_marks.path.erase(frame.node.second);
+                frame_marks.done.insert(frame.node.second);
+                stack.pop_back();
+                continue;
+            }
+
+            auto [sheet, pos] = frame.next[frame.visited++];
+            Marks& node_marks = marks(sheet);
+            if (node_marks.path.count(pos))
+                return true;
+            if (node_marks.done.count(pos))
+                continue;
+            counters_.Add(Counter::CYCLE_CHECK_VISITS);
+
+            std::vector<Node> next;
+            if (sheet == this && range.Contains(pos))
+            {
+                size_t index = static_cast<size_t>(pos.row - range.first.row) * width + (pos.col - range.first.col);
+                next = references(contents[index]);
+            }
+            else if (const Cell* cell = sheet->FindCell(pos))
+            {
+                for (Position include : cell->GetIncludes())
+                    next.emplace_back(sheet, include);
+                for (const auto& [other, positions] : cell->GetExternalIncludes())
+                {
+                    for (Position include : positions)
+                        next.emplace_back(other, include);
+                }
+            }
+            if (next.empty())
+            {
+                // Ячейки вне области без ссылок не могут замкнуть цикл, их не нужно запоминать
+                continue;
+            }
+            node_marks.path.insert(pos);
+            stack.push_back({ { sheet, pos }, std::move(next) });
+        }
+    }
+    return false;
+}
+
+std::vector<Sheet::Table::iterator> Sheet::FindCells(const Range& range)
+{
+    std::vector<Table::iterator> cells;
+    if (!range.IsValid())
+        return cells;
+
+    // Небольшую область дешевле перебрать по позициям, чем обойти всю таблицу
+    if (range.GetCellCount() < table_.size())
+    {
+        for (int row = range.first.row; row <= range.last.row; ++row)
+        {
+            for (int col = range.first.col; col <= range.last.col; ++col)
+            {
+                if (auto it = table_.find({ row, col }); it != table_.end())
+                    cells.push_back(it);
+            }
+        }
     }
     else
     {
-        return nullptr;
+        for (auto it = table_.begin(); it != table_.end(); ++it)
+        {
+            if (range.Contains(it->first))
+                cells.push_back(it);
+        }
     }
+    return cells;
+}
 
+std::vector<std::pair<Position, const Cell*>> Sheet::CollectCells(const Range& range) const
+{
+    std::vector<std::pair<Position, const Cell*>> cells;
+    // Как в FindCells: окно перебирается по позициям, только если оно меньше таблицы
+    if (range.GetCellCount() < table_.size())
+    {
+        for (int row = range.first.row; row <= range.last.row; ++row)
+        {
+            for (int col = range.first.col; col <= range.last.col; ++col)
+            {
+                if (const Cell* cell = FindCell({ row, col }); cell && !cell->Empty())
+                    cells.emplace_back(Position{ row, col }, cell);
+            }
+        }
+        return cells;
+    }
 
+    for (const auto& [pos, cell] : table_)
+    {
+        if (range.Contains(pos) && !cell->Empty())
+            cells.emplace_back(pos, cell.get());
+    }
+    auto by_position = [](const auto& lhs, const auto& rhs) { return lhs.first < rhs.first; };
+    std::sort(cells.begin(), cells.end(), by_position);
+    return cells;
 }
 
-void Sheet::ClearCell(Position pos)
+std::optional<CellInterface::Value> Sheet::GetValueWithin(Position pos,
+    std::chrono::steady_clock::time_point deadline, const CancellationToken* token) const
 {
-    if (IsCellAvailable(pos))
-        SetCell(pos, std::string());
+    if (!pos.IsValid())
+        throw InvalidPositionException("Sheet::GetValueWithin: Invalid position");
+
+    auto lock = Lock();
+    const Cell* cell = FindCell(pos);
+    if (!cell)
+        return CellInterface::Value(std::string());
+    return cell->GetValueWithin(deadline, token);
+}
+
+std::future<CellInterface::Value> Sheet::GetValueAsync(Position pos) const
+{
+    if (!pos.IsValid())
+        throw InvalidPositionException("Sheet::GetValueAsync: Invalid position");
+    if (workbook_)
+        throw std::logic_error("Sheet::GetValueAsync: Not supported for workbook sheets");
+
+    std::promise<CellInterface::Value> promise;
+    auto future = promise.get_future();
+    // Блокировка берётся всегда: первые чтения из разных потоков приходят до запуска
+    // потока чтения, когда Lock() ещё ничего не блокирует, и поток запускается один раз
+    std::unique_lock lock(mutex_);
+    // Срок уже истёк: значение отдаётся, только если вычислять ничего не нужно
+    const Cell* cell = FindCell(pos);
+    std::optional<CellInterface::Value> value = CellInterface::Value(std::string());
+    if (cell)
+        value = cell->GetValueWithin(std::chrono::steady_clock::time_point::min());
+    if (value)
+    {
+        promise.set_value(std::move(*value));
+        return future;
+    }
+
+    reads_.push_back({ pos, std::move(promise), {} });
+    if (reader_.joinable())
+        read_ready_.notify_one();
     else
-        table_.erase(pos);
-    positions_.erase(pos);
+        StartReader();
+    return future;
+}
+
+FormulaValue Sheet::GetFormulaOperand(Position pos) const
+{
+    const Cell* cell = FindCell(pos);
+    return cell ? cell->GetOperand() : FormulaValue(0.0);
+}
+
+Cell* Sheet::FindCell(Position pos)
+{
+    auto it = table_.find(pos);
+    return it != table_.end() ? it->second.get() : nullptr;
+}
+
+const Cell* Sheet::FindCell(Position pos) const
+{
+    auto it = table_.find(pos);
+    return it != table_.end() ? it->second.get() : nullptr;
+}
+
+Cell& Sheet::GetOrCreateCell(Position pos)
+{
+    auto& cell = table_[pos];
+    if (!cell)
+    {
+        cell = std::make_unique<Cell>(*this, pos);
+        counters_.Add(Counter::CELLS_MATERIALIZED);
+        counters_.Add(Counter::BYTES_ALLOCATED, sizeof(Cell));
+    }
+    return *cell;
+}
+
+const std::string& Sheet::GetName() const
+{
+    return name_;
+}
+
+Sheet* Sheet::FindSheet(const std::string& name) const
+{
+    return workbook_ ? workbook_->GetSheet(name) : nullptr;
+}
+
+std::vector<Sheet*> Sheet::GetReferencedSheets() const
+{
+    std::vector<Sheet*> sheets;
+    for (const auto& [pos, cell] : table_)
+    {
+        for (const auto& [sheet, positions] : cell->GetExternalIncludes())
+        {
+            if (sheet != this && std::find(sheets.begin(), sheets.end(), sheet) == sheets.end())
+                sheets.push_back(sheet);
+        }
+    }
+    return sheets;
+}
+
+size_t Sheet::CalculateAll() const
+{
+    auto lock = Lock();
+    // Ячейки отбираются заранее: вычисление одной ячейки заполняет кэш тех, на которые она ссылается
+    std::vector<const Cell*> cells;
+    for (const auto& [pos, cell] : table_)
+    {
+        if (!cell->Empty() && !cell->HasActualCache())
+            cells.push_back(cell.get());
+    }
+    for (const Cell* cell : cells)
+    {
+        if (!cell->HasActualCache())
+            cell->GetValue();
+    }
+    return cells.size();
+}
+
+size_t Sheet::GetStoredCellCount() const
+{
+    auto lock = Lock();
+    return table_.size();
+}
+
+void Sheet::ReleaseCell(Position pos)
+{
+    auto it = table_.find(pos);
+    if (it != table_.end() && it->second->Empty() && !it->second->IsReferenced())
+        table_.erase(it);
 }
 
 Size Sheet::GetPrintableSize() const
 {
+    auto lock = Lock();
+    if (printable_size_actual_)
+        return printable_size_;
+
     int max_r = 0;
     int max_c = 0;
 
@@ -69,57 +755,639 @@ Size Sheet::GetPrintableSize() const
         max_c = std::max(max_c, pos.col + 1);
     }
 
-    return { max_r, max_c };
+    printable_size_ = { max_r, max_c };
+    printable_size_actual_ = true;
+    return printable_size_;
+}
+
+void Sheet::AddPrintable(Position pos)
+{
+    positions_.insert(pos);
+    printable_size_.rows = std::max(printable_size_.rows, pos.row + 1);
+    printable_size_.cols = std::max(printable_size_.cols, pos.col + 1);
+}
+
+void Sheet::RemovePrintable(Position pos)
+{
+    // Область может уменьшиться, только если удалена ячейка с её границы.
+    // Пересчёт откладывается до следующего запроса размера
+    if (positions_.erase(pos) != 0
+        && (pos.row + 1 == printable_size_.rows || pos.col + 1 == printable_size_.cols))
+    {
+        printable_size_actual_ = false;
+    }
 }
 
 void Sheet::PrintValues(std::ostream& output) const
 {
-    auto caller = [&output](const auto& obj) { output << obj; };
+    auto lock = Lock();
     Size scope = GetPrintableSize();
 
     for (int i = 0; i < scope.rows; ++i)
     {
-        bool b = false;
-        for (int j = 0; j < scope.cols; ++j)
-        {
-            Position pos{ i, j };
-            auto cell = GetCell(pos);
-
-            if (b)
-                output << '\t';
-            if (cell)
-                std::visit(caller, cell->GetValue());
-            b = true;
-        }
+        PrintRow(output, i, 0, scope.cols - 1, true);
         output << std::endl;
     }
 }
 
 void Sheet::PrintTexts(std::ostream& output) const
 {
-    auto caller = [&output](const auto& obj) { output << obj; };
+    auto lock = Lock();
     Size scope = GetPrintableSize();
 
     for (int i = 0; i < scope.rows; ++i)
     {
-        bool b = false;
-        for (int j = 0; j < scope.cols; ++j)
+        PrintRow(output, i, 0, scope.cols - 1, false);
+        output << std::endl;
+    }
+}
+
+void Sheet::PrintValues(std::ostream& output, const Range& range) const
+{
+    PrintRange(output, range, true);
+}
+
+void Sheet::PrintTexts(std::ostream& output, const Range& range) const
+{
+    PrintRange(output, range, false);
+}
+
+void Sheet::PrintRange(std::ostream& output, const Range& range, bool values) const
+{
+    if (!range.IsValid())
+        throw InvalidPositionException("Sheet::PrintRange: Invalid range");
+
+    auto lock = Lock();
+    for (int i = range.first.row; i <= range.last.row; ++i)
+    {
+        PrintRow(output, i, range.first.col, range.last.col, values);
+        output << '\n';
+    }
+}
+
+void Sheet::PrintRow(std::ostream& output, int row, int first_col, int last_col, bool values) const
+{
+    auto caller = [&output](const auto& obj) { output << obj; };
+    for (int j = first_col; j <= last_col; ++j)
+    {
+        if (j > first_col)
+            output << '\t';
+        auto cell = FindCell({ row, j });
+        if (!cell)
+            continue;
+        if (values)
+            std::visit(caller, cell->GetValue());
+        else
+            cell->PrintText(output);
+    }
+}
+
+uint64_t Sheet::GetVersion() const
+{
+    auto lock = Lock();
+    version_taken_ = true;
+    return version_;
+}
+
+uint64_t Sheet::PrintValuesSince(std::ostream& output, uint64_t version) const
+{
+    return PrintRowsSince(output, version, true);
+}
+
+uint64_t Sheet::PrintTextsSince(std::ostream& output, uint64_t version) const
+{
+    return PrintRowsSince(output, version, false);
+}
+
+uint64_t Sheet::PrintRowsSince(std::ostream& output, uint64_t version, bool values) const
+{
+    auto lock = Lock();
+    Size scope = GetPrintableSize();
+    output << scope.rows << '\t' << scope.cols << '\n';
+    for (int row : GetRowsChangedSince(version))
+    {
+        output << row + 1;
+        if (row < scope.rows && scope.cols > 0)
+        {
+            output << '\t';
+            PrintRow(output, row, 0, scope.cols - 1, values);
+        }
+        output << '\n';
+    }
+    // Вычисление значений не меняет версию: сброшенные ячейки уже отмечены
+    return GetVersion();
+}
+
+std::vector<int> Sheet::GetRowsChangedSince(uint64_t version) const
+{
+    // Журнал упорядочен по версиям, и у каждой строки ровно одна живая запись
+    std::vector<int> rows;
+    for (auto it = row_journal_.rbegin(); it != row_journal_.rend() && it->first > version; ++it)
+    {
+        if (row_versions_[it->second] == it->first)
+            rows.push_back(it->second);
+    }
+    std::sort(rows.begin(), rows.end());
+    return rows;
+}
+
+void Sheet::MarkRowChanged(int row)
+{
+    if (version_taken_)
+    {
+        ++version_;
+        version_taken_ = false;
+    }
+    if (static_cast<size_t>(row) >= row_versions_.size())
+        row_versions_.resize(row + 1, 0);
+    uint64_t& row_version = row_versions_[row];
+    if (row_version == version_)
+        return;
+    if (row_version == 0)
+        ++changed_rows_;
+    row_version = version_;
+    row_journal_.emplace_back(version_, row);
+
+    // Записи строк, изменившихся позже, больше не нужны. Порядок журнала сохраняется
+    if (row_journal_.size() > 2 * changed_rows_ + 64)
+    {
+        auto superseded = [this](const auto& entry) { return row_versions_[entry.second] != entry.first; };
+        row_journal_.erase(std::remove_if(row_journal_.begin(), row_journal_.end(), superseded), row_journal_.end());
+    }
+}
+
+void Sheet::SetCalculationMode(CalculationMode mode)
+{
+    if (mode == mode_)
+        return;
+    assert(!workbook_ || mode == CalculationMode::LAZY);
+
+    StopWorker();
+    // Поток чтения может работать и без фонового потока
+    auto lock = Lock();
+    // Устаревшие значения ручного режима больше не должны быть видны
+    if (mode_ == CalculationMode::MANUAL)
+        ResetDirtyCone(std::move(dirty_));
+    dirty_.clear();
+    for (auto& queue : queues_)
+        queue.clear();
+    recalc_requested_ = false;
+
+    mode_ = mode;
+    if (mode_ != CalculationMode::LAZY)
+        StartWorker();
+    NotifyChanges();
+}
+
+CalculationMode Sheet::GetCalculationMode() const
+{
+    return mode_;
+}
+
+SheetStats Sheet::GetStats() const
+{
+    return counters_.Snapshot();
+}
+
+void Sheet::ResetStats()
+{
+    counters_.Reset();
+    auto lock = Lock();
+    peak_queue_depth_ = 0;
+}
+
+PerfCounters& Sheet::GetCounters() const
+{
+    return counters_;
+}
+
+void Sheet::EnableProfiling(bool enable)
+{
+    auto lock = Lock();
+    if (!enable)
+        profiler_.reset();
+    else if (!profiler_)
+        profiler_ = std::make_unique<EvaluationProfiler>();
+}
+
+EvaluationProfiler* Sheet::GetProfiler() const
+{
+    return profiler_.get();
+}
+
+void Sheet::Recalculate()
+{
+    auto lock = Lock();
+    if (!worker_.joinable())
+        return;
+    recalc_requested_ = true;
+    work_ready_.notify_one();
+}
+
+void Sheet::WaitForRecalculation() const
+{
+    if (!worker_.joinable())
+        return;
+    std::unique_lock lock(mutex_);
+    work_done_.wait(lock, [this] { return !worker_busy_ && !HasPendingWork(); });
+}
+
+size_t Sheet::Subscribe(ChangeListener listener)
+{
+    auto lock = Lock();
+    const size_t id = next_listener_++;
+    listeners_.emplace(id, std::make_shared<const ChangeListener>(std::move(listener)));
+    return id;
+}
+
+void Sheet::Unsubscribe(size_t id)
+{
+    auto lock = Lock();
+    listeners_.erase(id);
+}
+
+void Sheet::BeginBatch()
+{
+    auto lock = Lock();
+    ++batch_depth_;
+}
+
+void Sheet::EndBatch()
+{
+    auto lock = Lock();
+    assert(batch_depth_ > 0);
+    if (--batch_depth_ == 0)
+        NotifyChanges();
+}
+
+void Sheet::RecordChange(Position pos)
+{
+    if (IsObserved())
+        RecordChange(pos, PreviousValue(pos));
+}
+
+std::optional<CellInterface::Value> Sheet::PreviousValue(Position pos) const
+{
+    if (!IsObserved())
+        return std::nullopt;
+    // Прежнее значение формулы без кэша неизвестно: ради него не вычисляется вся цепочка
+    // зависимостей, а ячейка считается изменившейся
+    const Cell* cell = FindCell(pos);
+    if (!cell)
+        return CellInterface::Value(std::string());
+    if (!cell->IsFormula() || cell->HasActualCache() || cell->IsStale())
+        return cell->GetValue();
+    return std::nullopt;
+}
+
+void Sheet::RecordChange(Position pos, std::optional<CellInterface::Value> value)
+{
+    if (IsObserved())
+        pending_changes_.push_back({ pos, pending_changes_.size(), std::move(value) });
+}
+
+void Sheet::NotifyChanges()
+{
+    if (workbook_)
+        workbook_->DeliverChanges();
+    else
+        DeliverChanges();
+}
+
+void Sheet::DeliverChanges()
+{
+    auto lock = Lock();
+    if (batch_depth_ > 0 || delivering_)
+        return;
+    if (!IsObserved())
+    {
+        pending_changes_.clear();
+        stale_changes_.clear();
+        return;
+    }
+
+    // Исключение обработчика выходит из доставки, но не должно навсегда её заглушить:
+    // изменения, записанные до него и во время него, доставляются в следующий раз
+    struct DeliveryGuard
+    {
+        Sheet& sheet;
+        ~DeliveryGuard()
         {
-            Position pos{ i, j };
-            auto cell = GetCell(pos);
+            sheet.delivered_changes_.clear();
+            sheet.changed_.clear();
+            sheet.delivering_ = false;
+        }
+    } guard{ *this };
+    delivering_ = true;
+    auto by_position = [](const Change& lhs, const Change& rhs)
+    {
+        return lhs.pos < rhs.pos || (lhs.pos == rhs.pos && lhs.order < rhs.order);
+    };
+    auto same_position = [](const Change& lhs, const Change& rhs) { return lhs.pos == rhs.pos; };
+
+    // Обработчики могут снова менять таблицу: круги повторяются, пока есть новые изменения
+    while (!pending_changes_.empty())
+    {
+        std::swap(pending_changes_, delivered_changes_);
+        std::sort(delivered_changes_.begin(), delivered_changes_.end(), by_position);
+        delivered_changes_.erase(std::unique(delivered_changes_.begin(), delivered_changes_.end(), same_position),
+            delivered_changes_.end());
 
-            if (b)
-                output << '\t';
-            if (cell)
-                output << cell->GetText();
-            b = true;
+        changed_.clear();
+        for (Change& change : delivered_changes_)
+        {
+            const Cell* cell = FindCell(change.pos);
+            // Устаревшее значение ещё видно: сравнение откладывается до пересчёта
+            if (cell && cell->IsStale())
+                stale_changes_.push_back(std::move(change));
+            else if (!change.value || !(*change.value == (cell ? cell->GetValue() : CellInterface::Value(std::string()))))
+                changed_.push_back(change.pos);
         }
-        output << std::endl;
+        delivered_changes_.clear();
+
+        // Следующий обработчик ищется по номеру, поэтому подписка и отписка во время вызова безопасны
+        for (auto it = listeners_.begin(); !changed_.empty() && it != listeners_.end();)
+        {
+            const size_t id = it->first;
+            auto listener = it->second;
+            (*listener)(changed_);
+            it = listeners_.upper_bound(id);
+        }
+    }
+
+    // Отложенные изменения идут первыми: их прежние значения записаны раньше
+    std::swap(pending_changes_, stale_changes_);
+    for (size_t i = 0; i < pending_changes_.size(); ++i)
+        pending_changes_[i].order = i;
+}
+
+void Sheet::SetViewport(const Range& viewport)
+{
+    auto lock = Lock();
+    viewport_ = viewport;
+    if (!worker_busy_ || !viewport.IsValid())
+        return;
+
+    // Ячейки окна, ждущие в других очередях, добавляются в очередь окна. В другой
+    // очереди они останутся, но к тому времени будут посчитаны и пропущены
+    std::vector<Position> visible;
+    for (auto [pos, cell] : CollectCells(viewport))
+    {
+        if (!cell->HasActualCache())
+            visible.push_back(pos);
+    }
+    Schedule(RecalcPriority::VIEWPORT, visible);
+}
+
+void Sheet::PinCell(Position pos)
+{
+    if (!pos.IsValid())
+        throw InvalidPositionException("Sheet::PinCell: Invalid position");
+
+    auto lock = Lock();
+    pinned_.insert(pos);
+    if (const Cell* cell = FindCell(pos); worker_busy_ && cell && !cell->HasActualCache())
+        Schedule(RecalcPriority::PINNED, { pos });
+}
+
+void Sheet::UnpinCell(Position pos)
+{
+    auto lock = Lock();
+    pinned_.erase(pos);
+}
+
+RecalcQueueDepth Sheet::GetQueueDepth() const
+{
+    auto lock = Lock();
+    RecalcQueueDepth depth;
+    depth.viewport = queues_[static_cast<size_t>(RecalcPriority::VIEWPORT)].size();
+    depth.pinned = queues_[static_cast<size_t>(RecalcPriority::PINNED)].size();
+    depth.background = queues_[static_cast<size_t>(RecalcPriority::BACKGROUND)].size();
+    depth.unscheduled = dirty_.size();
+    depth.peak = peak_queue_depth_;
+    return depth;
+}
+
+std::unique_lock<std::recursive_mutex> Sheet::Lock() const
+{
+    // worker_ и reader_ не читаются: их присваивают и освобождают без блокировки, пока
+    // запущенный поток уже работает с таблицей
+    if (!concurrent_.load(std::memory_order_acquire))
+        return {};
+    return std::unique_lock(mutex_);
+}
+
+void Sheet::MarkDirty(Position pos)
+{
+    dirty_.push_back(pos);
+    if (mode_ == CalculationMode::EAGER)
+        work_ready_.notify_one();
+}
+
+void Sheet::StartWorker()
+{
+    stop_worker_ = false;
+    concurrent_.store(true, std::memory_order_release);
+    worker_ = std::thread([this] { RunWorker(); });
+}
+
+void Sheet::StopWorker()
+{
+    if (!worker_.joinable())
+        return;
+    {
+        std::lock_guard guard(mutex_);
+        stop_worker_ = true;
+    }
+    work_ready_.notify_all();
+    worker_.join();
+}
+
+void Sheet::RunWorker()
+{
+    // Сколько ячеек пересчитывается, прежде чем отпустить таблицу к читателям и писателям
+    constexpr size_t BATCH_SIZE = 256;
+
+    std::unique_lock lock(mutex_);
+    while (true)
+    {
+        work_ready_.wait(lock, [this] { return stop_worker_ || HasPendingWork(); });
+        if (stop_worker_)
+            break;
+
+        worker_busy_ = true;
+        Schedule(TakeDirtyBatch());
+        Position pos;
+        for (size_t i = 1; !stop_worker_ && TakeScheduled(pos); ++i)
+        {
+            // Ячейку могли удалить или уже посчитать при чтении, пока таблица была отпущена
+            if (const Cell* cell = FindCell(pos); cell && !cell->HasActualCache())
+                cell->GetValue();
+
+            if (i % BATCH_SIZE == 0)
+            {
+                lock.unlock();
+                std::this_thread::yield();
+                lock.lock();
+                // Записи, сделанные за это время, встают в очереди по своим приоритетам
+                if (HasPendingWork())
+                    Schedule(TakeDirtyBatch());
+            }
+        }
+        // Изменения доставляются до сигнала: дождавшийся пересчёта их уже получил
+        if (!stop_worker_)
+        {
+            // Исключению обработчика некуда выйти из фонового потока: оно отбрасывается
+            try
+            {
+                DeliverChanges();
+            }
+            catch (...)
+            {
+            }
+        }
+        worker_busy_ = false;
+        work_done_.notify_all();
+    }
+}
+
+void Sheet::StartReader() const
+{
+    concurrent_.store(true, std::memory_order_release);
+    reader_ = std::thread([this] { RunReader(); });
+}
+
+void Sheet::StopReader()
+{
+    if (!reader_.joinable())
+        return;
+    {
+        std::lock_guard guard(mutex_);
+        stop_reader_ = true;
+    }
+    read_ready_.notify_all();
+    reader_.join();
+}
+
+void Sheet::RunReader() const
+{
+    // Сколько поток чтения считает одно чтение, прежде чем перейти к следующему
+    constexpr auto READ_SLICE = std::chrono::microseconds(250);
+
+    std::unique_lock lock(mutex_);
+    while (true)
+    {
+        read_ready_.wait(lock, [this] { return stop_reader_ || !reads_.empty(); });
+        if (stop_reader_)
+            break;
+
+        AsyncRead read = std::move(reads_.front());
+        reads_.pop_front();
+        try
+        {
+            // Ячейку могли удалить, пока чтение стояло в очереди
+            std::optional<CellInterface::Value> value = CellInterface::Value(std::string());
+            if (const Cell* cell = FindCell(read.pos))
+                value = cell->GetValueWithin(std::chrono::steady_clock::now() + READ_SLICE, nullptr, &read.progress);
+            if (value)
+                read.promise.set_value(std::move(*value));
+            else
+                reads_.push_back(std::move(read));
+        }
+        catch (...)
+        {
+            read.promise.set_exception(std::current_exception());
+        }
+
+        // Между квантами таблица отпускается к писателям и другим читателям
+        lock.unlock();
+        std::this_thread::yield();
+        lock.lock();
+    }
+}
+
+bool Sheet::HasPendingWork() const
+{
+    return recalc_requested_ || (mode_ == CalculationMode::EAGER && !dirty_.empty());
+}
+
+std::vector<Position> Sheet::TakeDirtyBatch()
+{
+    recalc_requested_ = false;
+    if (mode_ == CalculationMode::MANUAL)
+        return ResetDirtyCone(std::move(dirty_));
+    return std::exchange(dirty_, {});
+}
+
+void Sheet::Schedule(const std::vector<Position>& cells)
+{
+    auto& viewport = queues_[static_cast<size_t>(RecalcPriority::VIEWPORT)];
+    auto& pinned = queues_[static_cast<size_t>(RecalcPriority::PINNED)];
+    auto& background = queues_[static_cast<size_t>(RecalcPriority::BACKGROUND)];
+    for (Position pos : cells)
+    {
+        if (viewport_.Contains(pos))
+            viewport.push_back(pos);
+        else if (pinned_.count(pos))
+            pinned.push_back(pos);
+        else
+            background.push_back(pos);
+    }
+    peak_queue_depth_ = std::max(peak_queue_depth_, viewport.size() + pinned.size() + background.size());
+}
+
+void Sheet::Schedule(RecalcPriority priority, const std::vector<Position>& cells)
+{
+    auto& queue = queues_[static_cast<size_t>(priority)];
+    queue.insert(queue.end(), cells.begin(), cells.end());
+    size_t depth = 0;
+    for (const auto& other : queues_)
+        depth += other.size();
+    peak_queue_depth_ = std::max(peak_queue_depth_, depth);
+}
+
+bool Sheet::TakeScheduled(Position& pos)
+{
+    for (auto& queue : queues_)
+    {
+        if (!queue.empty())
+        {
+            pos = queue.back();
+            queue.pop_back();
+            return true;
+        }
+    }
+    return false;
+}
+
+std::vector<Position> Sheet::ResetDirtyCone(std::vector<Position> roots)
+{
+    // Устаревшие ячейки и всё, что от них зависит, включая ячейки,
+    // посчитанные по устаревшим значениям уже после пометки
+    PositionSet visited;
+    std::vector<Position> cone;
+    while (!roots.empty())
+    {
+        Position pos = roots.back();
+        roots.pop_back();
+        if (!visited.insert(pos))
+            continue;
+
+        Cell* cell = FindCell(pos);
+        if (!cell)
+            continue;
+        cell->ClearCache();
+        MarkRowChanged(pos.row);
+        cone.push_back(pos);
+        roots.insert(roots.end(), cell->GetDependents().begin(), cell->GetDependents().end());
     }
+    dirty_.clear();
+    return cone;
 }
 
 
 std::unique_ptr<SheetInterface> CreateSheet()
 {
+    WarmUpFormulaParser();
     return std::make_unique<Sheet>();
 }
@@ -2,20 +2,70 @@
 
 #include "common.h"
 #include "cell.h"
+#include "profiler.h"
+#include "stats.h"
 
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
 #include <functional>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 
 
+// Когда пересчитываются формулы после изменения ячеек
+enum class CalculationMode
+{
+    LAZY,    // при чтении значения (по умолчанию)
+    EAGER,   // фоновым потоком сразу после записи; чтение непосчитанной ячейки ждёт её вычисления
+    MANUAL,  // фоновым потоком по вызову Recalculate(); до этого чтение видит последнее вычисленное значение
+};
+
+
+// Очереди фонового пересчёта в порядке обработки
+enum class RecalcPriority
+{
+    VIEWPORT,    // ячейки окна просмотра
+    PINNED,      // закреплённые ячейки, которые нужны клиенту
+    BACKGROUND,  // всё остальное
+};
+
+
+// Глубина очередей фонового пересчёта
+struct RecalcQueueDepth
+{
+    size_t viewport = 0;
+    size_t pinned = 0;
+    size_t background = 0;
+    size_t unscheduled = 0;  // Ячейки, ещё не разложенные по очередям (ждут Recalculate в режиме MANUAL)
+    size_t peak = 0;         // Наибольшая суммарная глубина очередей с последнего ResetStats
+};
+
+
+class Workbook;
+
+
 class Sheet : public SheetInterface
 {
     using Table = std::unordered_map<Position, std::unique_ptr<Cell>, HashPosition>;
 public:
     Sheet() = default;
+    // Лист книги workbook. Формулы листа могут ссылаться на ячейки других листов книги
+    Sheet(Workbook& workbook, std::string name);
     virtual ~Sheet() override;
 
     void SetCell(Position pos, std::string text) override;
 
+    // Не создаёт ячеек: для пустой позиции внутри печатной области
+    // возвращает общую неизменяемую пустую ячейку
     const CellInterface* GetCell(Position pos) const override;
     CellInterface* GetCell(Position pos) override;
 
@@ -27,13 +77,312 @@ public:
 
     void PrintTexts(std::ostream& output) const override;
 
-    bool Sheet::IsCellAvailable(Position pos) const
+    // Печатает только область range в формате PrintValues и PrintTexts. Вычисляются
+    // формулы области и ячейки, от которых они зависят, пустые ячейки не создаются:
+    // прокрутка большой таблицы стоит размера окна, а не таблицы
+    void PrintValues(std::ostream& output, const Range& range) const;
+    void PrintTexts(std::ostream& output, const Range& range) const;
+
+    // Обходит непустые ячейки области по строкам, вызывая visitor(Position, const Cell&).
+    // Чтение значения в visitor вычисляет только конус зависимостей ячейки
+    template <typename Visitor>
+    void VisitRange(const Range& range, Visitor&& visitor) const
+    {
+        if (!range.IsValid())
+            throw InvalidPositionException("Sheet::VisitRange: Invalid range");
+
+        auto lock = Lock();
+        for (auto [pos, cell] : CollectCells(range))
+            visitor(pos, *cell);
+    }
+
+    bool IsCellAvailable(Position pos) const
     {
         Size size_area = GetPrintableSize();
         return pos.IsValid() ? pos.row < size_area.rows && pos.col < size_area.cols : false;
     }
 
+    // Вставка и удаление строк и столбцов. Ячейки переезжают вместе с рёбрами,
+    // ссылки формул переписываются без повторного разбора, ссылки на удалённые
+    // ячейки становятся #REF!. Вставка бросает TableTooBigException, если
+    // непустые ячейки окажутся за пределами таблицы
+    void InsertRows(int before, int count = 1);
+    void InsertCols(int before, int count = 1);
+    void DeleteRows(int first, int count = 1);
+    void DeleteCols(int first, int count = 1);
+
+    // Операции над прямоугольными областями. Формула разбирается один раз и
+    // копируется в ячейки со сдвигом относительных ссылок, рёбра обновляются
+    // одним проходом, проверка циклов и сброс кэша зависимых ячеек выполняются
+    // один раз на всю операцию. Если запись замкнула бы цикл, бросается
+    // CircularDependencyException и таблица не меняется
+
+    // Записывает text в левую верхнюю ячейку области, а в остальные — его
+    // копии со ссылками, сдвинутыми на смещение ячейки от левого верхнего угла
+    void FillRange(const Range& range, std::string text);
+    // Копирует область from в область того же размера с левым верхним углом to,
+    // сдвигая ссылки формул на смещение области. Пустые ячейки источника
+    // очищают ячейки назначения
+    void CopyRange(const Range& from, Position to);
+    // Переносит область from в область того же размера с левым верхним углом to.
+    // Формулы сохраняют ссылки, ссылки на перенесённые ячейки следуют за ними,
+    // ссылки на замещённые ячейки становятся #REF!
+    void MoveRange(const Range& from, Position to);
+    void ClearRange(const Range& range);
+
+    // Версия таблицы растёт с изменениями текстов и значений ячеек. Изменения
+    // отмечаются по строкам при записи, сбросе кэша и пересчёте, поэтому выборка
+    // изменившихся строк стоит пропорционально их числу, а не размеру таблицы
+    uint64_t GetVersion() const;
+
+    // Дельта-экспорт: печатает строки, изменившиеся после версии version, и возвращает
+    // текущую версию для следующего вызова. Первая строка вывода — печатная область
+    // "<строк>\t<столбцов>", за ней изменившиеся строки по возрастанию: номер строки
+    // с единицы и ячейки через табуляцию, как в PrintValues и PrintTexts. Строка за
+    // пределами печатной области выводится одним номером. Версия 0 даёт все строки,
+    // которые когда-либо менялись
+    uint64_t PrintValuesSince(std::ostream& output, uint64_t version) const;
+    uint64_t PrintTextsSince(std::ostream& output, uint64_t version) const;
+
+    // Отмечает изменение строки в текущей версии. Вызывается под блокировкой таблицы
+    void MarkRowChanged(int row);
+
+    // Значение ячейки, если его удалось вычислить до deadline и без отмены token;
+    // std::nullopt — значение ещё не готово. Посчитанная часть конуса зависимостей
+    // остаётся в кэше, и следующий вызов продолжает с того же места
+    std::optional<CellInterface::Value> GetValueWithin(Position pos, std::chrono::steady_clock::time_point deadline,
+        const CancellationToken* token = nullptr) const;
+
+    // Асинхронное чтение значения ячейки. Посчитанное значение сразу возвращается
+    // готовым future, и вызывающий поток не ждёт вычислений. Непосчитанную ячейку
+    // вычисляет поток чтения таблицы: он берёт чтения по очереди, считает каждое не
+    // дольше кванта и ставит недосчитанное в конец очереди. Чтения с небольшим конусом
+    // зависимостей не ждут чтений с большим, а остальные вызовы ждут таблицу не дольше
+    // кванта. Поток запускается первым таким чтением. Ячейки вычисляются под
+    // блокировкой таблицы, поэтому конусы разных чтений считаются поочерёдно, а не
+    // параллельно. Недосчитанные к уничтожению таблицы чтения получают broken_promise.
+    // Только для отдельной таблицы: поток чтения не может читать другие листы книги,
+    // для листа книги бросает std::logic_error. Отложенные чтения следуют за ячейками
+    // при вставке, удалении и переносе; чтение удалённой ячейки возвращает пустое значение
+    std::future<CellInterface::Value> GetValueAsync(Position pos) const;
+
+    // Значение ячейки как операнд формулы. То же, что чтение через GetCell,
+    // но без виртуальных вызовов и проверки печатной области
+    FormulaValue GetFormulaOperand(Position pos) const;
+
+    // Возвращает хранимую ячейку или nullptr, ничего не создавая
+    Cell* FindCell(Position pos);
+    const Cell* FindCell(Position pos) const;
+
+    // Возвращает хранимую ячейку, создавая пустую, если её нет.
+    // Используется только для записи и для рёбер зависимостей
+    Cell& GetOrCreateCell(Position pos);
+
+    // Удаляет пустую ячейку, на которую никто не ссылается
+    void ReleaseCell(Position pos);
+
+    // Количество ячеек, которые реально хранятся в таблице
+    size_t GetStoredCellCount() const;
+
+    // Имя листа в книге; пусто для отдельной таблицы
+    const std::string& GetName() const;
+
+    // Лист той же книги с именем name, в том числе этот лист, или nullptr
+    Sheet* FindSheet(const std::string& name) const;
+
+    // Другие листы, на ячейки которых ссылаются формулы этого листа
+    std::vector<Sheet*> GetReferencedSheets() const;
+
+    // Вычисляет все непустые ячейки без актуального значения и возвращает их число
+    size_t CalculateAll() const;
+
+    // Переключает режим пересчёта. Не должен вызываться одновременно с другими методами.
+    // Листы книги работают только в режиме LAZY: фоновый поток одного листа
+    // не может безопасно читать ячейки других листов
+    void SetCalculationMode(CalculationMode mode);
+    CalculationMode GetCalculationMode() const;
+
+    // Запускает фоновый пересчёт устаревших ячеек (в режиме MANUAL)
+    void Recalculate();
+
+    // Блокирует вызывающий поток, пока фоновый поток не обработает всю очередь
+    void WaitForRecalculation() const;
+
+    // Приоритеты фонового пересчёта: сначала ячейки окна просмотра, затем закреплённые
+    // ячейки, затем остальные. Очередь разбирается порциями; между порциями новые
+    // записи раскладываются по очередям, а ячейки нового окна или только что
+    // закреплённые обгоняют уже стоящие в очереди. Окно задаётся в координатах
+    // таблицы и не сдвигается вставкой строк, закреплённые ячейки сдвигаются
+    void SetViewport(const Range& viewport);
+    void PinCell(Position pos);
+    void UnpinCell(Position pos);
+    RecalcQueueDepth GetQueueDepth() const;
+
+    // Подписка на изменения видимых значений. После каждой записи (SetCell,
+    // ClearCell, операции над областями, вставка и удаление строк и столбцов) или
+    // в конце пакета подписчик получает позиции, видимое значение которых
+    // изменилось. Кандидаты собираются при записи и сбросе кэша вместе с прежним
+    // значением, при доставке их новые значения вычисляются и сравниваются с
+    // прежними. Ячейки, значение которых ещё не вычислялось, не сообщаются, пока
+    // не изменятся снова после вычисления. В режиме MANUAL изменения зависимых
+    // ячеек доставляются из фонового потока после пересчёта. Обработчик вызывается
+    // под блокировкой таблицы и может читать её, подписываться и отписываться;
+    // изменения, сделанные из обработчика, доставляются следующим кругом.
+    // Исключение обработчика выходит из вызова, изменившего таблицу; остальные
+    // обработчики этот список уже не получают. Исключения обработчиков, вызванных
+    // из фонового потока, отбрасываются
+    using ChangeListener = std::function<void(const std::vector<Position>& changed)>;
+    size_t Subscribe(ChangeListener listener);
+    void Unsubscribe(size_t id);
+
+    // Пакет записей: изменения копятся и доставляются одним списком в конце
+    // внешнего пакета. Пакеты могут вкладываться
+    void BeginBatch();
+    void EndBatch();
+
+    // Запоминает видимое значение ячейки перед его возможным изменением; nullopt —
+    // значение неизвестно, и ячейка будет сообщена как изменившаяся.
+    // Ничего не делает, если на таблицу никто не подписан
+    bool IsObserved() const
+    {
+        return !listeners_.empty();
+    }
+    void RecordChange(Position pos);
+    void RecordChange(Position pos, std::optional<CellInterface::Value> value);
+    // Значение для RecordChange, известное без вычислений; nullopt, если никто не подписан
+    std::optional<CellInterface::Value> PreviousValue(Position pos) const;
+
+    // Доставляет накопленные изменения подписчикам, если не идёт пакет
+    void DeliverChanges();
+
+    // Снимок счётчиков производительности и их обнуление
+    SheetStats GetStats() const;
+    void ResetStats();
+    PerfCounters& GetCounters() const;
+
+    // Профилирование вычислений ячеек (по умолчанию выключено).
+    // GetProfiler возвращает nullptr, пока профилирование не включено
+    void EnableProfiling(bool enable);
+    EvaluationProfiler* GetProfiler() const;
+
+    // Захватывает таблицу, если фоновый поток хоть раз запускался или работает поток чтения;
+    // иначе возвращает пустую блокировку
+    std::unique_lock<std::recursive_mutex> Lock() const;
+
+    // Ставит ячейку в очередь фонового пересчёта. Вызывается под блокировкой таблицы
+    void MarkDirty(Position pos);
+
+private:
+    void StartWorker();
+    void StopWorker();
+    void RunWorker();
+    void StartReader() const;
+    void StopReader();
+    void RunReader() const;
+    bool HasPendingWork() const;
+    std::vector<Position> TakeDirtyBatch();
+    std::vector<Position> ResetDirtyCone(std::vector<Position> roots);
+    // Раскладывает ячейки по очередям приоритетов и достаёт следующую по приоритету
+    void Schedule(const std::vector<Position>& cells);
+    void Schedule(RecalcPriority priority, const std::vector<Position>& cells);
+    bool TakeScheduled(Position& pos);
+
+    void InsertLines(PositionShift::Axis axis, int before, int count);
+    void DeleteLines(PositionShift::Axis axis, int first, int count);
+    void ShiftCells(const PositionShift& shift);
+    // Итераторы хранимых ячеек области
+    std::vector<Table::iterator> FindCells(const Range& range);
+    // Непустые ячейки области по строкам
+    std::vector<std::pair<Position, const Cell*>> CollectCells(const Range& range) const;
+
+    // Записывает содержимое ячеек области, перечисленное по строкам
+    void WriteRange(const Range& range, std::vector<Cell::Content> contents);
+    bool HasCycle(const Range& range, const std::vector<Cell::Content>& contents) const;
+    // Записывает содержимое хранимой ячейки, сбрасывает кэш зависимых от неё
+    // и освобождает ячейку, если она стала ненужной
+    void WriteCell(Position pos, Cell& cell, Cell::Content content);
+
+    // Доставляет изменения этой таблицы, а для листа книги — всех листов книги
+    void NotifyChanges();
+
+    // Строки, изменившиеся после версии version, по возрастанию
+    std::vector<int> GetRowsChangedSince(uint64_t version) const;
+    uint64_t PrintRowsSince(std::ostream& output, uint64_t version, bool values) const;
+    // Печатает ячейки строки row из столбцов [first_col, last_col] через табуляцию
+    void PrintRow(std::ostream& output, int row, int first_col, int last_col, bool values) const;
+    void PrintRange(std::ostream& output, const Range& range, bool values) const;
+
+    // Поддерживают positions_ и кэш печатной области
+    void AddPrintable(Position pos);
+    void RemovePrintable(Position pos);
+
 private:
+    Workbook*   workbook_ = nullptr;
+    std::string name_;
+
     Table table_;
     Positions positions_;
-};
\ No newline at end of file
+    mutable Size printable_size_;                       // Печатная область, пока не сброшена удалением ячейки с её границы
+    mutable bool printable_size_actual_ = true;
+
+    CalculationMode mode_ = CalculationMode::LAZY;
+    mutable PerfCounters counters_;
+    std::unique_ptr<EvaluationProfiler> profiler_;
+
+    // Позиция, её прежнее видимое значение и номер записи: из повторов остаётся первая
+    struct Change
+    {
+        Position                            pos;
+        size_t                              order;
+        std::optional<CellInterface::Value> value;  // nullopt — прежнее значение неизвестно
+    };
+
+    // Обработчик может отписаться во время вызова, поэтому хранится в shared_ptr
+    std::map<size_t, std::shared_ptr<const ChangeListener>> listeners_;
+    size_t              next_listener_ = 0;
+    std::vector<Change> pending_changes_;
+    std::vector<Change> delivered_changes_;   // Буферы переиспользуются между доставками
+    std::vector<Change> stale_changes_;
+    std::vector<Position> changed_;
+    int                 batch_depth_ = 0;
+    bool                delivering_ = false;
+
+    // Журнал версий: последняя версия изменения каждой строки и записи (версия, строка)
+    // в порядке изменений. Записи, перекрытые более поздними, вычищаются, когда их
+    // становится больше, чем живых
+    uint64_t                              version_ = 0;
+    mutable bool                          version_taken_ = true;   // Следующее изменение открывает новую версию
+    std::vector<uint64_t>                 row_versions_;
+    std::vector<std::pair<uint64_t, int>> row_journal_;
+    size_t                                changed_rows_ = 0;
+
+    mutable std::recursive_mutex        mutex_;         // Защищает таблицу, пока работает фоновый поток
+    std::condition_variable_any         work_ready_;    // Появилась работа или поток пора остановить
+    mutable std::condition_variable_any work_done_;     // Фоновый поток опустошил очередь
+    std::thread                         worker_;
+    // Фоновый поток или поток чтения хоть раз запускались: с тех пор таблица блокируется всегда
+    mutable std::atomic<bool>           concurrent_{ false };
+    std::vector<Position>               dirty_;         // Ячейки на пересчёт, ещё не разложенные по очередям
+    std::array<std::vector<Position>, 3> queues_;       // Очереди по RecalcPriority
+    size_t                              peak_queue_depth_ = 0;
+    Range                               viewport_;
+    PositionSet                         pinned_;
+    bool                                recalc_requested_ = false;
+    bool                                worker_busy_ = false;
+    bool                                stop_worker_ = false;
+
+    // Асинхронное чтение, ещё не готовое: позиция, обещанное значение и место, где
+    // остановилось вычисление
+    struct AsyncRead
+    {
+        Position                           pos;
+        std::promise<CellInterface::Value> promise;
+        std::vector<Position>              progress;
+    };
+
+    // Поток чтения запускается константным GetValueAsync
+    mutable std::thread                 reader_;
+    mutable std::condition_variable_any read_ready_;
+    mutable std::deque<AsyncRead>       reads_;
+    bool                                stop_reader_ = false;
+};
@@ -0,0 +1,37 @@
+#include "stats.h"
+
+
+SheetStats PerfCounters::Snapshot() const
+{
+    SheetStats stats;
+#ifdef SPREADSHEET_STATS
+    std::array<uint64_t, static_cast<size_t>(Counter::COUNT)> totals{};
+    for (const Shard& shard : shards_)
+    {
+        for (size_t i = 0; i < totals.size(); ++i)
+            totals[i] += shard.values[i].load(std::memory_order_relaxed);
+    }
+
+    auto total = [&totals](Counter counter) { return totals[static_cast<size_t>(counter)]; };
+    stats.formula_parses = total(Counter::FORMULA_PARSES);
+    stats.ast_evaluations = total(Counter::AST_EVALUATIONS);
+    stats.cache_hits = total(Counter::CACHE_HITS);
+    stats.cache_misses = total(Counter::CACHE_MISSES);
+    stats.invalidations = total(Counter::INVALIDATIONS);
+    stats.cycle_check_visits = total(Counter::CYCLE_CHECK_VISITS);
+    stats.cells_materialized = total(Counter::CELLS_MATERIALIZED);
+    stats.bytes_allocated = total(Counter::BYTES_ALLOCATED);
+#endif
+    return stats;
+}
+
+void PerfCounters::Reset()
+{
+#ifdef SPREADSHEET_STATS
+    for (Shard& shard : shards_)
+    {
+        for (auto& value : shard.values)
+            value.store(0, std::memory_order_relaxed);
+    }
+#endif
+}
@@ -0,0 +1,84 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+// Счётчики производительности таблицы. Собираются, только если определён
+// SPREADSHEET_STATS; иначе все вызовы Add компилируются в пустоту.
+enum class Counter
+{
+    FORMULA_PARSES = 0,  // разобранные формулы
+    AST_EVALUATIONS,     // вычисления AST формул
+    CACHE_HITS,          // Cell::GetValue вернул значение из кэша
+    CACHE_MISSES,        // Cell::GetValue вычислил значение
+    INVALIDATIONS,       // сброшенные кэши зависимых ячеек
+    CYCLE_CHECK_VISITS,  // ячейки, просмотренные при проверке циклов
+    CELLS_MATERIALIZED,  // ячейки, созданные в хранилище таблицы
+    BYTES_ALLOCATED,     // оценка памяти, выделенной под ячейки и их содержимое
+    COUNT
+};
+
+
+// Снимок счётчиков на момент вызова Sheet::GetStats()
+struct SheetStats
+{
+    uint64_t formula_parses = 0;
+    uint64_t ast_evaluations = 0;
+    uint64_t cache_hits = 0;
+    uint64_t cache_misses = 0;
+    uint64_t invalidations = 0;
+    uint64_t cycle_check_visits = 0;
+    uint64_t cells_materialized = 0;
+    uint64_t bytes_allocated = 0;
+};
+
+
+class PerfCounters
+{
+public:
+#ifdef SPREADSHEET_STATS
+    static constexpr bool ENABLED = true;
+#else
+    static constexpr bool ENABLED = false;
+#endif
+
+    void Add(Counter counter, uint64_t value = 1);
+
+    // Суммирует счётчики всех потоков
+    SheetStats Snapshot() const;
+    void Reset();
+
+private:
+#ifdef SPREADSHEET_STATS
+    static constexpr size_t SHARD_COUNT = 16;
+
+    // Каждый поток пишет в свою строку кэша, чтобы не делить её с другими
+    struct alignas(64) Shard
+    {
+        std::array<std::atomic<uint64_t>, static_cast<size_t>(Counter::COUNT)> values{};
+    };
+
+    static size_t ThreadShard();
+
+    std::array<Shard, SHARD_COUNT> shards_;
+#endif
+};
+
+
+#ifdef SPREADSHEET_STATS
+inline size_t PerfCounters::ThreadShard()
+{
+    static std::atomic<size_t> next_shard{0};
+    thread_local const size_t shard = next_shard.fetch_add(1, std::memory_order_relaxed) % SHARD_COUNT;
+    return shard;
+}
+#endif
+
+inline void PerfCounters::Add(Counter counter, uint64_t value)
+{
+#ifdef SPREADSHEET_STATS
+    shards_[ThreadShard()].values[static_cast<size_t>(counter)].fetch_add(value, std::memory_order_relaxed);
+#endif
+}
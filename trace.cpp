@@ -0,0 +1,586 @@
+#include "trace.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <istream>
+#include <ostream>
+#include <streambuf>
+#include <utility>
+
+namespace
+{
+    constexpr char    TRACE_MAGIC[] = { 'S', 'S', 'T', 'R' };
+    constexpr uint8_t TRACE_VERSION = 2;         // Версия 1 — без формата чисел у PRINT_*
+    constexpr uint8_t FAILED_FLAG = 0x80;
+    constexpr uint64_t MAX_TEXT_SIZE = uint64_t(1) << 31;
+
+    enum ValueTag : uint8_t
+    {
+        STRING_VALUE = 0,
+        NUMBER_VALUE,
+        ERROR_VALUE,
+        NO_CELL,
+    };
+
+    bool HasPosition(TraceOp op)
+    {
+        return op == TraceOp::SET_CELL || op == TraceOp::CLEAR_CELL || op == TraceOp::GET_VALUE;
+    }
+
+    uint64_t ZigZag(int64_t value)
+    {
+        return (static_cast<uint64_t>(value) << 1) ^ static_cast<uint64_t>(value >> 63);
+    }
+
+    int64_t UnZigZag(uint64_t value)
+    {
+        return static_cast<int64_t>(value >> 1) ^ -static_cast<int64_t>(value & 1);
+    }
+
+    // Значения флагов потока зависят от реализации стандартной библиотеки,
+    // поэтому нотация хранится своим номером
+    uint8_t EncodeFloatfield(std::ios_base::fmtflags floatfield)
+    {
+        switch (floatfield & std::ios_base::floatfield)
+        {
+        case std::ios_base::fixed:
+            return 1;
+        case std::ios_base::scientific:
+            return 2;
+        case std::ios_base::fixed | std::ios_base::scientific:
+            return 3;
+        default:
+            return 0;
+        }
+    }
+
+    std::ios_base::fmtflags DecodeFloatfield(uint8_t code)
+    {
+        switch (code)
+        {
+        case 0:
+            return {};
+        case 1:
+            return std::ios_base::fixed;
+        case 2:
+            return std::ios_base::scientific;
+        case 3:
+            return std::ios_base::fixed | std::ios_base::scientific;
+        default:
+            throw TraceFormatException("TraceReader: unknown number format");
+        }
+    }
+
+    // Считает длину и хэш проходящего текста и, если задан, передаёт его в target
+    class HashingBuffer : public std::streambuf
+    {
+    public:
+        explicit HashingBuffer(std::streambuf* target, bool hash = true)
+            : target_(target)
+            , hash_enabled_(hash)
+        {
+        }
+
+        uint64_t Size() const
+        {
+            return size_;
+        }
+
+        uint64_t Hash() const
+        {
+            return hash_;
+        }
+
+        void Reset()
+        {
+            size_ = 0;
+            hash_ = HashTraceOutput({});
+        }
+
+    protected:
+        int overflow(int c) override
+        {
+            if (c == traits_type::eof())
+                return traits_type::not_eof(c);
+            const char ch = traits_type::to_char_type(c);
+            Add(&ch, 1);
+            return target_ ? target_->sputc(ch) : c;
+        }
+
+        std::streamsize xsputn(const char* data, std::streamsize count) override
+        {
+            Add(data, count);
+            return target_ ? target_->sputn(data, count) : count;
+        }
+
+        int sync() override
+        {
+            return target_ ? target_->pubsync() : 0;
+        }
+
+    private:
+        void Add(const char* data, std::streamsize count)
+        {
+            size_ += static_cast<uint64_t>(count);
+            if (hash_enabled_)
+                hash_ = HashTraceOutput({ data, static_cast<size_t>(count) }, hash_);
+        }
+
+        std::streambuf* target_;
+        bool            hash_enabled_;
+        uint64_t        size_ = 0;
+        uint64_t        hash_ = HashTraceOutput({});
+    };
+}
+
+std::string_view ToString(TraceOp op)
+{
+    switch (op)
+    {
+    case TraceOp::SET_CELL:
+        return "set-cell";
+    case TraceOp::CLEAR_CELL:
+        return "clear-cell";
+    case TraceOp::GET_VALUE:
+        return "get-value";
+    case TraceOp::PRINT_VALUES:
+        return "print-values";
+    case TraceOp::PRINT_TEXTS:
+        return "print-texts";
+    }
+    return {};
+}
+
+uint64_t HashTraceOutput(std::string_view text, uint64_t hash)
+{
+    for (char ch : text)
+    {
+        hash ^= static_cast<unsigned char>(ch);
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+TraceWriter::TraceWriter(std::ostream& output)
+    : output_(output)
+{
+    output_.write(TRACE_MAGIC, sizeof(TRACE_MAGIC));
+    output_.put(static_cast<char>(TRACE_VERSION));
+}
+
+void TraceWriter::Write(const TraceRecord& record)
+{
+    buffer_.clear();
+    buffer_.push_back(static_cast<char>(static_cast<uint8_t>(record.op) | (record.failed ? FAILED_FLAG : 0)));
+    if (HasPosition(record.op))
+    {
+        WriteVarint(ZigZag(int64_t(record.pos.row) - last_pos_.row));
+        WriteVarint(ZigZag(int64_t(record.pos.col) - last_pos_.col));
+        last_pos_ = record.pos;
+    }
+    WriteVarint(static_cast<uint64_t>(std::max<int64_t>(record.duration.count(), 0)));
+
+    // Текст пишется и для бросившей записи: при повторе она должна бросить так же
+    if (record.op == TraceOp::SET_CELL)
+    {
+        WriteVarint(record.text.size());
+        buffer_ += record.text;
+    }
+    else if (!record.failed)
+    {
+        switch (record.op)
+        {
+        case TraceOp::SET_CELL:
+        case TraceOp::CLEAR_CELL:
+            break;
+        case TraceOp::GET_VALUE:
+            if (!record.value)
+            {
+                buffer_.push_back(static_cast<char>(NO_CELL));
+            }
+            else if (const auto* text = std::get_if<std::string>(&*record.value))
+            {
+                buffer_.push_back(static_cast<char>(STRING_VALUE));
+                WriteVarint(text->size());
+                buffer_ += *text;
+            }
+            else if (const auto* number = std::get_if<double>(&*record.value))
+            {
+                uint64_t bits;
+                std::memcpy(&bits, number, sizeof(bits));
+                buffer_.push_back(static_cast<char>(NUMBER_VALUE));
+                WriteFixed(bits);
+            }
+            else
+            {
+                buffer_.push_back(static_cast<char>(ERROR_VALUE));
+                buffer_.push_back(static_cast<char>(std::get<FormulaError>(*record.value).GetCategory()));
+            }
+            break;
+        case TraceOp::PRINT_VALUES:
+        case TraceOp::PRINT_TEXTS:
+            buffer_.push_back(static_cast<char>(EncodeFloatfield(record.output_floatfield)));
+            WriteVarint(static_cast<uint64_t>(std::max<std::streamsize>(record.output_precision, 0)));
+            WriteVarint(record.output_size);
+            WriteFixed(record.output_hash);
+            break;
+        }
+    }
+    output_.write(buffer_.data(), static_cast<std::streamsize>(buffer_.size()));
+}
+
+void TraceWriter::WriteVarint(uint64_t value)
+{
+    while (value >= 0x80)
+    {
+        buffer_.push_back(static_cast<char>(value | 0x80));
+        value >>= 7;
+    }
+    buffer_.push_back(static_cast<char>(value));
+}
+
+void TraceWriter::WriteFixed(uint64_t value)
+{
+    for (int i = 0; i < 8; ++i)
+        buffer_.push_back(static_cast<char>(value >> (8 * i)));
+}
+
+TraceReader::TraceReader(std::istream& input)
+    : input_(input)
+{
+    char magic[sizeof(TRACE_MAGIC)];
+    if (!input_.read(magic, sizeof(magic)) || std::memcmp(magic, TRACE_MAGIC, sizeof(magic)) != 0)
+        throw TraceFormatException("TraceReader: not a sheet trace");
+    version_ = ReadByte();
+    if (version_ < 1 || version_ > TRACE_VERSION)
+        throw TraceFormatException("TraceReader: unsupported trace version");
+}
+
+bool TraceReader::Read(TraceRecord& record)
+{
+    const int first = input_.get();
+    if (first == std::istream::traits_type::eof())
+        return false;
+
+    const uint8_t op = static_cast<uint8_t>(first) & ~FAILED_FLAG;
+    if (op < static_cast<uint8_t>(TraceOp::SET_CELL) || op > static_cast<uint8_t>(TraceOp::PRINT_TEXTS))
+        throw TraceFormatException("TraceReader: unknown operation");
+    record.op = static_cast<TraceOp>(op);
+    record.failed = (static_cast<uint8_t>(first) & FAILED_FLAG) != 0;
+    record.text.clear();
+    record.value.reset();
+    record.output_size = 0;
+    record.output_hash = 0;
+    record.output_floatfield = {};
+    record.output_precision = 6;
+
+    if (HasPosition(record.op))
+    {
+        auto read_coordinate = [this](int last) {
+            const int64_t delta = UnZigZag(ReadVarint());
+            if (delta < int64_t(INT32_MIN) - last || delta > int64_t(INT32_MAX) - last)
+                throw TraceFormatException("TraceReader: position out of range");
+            return static_cast<int>(last + delta);
+        };
+        const int row = read_coordinate(last_pos_.row);
+        last_pos_ = { row, read_coordinate(last_pos_.col) };
+    }
+    record.pos = last_pos_;
+    record.duration = std::chrono::nanoseconds(static_cast<int64_t>(ReadVarint()));
+
+    auto read_text = [this](std::string& text) {
+        const uint64_t size = ReadVarint();
+        if (size > MAX_TEXT_SIZE)
+            throw TraceFormatException("TraceReader: text too long");
+        text.resize(size);
+        if (!input_.read(text.data(), static_cast<std::streamsize>(size)))
+            throw TraceFormatException("TraceReader: truncated trace");
+    };
+
+    if (record.op == TraceOp::SET_CELL)
+        read_text(record.text);
+    if (record.failed)
+        return true;
+
+    switch (record.op)
+    {
+    case TraceOp::SET_CELL:
+    case TraceOp::CLEAR_CELL:
+        break;
+    case TraceOp::GET_VALUE:
+        switch (ReadByte())
+        {
+        case STRING_VALUE:
+        {
+            std::string text;
+            read_text(text);
+            record.value = std::move(text);
+            break;
+        }
+        case NUMBER_VALUE:
+        {
+            const uint64_t bits = ReadFixed();
+            double number;
+            std::memcpy(&number, &bits, sizeof(number));
+            record.value = number;
+            break;
+        }
+        case ERROR_VALUE:
+        {
+            const uint8_t category = ReadByte();
+            if (category > static_cast<uint8_t>(FormulaError::Category::Div0))
+                throw TraceFormatException("TraceReader: unknown error category");
+            record.value = FormulaError(static_cast<FormulaError::Category>(category));
+            break;
+        }
+        case NO_CELL:
+            break;
+        default:
+            throw TraceFormatException("TraceReader: unknown value type");
+        }
+        break;
+    case TraceOp::PRINT_VALUES:
+    case TraceOp::PRINT_TEXTS:
+        if (version_ >= 2)
+        {
+            record.output_floatfield = DecodeFloatfield(ReadByte());
+            const uint64_t precision = ReadVarint();
+            if (precision > MAX_TEXT_SIZE)
+                throw TraceFormatException("TraceReader: number precision is too large");
+            record.output_precision = static_cast<std::streamsize>(precision);
+        }
+        record.output_size = ReadVarint();
+        record.output_hash = ReadFixed();
+        break;
+    }
+    return true;
+}
+
+uint8_t TraceReader::ReadByte()
+{
+    const int byte = input_.get();
+    if (byte == std::istream::traits_type::eof())
+        throw TraceFormatException("TraceReader: truncated trace");
+    return static_cast<uint8_t>(byte);
+}
+
+uint64_t TraceReader::ReadVarint()
+{
+    uint64_t value = 0;
+    for (int shift = 0; shift < 64; shift += 7)
+    {
+        const uint8_t byte = ReadByte();
+        value |= uint64_t(byte & 0x7F) << shift;
+        if ((byte & 0x80) == 0)
+            return value;
+    }
+    throw TraceFormatException("TraceReader: malformed varint");
+}
+
+uint64_t TraceReader::ReadFixed()
+{
+    uint64_t value = 0;
+    for (int i = 0; i < 8; ++i)
+        value |= uint64_t(ReadByte()) << (8 * i);
+    return value;
+}
+
+// Ячейка, полученная через RecordingSheet: записывает чтения значения
+class RecordingSheet::RecordingCell : public CellInterface
+{
+public:
+    RecordingCell(const RecordingSheet& sheet, Position pos)
+        : sheet_(sheet)
+        , pos_(pos)
+    {
+    }
+
+    Value GetValue() const override
+    {
+        TraceRecord record;
+        record.op = TraceOp::GET_VALUE;
+        record.pos = pos_;
+        Value value;
+        sheet_.Record(record, [&] {
+            if (const CellInterface* cell = std::as_const(sheet_.sheet_).GetCell(pos_))
+                record.value = value = cell->GetValue();
+        });
+        return value;
+    }
+
+    std::string GetText() const override
+    {
+        const CellInterface* cell = std::as_const(sheet_.sheet_).GetCell(pos_);
+        return cell ? cell->GetText() : std::string();
+    }
+
+    std::vector<Position> GetReferencedCells() const override
+    {
+        const CellInterface* cell = std::as_const(sheet_.sheet_).GetCell(pos_);
+        return cell ? cell->GetReferencedCells() : std::vector<Position>();
+    }
+
+private:
+    const RecordingSheet& sheet_;
+    Position              pos_;
+};
+
+RecordingSheet::RecordingSheet(SheetInterface& sheet, std::ostream& trace)
+    : sheet_(sheet)
+    , writer_(trace)
+{
+}
+
+RecordingSheet::~RecordingSheet() = default;
+
+template <typename Operation>
+void RecordingSheet::Record(TraceRecord& record, Operation&& operation) const
+{
+    const auto start = std::chrono::steady_clock::now();
+    try
+    {
+        operation();
+    }
+    catch (...)
+    {
+        record.failed = true;
+        record.duration = std::chrono::steady_clock::now() - start;
+        writer_.Write(record);
+        throw;
+    }
+    record.duration = std::chrono::steady_clock::now() - start;
+    writer_.Write(record);
+}
+
+void RecordingSheet::SetCell(Position pos, std::string text)
+{
+    TraceRecord record;
+    record.op = TraceOp::SET_CELL;
+    record.pos = pos;
+    record.text = text;
+    Record(record, [&] { sheet_.SetCell(pos, std::move(text)); });
+}
+
+const CellInterface* RecordingSheet::GetCell(Position pos) const
+{
+    if (!std::as_const(sheet_).GetCell(pos))
+        return nullptr;
+    auto& cell = cells_[pos];
+    if (!cell)
+        cell = std::make_unique<RecordingCell>(*this, pos);
+    return cell.get();
+}
+
+CellInterface* RecordingSheet::GetCell(Position pos)
+{
+    return const_cast<CellInterface*>(std::as_const(*this).GetCell(pos));
+}
+
+void RecordingSheet::ClearCell(Position pos)
+{
+    TraceRecord record;
+    record.op = TraceOp::CLEAR_CELL;
+    record.pos = pos;
+    Record(record, [&] { sheet_.ClearCell(pos); });
+}
+
+Size RecordingSheet::GetPrintableSize() const
+{
+    return sheet_.GetPrintableSize();
+}
+
+void RecordingSheet::PrintValues(std::ostream& output) const
+{
+    Print(output, TraceOp::PRINT_VALUES);
+}
+
+void RecordingSheet::PrintTexts(std::ostream& output) const
+{
+    Print(output, TraceOp::PRINT_TEXTS);
+}
+
+void RecordingSheet::Print(std::ostream& output, TraceOp op) const
+{
+    // Текст считается по пути в поток вызывающего, без промежуточной копии. Промежуточный
+    // поток печатает с форматом и состоянием вызывающего, а ошибки записи переносятся
+    // в его состояние после печати, как при печати прямо в output
+    HashingBuffer buffer(output.rdbuf());
+    std::ostream hashing(&buffer);
+    hashing.copyfmt(output);
+    hashing.exceptions(std::ios_base::goodbit);
+    hashing.clear(output.rdstate());
+    TraceRecord record;
+    record.op = op;
+    record.output_floatfield = output.flags() & std::ios_base::floatfield;
+    record.output_precision = output.precision();
+    Record(record, [&] {
+        if (op == TraceOp::PRINT_VALUES)
+            sheet_.PrintValues(hashing);
+        else
+            sheet_.PrintTexts(hashing);
+        record.output_size = buffer.Size();
+        record.output_hash = buffer.Hash();
+    });
+    output.setstate(hashing.rdstate());
+}
+
+std::vector<ReplayedOp> ReplayTrace(std::istream& trace, SheetInterface& sheet, bool verify)
+{
+    TraceReader reader(trace);
+    HashingBuffer buffer(nullptr, verify);
+    std::ostream output(&buffer);
+
+    std::vector<ReplayedOp> replayed;
+    TraceRecord record;
+    while (reader.Read(record))
+    {
+        std::optional<CellInterface::Value> value;
+        bool failed = false;
+        buffer.Reset();
+        const auto start = std::chrono::steady_clock::now();
+        try
+        {
+            switch (record.op)
+            {
+            case TraceOp::SET_CELL:
+                sheet.SetCell(record.pos, std::move(record.text));
+                break;
+            case TraceOp::CLEAR_CELL:
+                sheet.ClearCell(record.pos);
+                break;
+            case TraceOp::GET_VALUE:
+                if (const CellInterface* cell = std::as_const(sheet).GetCell(record.pos))
+                    value = cell->GetValue();
+                break;
+            case TraceOp::PRINT_VALUES:
+                output.setf(record.output_floatfield, std::ios_base::floatfield);
+                output.precision(record.output_precision);
+                sheet.PrintValues(output);
+                break;
+            case TraceOp::PRINT_TEXTS:
+                output.setf(record.output_floatfield, std::ios_base::floatfield);
+                output.precision(record.output_precision);
+                sheet.PrintTexts(output);
+                break;
+            }
+        }
+        catch (...)
+        {
+            failed = true;
+        }
+        const auto elapsed = std::chrono::steady_clock::now() - start;
+
+        bool matched = true;
+        if (verify)
+        {
+            matched = failed == record.failed;
+            if (matched && !failed && record.op == TraceOp::GET_VALUE)
+                matched = value == record.value;
+            if (matched && !failed && (record.op == TraceOp::PRINT_VALUES || record.op == TraceOp::PRINT_TEXTS))
+                matched = buffer.Size() == record.output_size && buffer.Hash() == record.output_hash;
+        }
+        replayed.push_back({ record.op, record.duration, std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed), matched });
+    }
+    return replayed;
+}
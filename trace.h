@@ -0,0 +1,164 @@
+#pragma once
+
+#include "common.h"
+
+#include <chrono>
+#include <cstdint>
+#include <ios>
+#include <memory>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// Запись и воспроизведение трасс операций с таблицей. RecordingSheet оборачивает
+// рабочую таблицу и пишет каждую операцию в компактном двоичном формате, ReplayTrace
+// повторяет трассу на другой таблице с замером времени каждой операции и, если
+// нужно, сверяет прочитанные значения и напечатанный текст с записанными.
+//
+// Формат: заголовок "SSTR" и версия формата байтом, затем записи. Запись начинается
+// байтом операции; старший бит отмечает операцию, бросившую исключение. У операций
+// с ячейкой дальше идёт позиция как разность с позицией предыдущей такой записи
+// (zigzag varint строки и столбца). Затем у всех — время исходной операции в
+// наносекундах (varint) и данные операции:
+//   SET_CELL      текст ячейки (varint длины и байты)
+//   CLEAR_CELL    —
+//   GET_VALUE     тип значения байтом: 0 — строка (varint длины и байты), 1 — число
+//                 (8 байт IEEE 754, младшим байтом вперёд), 2 — ошибка (категория
+//                 байтом), 3 — ячейки уже нет
+//   PRINT_VALUES,
+//   PRINT_TEXTS   формат чисел потока: байт нотации (0 — по умолчанию, 1 — fixed,
+//                 2 — scientific, 3 — hexfloat) и точность (varint); затем длина
+//                 напечатанного текста (varint) и его хэш FNV-1a (8 байт). В трассах
+//                 версии 1 формата нет: печать шла с форматом потока по умолчанию
+// У бросивших операций нет значения и данных печати.
+
+enum class TraceOp : uint8_t
+{
+    SET_CELL = 1,
+    CLEAR_CELL,
+    GET_VALUE,
+    PRINT_VALUES,
+    PRINT_TEXTS,
+};
+
+inline constexpr TraceOp TRACE_OPS[] = {
+    TraceOp::SET_CELL, TraceOp::CLEAR_CELL, TraceOp::GET_VALUE, TraceOp::PRINT_VALUES, TraceOp::PRINT_TEXTS,
+};
+
+std::string_view ToString(TraceOp op);
+
+
+// Трасса повреждена или записана другой версией формата
+class TraceFormatException : public std::runtime_error
+{
+public:
+    using std::runtime_error::runtime_error;
+};
+
+
+struct TraceRecord
+{
+    TraceOp                  op = TraceOp::SET_CELL;
+    bool                     failed = false;     // Операция бросила исключение
+    Position                 pos;
+    std::chrono::nanoseconds duration{ 0 };     // Время исходной операции
+    std::string              text;               // SET_CELL
+    std::optional<CellInterface::Value> value;   // GET_VALUE; nullopt — ячейки уже нет
+    uint64_t                 output_size = 0;    // PRINT_*
+    uint64_t                 output_hash = 0;
+    // Формат чисел потока, в который шла печать PRINT_*: повтор печатает с ним же
+    std::ios_base::fmtflags  output_floatfield{};
+    std::streamsize          output_precision = 6;
+};
+
+
+class TraceWriter
+{
+public:
+    // Сразу пишет заголовок трассы
+    explicit TraceWriter(std::ostream& output);
+
+    void Write(const TraceRecord& record);
+
+private:
+    void WriteVarint(uint64_t value);
+    void WriteFixed(uint64_t value);
+
+    std::ostream& output_;
+    Position      last_pos_{ 0, 0 };
+    std::string   buffer_;           // Запись собирается целиком и пишется одним вызовом
+};
+
+
+class TraceReader
+{
+public:
+    // Читает и проверяет заголовок. Бросает TraceFormatException
+    explicit TraceReader(std::istream& input);
+
+    // Следующая запись; false в конце трассы. Бросает TraceFormatException
+    // для обрезанной или повреждённой записи
+    bool Read(TraceRecord& record);
+
+private:
+    uint8_t  ReadByte();
+    uint64_t ReadVarint();
+    uint64_t ReadFixed();
+
+    std::istream& input_;
+    uint8_t       version_ = 0;
+    Position      last_pos_{ 0, 0 };
+};
+
+
+// Хэш FNV-1a напечатанного текста, как в записях PRINT_*
+uint64_t HashTraceOutput(std::string_view text, uint64_t hash = 14695981039346656037ull);
+
+
+// Таблица, записывающая в трассу операции SetCell, ClearCell, PrintValues, PrintTexts
+// и чтения GetValue у ячеек, полученных через неё. Остальные вызовы передаются
+// таблице без записи. Ячейки, которые возвращает GetCell, живут, пока жива обёртка,
+// и каждый раз обращаются к текущей ячейке таблицы по позиции
+class RecordingSheet : public SheetInterface
+{
+public:
+    RecordingSheet(SheetInterface& sheet, std::ostream& trace);
+    ~RecordingSheet() override;
+
+    void SetCell(Position pos, std::string text) override;
+    const CellInterface* GetCell(Position pos) const override;
+    CellInterface* GetCell(Position pos) override;
+    void ClearCell(Position pos) override;
+    Size GetPrintableSize() const override;
+    void PrintValues(std::ostream& output) const override;
+    void PrintTexts(std::ostream& output) const override;
+
+private:
+    class RecordingCell;
+    friend class RecordingCell;
+
+    template <typename Operation>
+    void Record(TraceRecord& record, Operation&& operation) const;
+    void Print(std::ostream& output, TraceOp op) const;
+
+    SheetInterface&     sheet_;
+    mutable TraceWriter writer_;
+    mutable std::unordered_map<Position, std::unique_ptr<RecordingCell>, HashPosition> cells_;
+};
+
+
+// Время исходной и повторённой операции и результат сверки
+struct ReplayedOp
+{
+    TraceOp                  op;
+    std::chrono::nanoseconds recorded;
+    std::chrono::nanoseconds replayed;
+    bool                     matched;  // Исход, значение или напечатанный текст совпали с записанными
+};
+
+// Повторяет трассу на таблице sheet. При verify сверяет исход каждой операции, прочитанные
+// значения и напечатанный текст; без verify matched всегда true. Бросает TraceFormatException
+std::vector<ReplayedOp> ReplayTrace(std::istream& trace, SheetInterface& sheet, bool verify = false);
@@ -0,0 +1,227 @@
+#include "workbook.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <thread>
+
+namespace
+{
+    // Компоненты сильной связности графа (алгоритм Тарьяна). Компонента
+    // выдаётся после всех компонент, в которые из неё ведут рёбра
+    class ComponentSearch
+    {
+    public:
+        explicit ComponentSearch(const std::vector<std::vector<size_t>>& edges)
+            : edges_(edges)
+            , order_(edges.size(), NONE)
+            , low_(edges.size(), NONE)
+            , on_stack_(edges.size(), false)
+        {
+        }
+
+        std::vector<std::vector<size_t>> Run()
+        {
+            for (size_t v = 0; v < edges_.size(); ++v)
+            {
+                if (order_[v] == NONE)
+                    Visit(v);
+            }
+            return std::move(components_);
+        }
+
+    private:
+        static constexpr size_t NONE = SIZE_MAX;
+
+        void Visit(size_t v)
+        {
+            order_[v] = low_[v] = next_order_++;
+            stack_.push_back(v);
+            on_stack_[v] = true;
+
+            for (size_t w : edges_[v])
+            {
+                if (order_[w] == NONE)
+                {
+                    Visit(w);
+                    low_[v] = std::min(low_[v], low_[w]);
+                }
+                else if (on_stack_[w])
+                {
+                    low_[v] = std::min(low_[v], order_[w]);
+                }
+            }
+
+            if (low_[v] != order_[v])
+                return;
+            auto& component = components_.emplace_back();
+            size_t w = NONE;
+            do
+            {
+                w = stack_.back();
+                stack_.pop_back();
+                on_stack_[w] = false;
+                component.push_back(w);
+            } while (w != v);
+        }
+
+        const std::vector<std::vector<size_t>>& edges_;
+        std::vector<size_t>              order_;
+        std::vector<size_t>              low_;
+        std::vector<bool>                on_stack_;
+        std::vector<size_t>              stack_;
+        size_t                           next_order_ = 0;
+        std::vector<std::vector<size_t>> components_;
+    };
+}  // namespace
+
+
+Sheet& Workbook::AddSheet(std::string name)
+{
+    if (name.empty())
+        throw InvalidSheetNameException("Workbook::AddSheet: Empty sheet name");
+    if (indices_.count(name))
+        throw InvalidSheetNameException("Workbook::AddSheet: Duplicate sheet name " + name);
+
+    WarmUpFormulaParser();
+    indices_.emplace(name, sheets_.size());
+    sheets_.push_back({ std::make_unique<Sheet>(*this, std::move(name)) });
+    return *sheets_.back().sheet;
+}
+
+Sheet* Workbook::GetSheet(const std::string& name)
+{
+    auto it = indices_.find(name);
+    return it != indices_.end() ? sheets_[it->second].sheet.get() : nullptr;
+}
+
+const Sheet* Workbook::GetSheet(const std::string& name) const
+{
+    return const_cast<Workbook*>(this)->GetSheet(name);
+}
+
+size_t Workbook::GetSheetCount() const
+{
+    return sheets_.size();
+}
+
+Sheet& Workbook::GetSheet(size_t index)
+{
+    return *sheets_.at(index).sheet;
+}
+
+const Sheet& Workbook::GetSheet(size_t index) const
+{
+    return *sheets_.at(index).sheet;
+}
+
+void Workbook::Recalculate(size_t threads)
+{
+    if (threads == 0)
+        threads = std::max<size_t>(1, std::thread::hardware_concurrency());
+    // Ячейки группы читают ячейки и профилировщики листов других групп
+    auto profiled = [](const auto& entry) { return entry.sheet->GetProfiler() != nullptr; };
+    if (std::any_of(sheets_.begin(), sheets_.end(), profiled))
+        threads = 1;
+
+    auto waves = PlanRecalculation();
+    for (size_t wave = 0; wave < waves.size(); ++wave)
+    {
+        const auto& groups = waves[wave];
+        std::atomic<size_t> next_group{0};
+        auto work = [&]
+        {
+            for (size_t group = next_group++; group < groups.size(); group = next_group++)
+                CalculateGroup(groups[group], wave);
+        };
+
+        // Вызывающий поток тоже считает группы, поэтому одна группа обходится без потоков
+        std::vector<std::thread> workers;
+        for (size_t i = 1; i < std::min(threads, groups.size()); ++i)
+            workers.emplace_back(work);
+        work();
+        for (auto& worker : workers)
+            worker.join();
+    }
+}
+
+void Workbook::DeliverChanges()
+{
+    for (auto& entry : sheets_)
+        entry.sheet->DeliverChanges();
+}
+
+std::vector<SheetReport> Workbook::GetReports() const
+{
+    std::vector<SheetReport> reports;
+    reports.reserve(sheets_.size());
+    for (const auto& entry : sheets_)
+    {
+        SheetReport report;
+        report.name = entry.sheet->GetName();
+        report.stats = entry.sheet->GetStats();
+        report.stored_cells = entry.sheet->GetStoredCellCount();
+        report.recalculated_cells = entry.recalculated_cells;
+        report.recalc_time = entry.recalc_time;
+        report.recalc_wave = entry.recalc_wave;
+        reports.push_back(std::move(report));
+    }
+    return reports;
+}
+
+std::vector<std::vector<std::vector<size_t>>> Workbook::PlanRecalculation() const
+{
+    std::unordered_map<const Sheet*, size_t> index;
+    for (size_t i = 0; i < sheets_.size(); ++i)
+        index.emplace(sheets_[i].sheet.get(), i);
+
+    // Рёбра ведут от листа к листам, ячейки которых читают его формулы
+    std::vector<std::vector<size_t>> reads(sheets_.size());
+    for (size_t i = 0; i < sheets_.size(); ++i)
+    {
+        for (const Sheet* sheet : sheets_[i].sheet->GetReferencedSheets())
+            reads[i].push_back(index.at(sheet));
+    }
+
+    // Группа выдаётся после групп, которые она читает, поэтому их волны уже известны
+    auto groups = ComponentSearch(reads).Run();
+    std::vector<size_t> group_of(sheets_.size());
+    for (size_t group = 0; group < groups.size(); ++group)
+    {
+        for (size_t i : groups[group])
+            group_of[i] = group;
+    }
+
+    std::vector<size_t> wave_of(groups.size(), 0);
+    std::vector<std::vector<std::vector<size_t>>> waves;
+    for (size_t group = 0; group < groups.size(); ++group)
+    {
+        for (size_t i : groups[group])
+        {
+            for (size_t j : reads[i])
+            {
+                if (group_of[j] != group)
+                    wave_of[group] = std::max(wave_of[group], wave_of[group_of[j]] + 1);
+            }
+        }
+        std::sort(groups[group].begin(), groups[group].end());
+        if (waves.size() <= wave_of[group])
+            waves.resize(wave_of[group] + 1);
+        waves[wave_of[group]].push_back(std::move(groups[group]));
+    }
+    return waves;
+}
+
+void Workbook::CalculateGroup(const std::vector<size_t>& group, size_t wave)
+{
+    // Листы группы считаются в одном потоке: формула одного из них
+    // может вычислить ячейки других листов группы
+    for (size_t i : group)
+    {
+        Entry& entry = sheets_[i];
+        auto start = std::chrono::steady_clock::now();
+        entry.recalculated_cells = entry.sheet->CalculateAll();
+        entry.recalc_time = std::chrono::steady_clock::now() - start;
+        entry.recalc_wave = wave;
+    }
+}
@@ -0,0 +1,81 @@
+#pragma once
+
+#include "common.h"
+#include "sheet.h"
+#include "stats.h"
+
+#include <chrono>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+
+// Память и пересчёт одного листа книги
+struct SheetReport
+{
+    std::string              name;
+    SheetStats               stats;                   // Счётчики листа, в том числе оценка выделенной памяти
+    size_t                   stored_cells = 0;        // Ячейки, которые реально хранятся в таблице листа
+    size_t                   recalculated_cells = 0;  // Ячейки, посчитанные последним Recalculate
+    std::chrono::nanoseconds recalc_time{0};          // Время вычисления листа в последнем Recalculate
+    size_t                   recalc_wave = 0;         // Волна последнего Recalculate, в которой считался лист
+};
+
+
+// Книга из нескольких листов. Формула листа ссылается на ячейку другого листа
+// как Sheet2!A1 или 'Q1 2024'!A1; зависимости между листами хранятся в ячейках
+// так же, как внутри листа, и сбрасывают кэш зависимых ячеек на всех листах.
+// Листы книги работают только в режиме LAZY. Книга не потокобезопасна: методы
+// книги и её листов не должны вызываться одновременно
+class Workbook
+{
+public:
+    Workbook() = default;
+    Workbook(const Workbook&) = delete;
+    Workbook& operator=(const Workbook&) = delete;
+
+    // Добавляет пустой лист. Бросает InvalidSheetNameException для пустого или уже занятого имени
+    Sheet& AddSheet(std::string name);
+
+    // Лист с именем name или nullptr
+    Sheet* GetSheet(const std::string& name);
+    const Sheet* GetSheet(const std::string& name) const;
+
+    // Листы в порядке добавления
+    size_t GetSheetCount() const;
+    Sheet& GetSheet(size_t index);
+    const Sheet& GetSheet(size_t index) const;
+
+    // Вычисляет все ячейки книги без актуального значения. Взаимно зависимые листы
+    // объединяются в группы, группы — в волны: группа попадает в волну после всех
+    // групп, на ячейки которых ссылается. Группы одной волны не зависят друг от друга
+    // и считаются параллельно не более чем в threads потоках (0 — по числу ядер);
+    // ячейки предыдущих волн к этому моменту посчитаны и только читаются.
+    // Если профилируется хоть один лист, волны считаются в вызывающем потоке:
+    // стек кадров профилировщика не рассчитан на несколько потоков
+    void Recalculate(size_t threads = 0);
+
+    // Доставляет накопленные изменения подписчикам всех листов. Запись в лист
+    // вызывает её сама: обработчик листа может менять другие листы книги
+    void DeliverChanges();
+
+    // Отчёты по листам в порядке добавления
+    std::vector<SheetReport> GetReports() const;
+
+private:
+    struct Entry
+    {
+        std::unique_ptr<Sheet>   sheet;
+        size_t                   recalculated_cells = 0;
+        std::chrono::nanoseconds recalc_time{0};
+        size_t                   recalc_wave = 0;
+    };
+
+    // Группы взаимно зависимых листов по волнам пересчёта
+    std::vector<std::vector<std::vector<size_t>>> PlanRecalculation() const;
+    void CalculateGroup(const std::vector<size_t>& group, size_t wave);
+
+    std::vector<Entry>                      sheets_;
+    std::unordered_map<std::string, size_t> indices_;  // Номер листа по имени
+};
@@ -0,0 +1,314 @@
+#include "workload.h"
+
+#include <algorithm>
+#include <iterator>
+#include <random>
+
+namespace
+{
+    // Результат std::mt19937 задан стандартом, а распределения стандартной
+    // библиотеки — нет, поэтому числа в диапазон приводятся вручную
+    class Random
+    {
+    public:
+        explicit Random(uint32_t seed)
+            : engine_(seed)
+        {
+        }
+
+        int Below(int bound)
+        {
+            return static_cast<int>(engine_() % static_cast<uint32_t>(bound));
+        }
+
+        Position Pick(const std::vector<Position>& positions)
+        {
+            return positions[Below(static_cast<int>(positions.size()))];
+        }
+
+    private:
+        std::mt19937 engine_;
+    };
+
+    class Builder
+    {
+    public:
+        explicit Builder(const WorkloadParams& params)
+            : rows_(std::clamp(params.rows, 1, int(Position::MAX_ROWS)))
+            , cols_(std::clamp(params.cols, 1, int(Position::MAX_COLS)))
+            , depth_(std::clamp(params.depth, 1, rows_))
+            , fan_(std::max(params.fan, 1))
+            , random_(params.seed)
+        {
+        }
+
+        Workload Build(WorkloadShape shape)
+        {
+            workload_.cells.reserve(static_cast<size_t>(rows_) * cols_);
+            switch (shape)
+            {
+            case WorkloadShape::CHAIN:
+                BuildChain();
+                break;
+            case WorkloadShape::FAN_IN:
+                BuildFanIn();
+                break;
+            case WorkloadShape::FAN_OUT:
+                BuildFanOut();
+                break;
+            case WorkloadShape::DIAMOND:
+                BuildDiamond();
+                break;
+            case WorkloadShape::RANDOM_DAG:
+                BuildRandomDag();
+                break;
+            case WorkloadShape::TEXT:
+                BuildText();
+                break;
+            case WorkloadShape::ERRORS:
+                BuildErrors();
+                break;
+            }
+            return std::move(workload_);
+        }
+
+    private:
+        void AddInput(Position pos)
+        {
+            workload_.cells.emplace_back(pos, std::to_string(random_.Below(100)));
+            workload_.inputs.push_back(pos);
+        }
+
+        void Add(Position pos, std::string text)
+        {
+            workload_.cells.emplace_back(pos, std::move(text));
+        }
+
+        // Среднее ячеек: значения не растут с глубиной графа
+        static std::string Average(const std::vector<Position>& refs)
+        {
+            std::string text = "=(";
+            for (size_t i = 0; i < refs.size(); ++i)
+            {
+                if (i > 0)
+                    text += '+';
+                text += refs[i].ToString();
+            }
+            return text + ")/" + std::to_string(refs.size());
+        }
+
+        void BuildChain()
+        {
+            for (int row = 0; row < rows_; ++row)
+            {
+                for (int col = 0; col < cols_; ++col)
+                {
+                    if (row == 0)
+                        AddInput({ row, col });
+                    else
+                        Add({ row, col }, "=" + Position{ row - 1, col }.ToString() + "+1");
+                }
+            }
+        }
+
+        void BuildFanIn()
+        {
+            for (int row = 0; row < rows_; ++row)
+            {
+                AddInput({ row, 0 });
+                for (int col = 1; col < cols_; ++col)
+                {
+                    std::vector<Position> refs;
+                    for (int i = 0; i < fan_; ++i)
+                        refs.push_back({ random_.Below(rows_), 0 });
+                    Add({ row, col }, Average(refs));
+                }
+            }
+        }
+
+        void BuildFanOut()
+        {
+            AddInput({ 0, 0 });
+            for (int row = 0; row < rows_; ++row)
+            {
+                for (int col = row == 0 ? 1 : 0; col < cols_; ++col)
+                    Add({ row, col }, "=A1*" + std::to_string(random_.Below(10) + 1));
+            }
+        }
+
+        void BuildDiamond()
+        {
+            for (int row = 0; row < rows_; ++row)
+            {
+                for (int col = 0; col < cols_; ++col)
+                {
+                    if (row == 0)
+                        AddInput({ row, col });
+                    else
+                        Add({ row, col }, Average({ { row - 1, col }, { row - 1, (col + 1) % cols_ } }));
+                }
+            }
+        }
+
+        void BuildRandomDag()
+        {
+            // Строки делятся на depth уровней; уровень 0 — исходные числа. Первая ссылка
+            // формулы ведёт на предыдущий уровень, остальные — на любой более ранний,
+            // поэтому самый длинный путь проходит все уровни
+            std::vector<int> level_start{ 0 };
+            for (int row = 1; row < rows_; ++row)
+            {
+                if (static_cast<long long>(row) * depth_ / rows_ != static_cast<long long>(row - 1) * depth_ / rows_)
+                    level_start.push_back(row);
+            }
+            level_start.push_back(rows_);
+
+            for (size_t level = 0; level + 1 < level_start.size(); ++level)
+            {
+                for (int row = level_start[level]; row < level_start[level + 1]; ++row)
+                {
+                    for (int col = 0; col < cols_; ++col)
+                    {
+                        if (level == 0)
+                        {
+                            AddInput({ row, col });
+                            continue;
+                        }
+                        const int previous = level_start[level - 1];
+                        const int current = level_start[level];
+                        std::vector<Position> refs{ { previous + random_.Below(current - previous), random_.Below(cols_) } };
+                        for (int i = 1; i < fan_; ++i)
+                            refs.push_back({ random_.Below(current), random_.Below(cols_) });
+                        Add({ row, col }, Average(refs));
+                    }
+                }
+            }
+        }
+
+        void BuildText()
+        {
+            static const char* const WORDS[] = { "alpha", "beta", "gamma", "delta", "total", "note", "n/a" };
+            for (int row = 0; row < rows_; ++row)
+            {
+                for (int col = 0; col < cols_; ++col)
+                {
+                    const int kind = random_.Below(10);
+                    if (kind < 6)
+                        Add({ row, col }, std::string(WORDS[random_.Below(static_cast<int>(std::size(WORDS)))]) + ' ' + std::to_string(row));
+                    else if (kind == 6)
+                        Add({ row, col }, "'=" + std::string(WORDS[random_.Below(static_cast<int>(std::size(WORDS)))]));
+                    else if (kind < 9 || workload_.inputs.empty())
+                        AddInput({ row, col });
+                    else
+                        Add({ row, col }, "=" + random_.Pick(workload_.inputs).ToString() + "*2");
+                }
+            }
+        }
+
+        void BuildErrors()
+        {
+            // Ошибки деления на ноль и чтения текста как числа; формулы, читающие
+            // другие формулы, распространяют их ошибки
+            std::vector<Position> texts;
+            std::vector<Position> formulas;
+            for (int row = 0; row < rows_; ++row)
+            {
+                for (int col = 0; col < cols_; ++col)
+                {
+                    const Position pos{ row, col };
+                    const int kind = random_.Below(8);
+                    if (kind == 0)
+                    {
+                        Add(pos, "=" + std::to_string(random_.Below(10)) + "/0");
+                        formulas.push_back(pos);
+                    }
+                    else if (kind == 1 && !texts.empty())
+                    {
+                        Add(pos, "=" + random_.Pick(texts).ToString() + "+1");
+                        formulas.push_back(pos);
+                    }
+                    else if (kind < 3)
+                    {
+                        Add(pos, "n/a");
+                        texts.push_back(pos);
+                    }
+                    else if (kind < 5 && !formulas.empty())
+                    {
+                        Add(pos, "=" + random_.Pick(formulas).ToString() + "+1");
+                        formulas.push_back(pos);
+                    }
+                    else
+                    {
+                        AddInput(pos);
+                    }
+                }
+            }
+        }
+
+        const int rows_;
+        const int cols_;
+        const int depth_;
+        const int fan_;
+        Random    random_;
+        Workload  workload_;
+    };
+}
+
+std::string_view ToString(WorkloadShape shape)
+{
+    switch (shape)
+    {
+    case WorkloadShape::CHAIN:
+        return "chain";
+    case WorkloadShape::FAN_IN:
+        return "fan-in";
+    case WorkloadShape::FAN_OUT:
+        return "fan-out";
+    case WorkloadShape::DIAMOND:
+        return "diamond";
+    case WorkloadShape::RANDOM_DAG:
+        return "random-dag";
+    case WorkloadShape::TEXT:
+        return "text";
+    case WorkloadShape::ERRORS:
+        return "errors";
+    }
+    return {};
+}
+
+std::optional<WorkloadShape> ParseWorkloadShape(std::string_view name)
+{
+    for (WorkloadShape shape : WORKLOAD_SHAPES)
+    {
+        if (ToString(shape) == name)
+            return shape;
+    }
+    return std::nullopt;
+}
+
+Workload GenerateWorkload(const WorkloadParams& params)
+{
+    return Builder(params).Build(params.shape);
+}
+
+void LoadWorkload(SheetInterface& sheet, const Workload& workload)
+{
+    for (const auto& [pos, text] : workload.cells)
+        sheet.SetCell(pos, text);
+}
+
+std::vector<std::pair<Position, std::string>> GenerateEdits(const Workload& workload, size_t count, uint32_t seed)
+{
+    std::vector<std::pair<Position, std::string>> edits;
+    if (workload.inputs.empty())
+        return edits;
+
+    Random random(seed);
+    edits.reserve(count);
+    for (size_t i = 0; i < count; ++i)
+    {
+        const Position pos = random.Pick(workload.inputs);
+        edits.emplace_back(pos, std::to_string(random.Below(100)));
+    }
+    return edits;
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include "common.h"
+
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+// Генератор синтетических таблиц для макробенчмарков и нагрузочных проверок.
+// Таблица строится только из параметров и зерна, поэтому воспроизводится
+// одинаково на любой машине и не требует реальных данных.
+
+// Форма графа зависимостей синтетической таблицы
+enum class WorkloadShape
+{
+    CHAIN,       // длинные цепочки: каждая ячейка столбца ссылается на предыдущую
+    FAN_IN,      // каждая формула читает fan ячеек столбца исходных чисел
+    FAN_OUT,     // все формулы зависят от одной ячейки
+    DIAMOND,     // решётка ромбов: ячейка строки зависит от двух соседей предыдущей строки
+    RANDOM_DAG,  // случайный ациклический граф глубины depth с fan ссылками на формулу
+    TEXT,        // в основном тексты, немного чисел и простых формул
+    ERRORS,      // формулы с ошибками и их распространением по зависимым ячейкам
+};
+
+inline constexpr WorkloadShape WORKLOAD_SHAPES[] = {
+    WorkloadShape::CHAIN, WorkloadShape::FAN_IN, WorkloadShape::FAN_OUT, WorkloadShape::DIAMOND,
+    WorkloadShape::RANDOM_DAG, WorkloadShape::TEXT, WorkloadShape::ERRORS,
+};
+
+// Имена форм для командной строки: chain, fan-in, fan-out, diamond, random-dag, text, errors
+std::string_view ToString(WorkloadShape shape);
+std::optional<WorkloadShape> ParseWorkloadShape(std::string_view name);
+
+
+struct WorkloadParams
+{
+    WorkloadShape shape = WorkloadShape::CHAIN;
+    int           rows = 1000;
+    int           cols = 8;
+    int           depth = 16;   // Уровни формул случайного графа
+    int           fan = 8;      // Ссылок на формулу в FAN_IN и RANDOM_DAG
+    uint32_t      seed = 1;
+};
+
+
+// Синтетическая таблица: тексты ячеек в порядке записи и позиции исходных чисел,
+// от которых зависят формулы, — их меняют сценарии правок
+struct Workload
+{
+    std::vector<std::pair<Position, std::string>> cells;
+    std::vector<Position>                         inputs;
+};
+
+// Строит таблицу по параметрам. Параметры приводятся к допустимым: не больше
+// Position::MAX_ROWS строк и Position::MAX_COLS столбцов, не меньше одной строки и одного столбца
+Workload GenerateWorkload(const WorkloadParams& params);
+
+// Записывает ячейки таблицы через SetCell
+void LoadWorkload(SheetInterface& sheet, const Workload& workload);
+
+// Шторм правок: count новых чисел для случайных исходных ячеек таблицы
+std::vector<std::pair<Position, std::string>> GenerateEdits(const Workload& workload, size_t count, uint32_t seed);